@@ -5,6 +5,7 @@ ifeq ($(TARGET_USE_DROIDBOOT),true)
 
 LOCAL_SRC_FILES := \
 	aboot.c \
+	blkdev.c \
 	fastboot.c \
 	util.c \
 	droidboot.c \
@@ -12,6 +13,17 @@ LOCAL_SRC_FILES := \
 	graphics.c \
 	events.c \
 	resources.c \
+	ring.c \
+	pipeline.c \
+	xxhash.c \
+	lz4.c \
+	zstd.c \
+	usb_ffs.c \
+	finalize.c \
+	blockmap.c \
+	patch.c \
+	digest.c \
+	writer.c \
 
 LOCAL_CFLAGS := -DDEVICE_NAME=\"$(TARGET_BOOTLOADER_BOARD_NAME)\" \
 	-W -Wall -Wno-unused-parameter -Werror
@@ -24,14 +36,16 @@ endif
 
 LOCAL_MODULE := droidboot
 LOCAL_MODULE_TAGS := eng
-LOCAL_SHARED_LIBRARIES := liblog libext4_utils libz libcutils
+LOCAL_SHARED_LIBRARIES := liblog libext4_utils libz libcutils libext2fs
 LOCAL_STATIC_LIBRARIES += libpng libpixelflinger_static libenc
+LOCAL_STATIC_LIBRARIES += libapplypatch libmtdutils libmincrypt libbz
 LOCAL_STATIC_LIBRARIES += $(TARGET_DROIDBOOT_LIBS) $(TARGET_DROIDBOOT_EXTRA_LIBS)
 LOCAL_C_INCLUDES += bootable/recovery \
 		    external/zlib \
 		    external/libpng \
 		    system/core/libsparse \
 		    system/core/libsparse/include \
+		    external/e2fsprogs/lib \
 
 # Each library in TARGET_DROIDBOOT_LIBS should have a function
 # named "<libname>_init()".  Here we emit a little C function that
@@ -29,10 +29,14 @@
  * SUCH DAMAGE.
  */
 
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -52,7 +56,13 @@
 #include <sparse_format.h>
 #include <sparse/sparse.h>
 
+#include "blkdev.h"
+#include "blockmap.h"
+#include "digest.h"
 #include "fastboot.h"
+#include "finalize.h"
+#include "patch.h"
+#include "writer.h"
 #include "droidboot.h"
 #include "droidboot_util.h"
 #include "droidboot_plugin.h"
@@ -149,26 +159,51 @@ int aboot_register_oem_cmd(char *key, oem_func callback)
 	return aboot_register_cmd(oem_cmds, key, callback);
 }
 
-/* Erase a named partition by creating a new empty partition on top of
- * its device node. No parameters. */
+/* Erase a named partition: ext4 partitions get a new empty filesystem,
+ * others are discarded so that they read back as zeroes. Parameters
+ * follow the name as for flash:
+ *
+ * secure     : Use secure discard, so that the old data can't be
+ *              recovered from the device either
+ *
+ * lazy       : (ext4 only) Format with mke2fs, leaving the inode tables
+ *              to be initialized by the kernel after the first mount.
+ *              Can't be combined with secure.
+ */
 static void cmd_erase(char *part_name, void *data, unsigned sz)
 {
+	struct flash_target tgt;
 	Volume *vol;
+	int ret;
 
 	pr_info("%s: %s\n", __func__, part_name);
 
-	vol = volume_for_name(part_name);
+	process_target(part_name, &tgt);
+	vol = volume_for_name(tgt.name);
 	if (vol == NULL) {
 		fastboot_fail("unknown partition name");
-		return;
+		goto out;
 	}
 
-	pr_debug("Erasing %s.\n", part_name);
-	if (erase_partition(vol))
+	if (hashmapContainsKey(tgt.params, "lazy") &&
+			hashmapContainsKey(tgt.params, "secure")) {
+		fastboot_fail("lazy and secure can't be combined");
+		goto out;
+	}
+
+	pr_debug("Erasing %s.\n", tgt.name);
+	if (hashmapContainsKey(tgt.params, "lazy"))
+		ret = format_partition_lazy(vol);
+	else if (hashmapContainsKey(tgt.params, "secure"))
+		ret = secure_erase_partition(vol);
+	else
+		ret = erase_partition(vol);
+	if (ret)
 		fastboot_fail("Can't erase partition");
 	else
 		fastboot_okay("");
-
+out:
+	hashmapFree(tgt.params);
 }
 
 
@@ -229,12 +264,153 @@ static int cmd_flash_update(Hashmap *params, void *data, unsigned sz)
  *
  * offset=    : Write the image to the destination at a designated byte offset
  *              from the beginning of the device node. Suffixes "G", "M",
- *              and "K" are recognized.
+ *              and "K" are recognized; anything else after the number
+ *              fails the command.
  *
  * type=      : Supported values are:
  *              'raw' Raw image (default)
  *              'gzip' Raw image compressed with gzip
+ *              'lz4' Raw image in LZ4 frame format
+ *              'zstd' Raw image compressed with Zstandard
+ *              'blocks' Changed extents only, made by the host from the
+ *              partition's "oem blockmap" manifest (see blockmap.h)
+ *              'bsdiff' bsdiff patch against what is on the partition
+ *              'imgdiff' imgdiff patch, for images with gzip streams
+ *              such as boot.img
+ *
+ * source-size=, source-sha1= : For 'bsdiff' and 'imgdiff', the size and
+ *              SHA-1 of the partition contents (from offset=) the patch
+ *              applies to. Nothing is written unless they match.
+ *
+ * target-size=, target-sha1= : For 'bsdiff' and 'imgdiff', the size of
+ *              the patched image and optionally its SHA-1, which is checked
+ *              before the image is written.
+ *
+ * sha256=    : SHA-256 of the downloaded image, in hex. Nothing is written
+ *              unless the download matches it. The digest is computed
+ *              while the data arrives; see "getvar:download-sha256".
+ *
+ * engine=    : Block write engine: 'buffered' (default), 'direct' for
+ *              O_DIRECT writes of erase block sized chunks, or 'aio' to
+ *              keep several of them in flight. Overrides the volume's
+ *              engine= option in recovery.fstab.
+ *
+ * qdepth=    : Number of writes the 'aio' engine keeps in flight
+ *
+ * regions=   : Number of regions of a raw or sparse image written
+ *              concurrently, 1 to 16. Defaults to the volume's regions=
+ *              option, or 4 on solid state disks and 1 otherwise. The
+ *              throughput of the latest flash with each number of regions
+ *              is in "getvar:write-rates".
+ *
+ * skip-unchanged : Read the destination back and only write the 4 KiB
+ *              blocks that differ from the image, to save time and eMMC
+ *              wear when re-flashing devices that are mostly up to date.
+ *              The OKAY reports the share of the image that was skipped.
+ *
+ * verify     : Read everything written back with O_DIRECT and check it
+ *              against the image, on a thread trailing the writes. Fails
+ *              with the offset of the first 4 KiB block that differs.
+ *
+ * deferred   : Send the OKAY as soon as the data is on disk and run the
+ *              ext4 filesystem checks in the background. Use "oem
+ *              finalize-wait" or "getvar:finalize-status" to get their
+ *              results; they are also waited for before the partition is
+ *              written or mounted again, and before rebooting.
  */
+static int parse_size(Hashmap *params, char *key, uint64_t *size)
+{
+	char *str, *end;
+
+	str = hashmapGet(params, key);
+	if (!str)
+		return -1;
+	*size = strtoull(str, &end, 0);
+	return (end == str || *end) ? -1 : 0;
+}
+
+/* Parse a device offset or length, with an optional K, M or G suffix.
+ * Fails on anything else after the number, or past what off64_t holds. */
+static int parse_offset(const char *str, uint64_t *val)
+{
+	uint64_t v, multiplier = 1;
+	char *end;
+
+	if (!isdigit((unsigned char)*str))
+		return -1;
+	errno = 0;
+	v = strtoull(str, &end, 0);
+	if (errno)
+		return -1;
+	switch (*end) {
+	case 'G':
+		multiplier <<= 10;
+		/* fall through */
+	case 'M':
+		multiplier <<= 10;
+		/* fall through */
+	case 'K':
+		multiplier <<= 10;
+		end++;
+	}
+	if (*end || v > (uint64_t)INT64_MAX / multiplier)
+		return -1;
+	*val = v * multiplier;
+	return 0;
+}
+
+/* Apply a bsdiff or imgdiff patch to what is on the partition at offset
+ * and write the result back there. The source has to be checked whole
+ * before anything is written, and bsdiff needs random access to it, so
+ * the patched image is built in memory and flashed in one go. */
+static int flash_patch(Volume *vol, Hashmap *params, int type, void *data,
+		unsigned sz, off64_t offset, const char **why)
+{
+	struct patch_spec spec;
+	unsigned char *out;
+	char *str;
+	int ret;
+
+	memset(&spec, 0, sizeof(spec));
+	spec.offset = offset;
+	if (parse_size(params, "source-size", &spec.source_size) ||
+			parse_size(params, "target-size", &spec.target_size)) {
+		*why = "source-size and target-size are required";
+		return -1;
+	}
+	if (!spec.source_size || !spec.target_size) {
+		*why = "source-size and target-size can't be 0";
+		return -1;
+	}
+	str = hashmapGet(params, "source-sha1");
+	if (!str || patch_parse_sha1(str, spec.source_sha1)) {
+		*why = "source-sha1 is required";
+		return -1;
+	}
+	if ( (str = hashmapGet(params, "target-sha1")) ) {
+		if (patch_parse_sha1(str, spec.target_sha1)) {
+			*why = "bad target-sha1";
+			return -1;
+		}
+		spec.has_target_sha1 = 1;
+	}
+
+	if (patch_check_source(vol->device, &spec)) {
+		*why = "source doesn't match source-sha1";
+		return -1;
+	}
+	if (patch_apply(vol->device, type, data, sz, &spec, &out)) {
+		*why = "Can't apply patch";
+		return -1;
+	}
+	pr_debug("patched %llu bytes into %llu\n",
+			(unsigned long long)spec.source_size,
+			(unsigned long long)spec.target_size);
+	ret = named_file_write(vol->device, out, spec.target_size, offset, 0);
+	patch_free(out, &spec);
+	return ret;
+}
+
 static void cmd_flash(char *targetspec, void *data, unsigned sz)
 {
 	struct flash_target tgt;
@@ -244,12 +420,38 @@ static void cmd_flash(char *targetspec, void *data, unsigned sz)
 
 	int action;
 	char *imgtype;
-	off_t offset = 0;
+	off64_t offset = 0;
+	uint64_t val;
 	char *offsetstr;
+	char *str;
+	int engine;
+	int depth;
+	int regions;
+	int skip;
+	int verify;
+	uint64_t total, skipped;
+	int64_t bad;
+	char msg[48];
+	const char *why = "Can't write data to target device";
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	char hex[2 * SHA256_DIGEST_SIZE + 1];
 
 	process_target(targetspec, &tgt);
 	pr_verbose("data size %u\n", sz);
 
+	if ( (str = hashmapGet(tgt.params, "sha256")) ) {
+		if (fastboot_download_sha256(digest)) {
+			fastboot_fail("no digest of the download");
+			goto out;
+		}
+		digest_format(digest, SHA256_DIGEST_SIZE, hex);
+		if (strcasecmp(hex, str)) {
+			pr_error("download sha256 %s, expected %s\n", hex, str);
+			fastboot_fail("download doesn't match sha256");
+			goto out;
+		}
+	}
+
 	if ( (cb = hashmapGet(flash_cmds, tgt.name)) ) {
 		/* Use our table of flash functions registered by platform
 		 * specific plugin libraries */
@@ -275,27 +477,49 @@ static void cmd_flash(char *targetspec, void *data, unsigned sz)
 		imgtype = "raw";
 
 	if ( (offsetstr = hashmapGet(tgt.params, "offset")) ) {
-		off_t multiplier = 1;
-
-		switch (offsetstr[strlen(offsetstr) - 1]) {
-		case 'G':
-			multiplier *= 1024;
-			/* fall through */
-		case 'M':
-			multiplier *= 1024;
-			/* fall through */
-		case 'K':
-			multiplier *= 1024;
-			offsetstr[strlen(offsetstr) - 1] = '\0';
+		if (parse_offset(offsetstr, &val)) {
+			fastboot_fail("bad offset");
+			goto out;
 		}
+		offset = val;
+	}
 
-		offset = atol(offsetstr) * multiplier;
+	engine = vol->write_engine;
+	depth = vol->write_depth;
+	if ( (str = hashmapGet(tgt.params, "engine")) ) {
+		engine = write_engine_parse(str);
+		if (engine < 0) {
+			fastboot_fail("unknown write engine");
+			goto out;
+		}
+	}
+	if ( (str = hashmapGet(tgt.params, "qdepth")) )
+		depth = atoi(str);
+	regions = vol->write_regions;
+	if ( (str = hashmapGet(tgt.params, "regions")) ) {
+		regions = atoi(str);
+		if (regions < 1 || regions > WRITE_REGIONS_MAX) {
+			fastboot_fail("bad number of regions");
+			goto out;
+		}
 	}
 
 	if (!is_valid_blkdev(vol->device)) {
 		fastboot_fail("invalid destination node. partition disks?");
 		goto out;
 	}
+	finalize_discard(vol);
+	write_engine_select(engine, depth, regions);
+	skip = hashmapContainsKey(tgt.params, "skip-unchanged");
+	if (skip) {
+		write_skip_reset();
+		write_skip_select(1);
+	}
+	verify = hashmapContainsKey(tgt.params, "verify");
+	if (verify) {
+		write_verify_reset();
+		write_verify_select(1);
+	}
 	pr_debug("Writing %u bytes to %s at offset: %jd\n",
 				sz, vol->device, (intmax_t)offset);
 	if (!strcmp(imgtype, "raw")) {
@@ -313,33 +537,152 @@ static void cmd_flash(char *targetspec, void *data, unsigned sz)
 	} else if (!strcmp(imgtype, "gzip")) {
 		pr_debug("File type is gzipped raw image\n");
 		ret = named_file_write_decompress_gzip(vol->device, data, sz, offset, 0);
+	} else if (!strcmp(imgtype, "lz4")) {
+		pr_debug("File type is LZ4 compressed raw image\n");
+		ret = named_file_write_decompress_lz4(vol->device, data, sz, offset, 0);
+	} else if (!strcmp(imgtype, "blocks")) {
+		pr_debug("File type is changed blocks\n");
+		ret = named_file_write_blocks(vol->device, data, sz);
+	} else if (!strcmp(imgtype, "zstd")) {
+		pr_debug("File type is zstd compressed raw image\n");
+		ret = named_file_write_decompress_zstd(vol->device, data, sz, offset, 0);
+	} else if (!strcmp(imgtype, "bsdiff") || !strcmp(imgtype, "imgdiff")) {
+		pr_debug("File type is %s patch\n", imgtype);
+		ret = flash_patch(vol, tgt.params, strcmp(imgtype, "bsdiff") ?
+				PATCH_IMGDIFF : PATCH_BSDIFF, data, sz, offset, &why);
 	} else {
 		pr_debug("Unknown data type '%s'\n", imgtype);
 		ret = -1;
 	}
 
+	if (verify) {
+		write_verify_stats(&total, &bad);
+		if (bad >= 0) {
+			snprintf(msg, sizeof(msg), "verify failed at offset %lld",
+					(long long)bad);
+			why = msg;
+		} else if (!ret) {
+			pr_info("%s: read back %llu MiB\n", vol->device,
+					(unsigned long long)(total >> 20));
+		}
+	}
 	if (ret) {
-		fastboot_fail("Can't write data to target device");
+		fastboot_fail(why);
 		goto out;
 	}
-	sync();
 
 	pr_debug("wrote %u bytes to %s\n", sz, vol->device);
 
-	if (action) {
-		if (!strcmp(vol->fs_type, "ext4")) {
-			if (ext4_filesystem_checks(vol)) {
-				fastboot_fail("ext4 filesystem error");
-				goto out;
-			}
+	if (action && !strcmp(vol->fs_type, "ext4")) {
+		if (hashmapContainsKey(tgt.params, "deferred"))
+			ret = finalize_start(vol);
+		else
+			ret = ext4_filesystem_checks(vol);
+		if (ret) {
+			fastboot_fail("ext4 filesystem error");
+			goto out;
 		}
 	}
 
-	fastboot_okay("");
+	if (skip) {
+		write_skip_stats(&total, &skipped);
+		snprintf(msg, sizeof(msg), "skipped %.1f%% of %llu MiB",
+				total ? 100.0 * skipped / total : 0.0,
+				(unsigned long long)(total >> 20));
+		pr_info("%s: %s\n", vol->device, msg);
+		fastboot_okay(msg);
+	} else {
+		fastboot_okay("");
+	}
 out:
+	write_engine_select(WRITE_BUFFERED, 0, 0);
+	fastboot_release_download();
 	hashmapFree(tgt.params);
 }
 
+/* Streaming flash command: "flash-stream:<name>:<size>", with the size
+ * in hex as for download:. The image is written to the partition's device
+ * node while it is still being received instead of being staged in the
+ * download buffer first, so the USB transfer and the eMMC writes overlap.
+ * Only raw images are supported; sparse and compressed images still need
+ * to go through download: and flash:. */
+static void cmd_flash_stream(char *arg, void *data, unsigned sz)
+{
+	Volume *vol;
+	char *lenstr, *end;
+	unsigned long long len;
+	uint64_t size;
+	int fd;
+	int ret;
+
+	lenstr = strchr(arg, ':');
+	if (!lenstr) {
+		fastboot_fail("usage: flash-stream:<partition>:<size>");
+		return;
+	}
+	*lenstr++ = '\0';
+	errno = 0;
+	len = strtoull(lenstr, &end, 16);
+	if (errno || end == lenstr || *end || !len || len > UINT_MAX) {
+		fastboot_fail("invalid size");
+		return;
+	}
+
+	vol = volume_for_name(arg);
+	if (!vol) {
+		fastboot_fail(arg);
+		return;
+	}
+
+	if (!is_valid_blkdev(vol->device)) {
+		fastboot_fail("invalid destination node. partition disks?");
+		return;
+	}
+	finalize_discard(vol);
+	writeback_note_device(vol->device);
+
+	fd = open(vol->device, O_WRONLY);
+	if (fd < 0) {
+		pr_error("Can't open %s: %s\n", vol->device, strerror(errno));
+		fastboot_fail("Can't open target device");
+		return;
+	}
+	if (blkdev_size(fd, &size)) {
+		close(fd);
+		fastboot_fail("Can't get partition size");
+		return;
+	}
+	if (len > size) {
+		pr_error("%llu bytes don't fit in %s (%llu bytes)\n", len,
+				vol->device, (unsigned long long)size);
+		close(fd);
+		fastboot_fail("image too large for partition");
+		return;
+	}
+
+	pr_debug("Streaming %llu bytes to %s\n", len, vol->device);
+	ret = fastboot_download_to_fd(fd, len);
+	if (!ret && fsync(fd)) {
+		pr_perror("fsync");
+		ret = -1;
+	}
+	close(fd);
+
+	if (ret) {
+		fastboot_fail("Can't write data to target device");
+		return;
+	}
+	pr_debug("wrote %llu bytes to %s\n", len, vol->device);
+
+	if (!strcmp(vol->fs_type, "ext4")) {
+		if (ext4_filesystem_checks(vol)) {
+			fastboot_fail("ext4 filesystem error");
+			return;
+		}
+	}
+	fastboot_okay("");
+}
+
 static void cmd_oem(char *arg, void *data, unsigned sz)
 {
 	char *command, *saveptr, *str1;
@@ -399,26 +742,258 @@ out:
 	return;
 }
 
+static void report_finalize_failure(Volume *vol)
+{
+	char msg[64];
+
+	snprintf(msg, sizeof(msg), "%s: filesystem checks failed",
+			vol->mount_point);
+	fastboot_info(msg);
+}
+
+/* Wait for the checks of all "deferred" flashes; fails if any of them
+ * did, naming the partitions in INFO lines */
+static int oem_finalize_wait(int argc, char **argv)
+{
+	return finalize_wait_all(report_finalize_failure);
+}
+
+/* oem blockmap <partition> <blocksize>: compute (or fetch from /cache)
+ * the manifest of per-block digests of a partition, and stage it for the
+ * host's next upload command */
+static int oem_blockmap(int argc, char **argv)
+{
+	Volume *vol;
+	void *manifest;
+	size_t len;
+	char msg[48];
+
+	if (argc != 3) {
+		pr_error("usage: oem blockmap <partition> <blocksize>\n");
+		return -1;
+	}
+	vol = volume_for_name(argv[1]);
+	if (!vol) {
+		pr_error("unknown partition %s\n", argv[1]);
+		return -1;
+	}
+	if (!is_valid_blkdev(vol->device)) {
+		pr_error("invalid destination node. partition disks?\n");
+		return -1;
+	}
+	/* Hash what the checks will leave, not what they'll change */
+	if (finalize_wait(vol))
+		pr_info("finalize of %s had failed\n", vol->device);
+
+	if (blockmap_get(vol, strtoul(argv[2], NULL, 0), &manifest, &len))
+		return -1;
+	fastboot_stage_upload(manifest, len);
+	snprintf(msg, sizeof(msg), "%zu bytes staged for upload", len);
+	fastboot_info(msg);
+	return 0;
+}
+
+/* oem hash <partition> [offset] [length] [algo]: tree hash (see
+ * blockmap.h) of a partition, or of length bytes of it from offset, with
+ * sha256 (the default), xxh64 or crc32c. offset and length take the
+ * same K, M and G suffixes as flash offset=; a length of 0 means up to
+ * the end. The digest is sent in the OKAY, except for sha256 which doesn't
+ * fit in a response and comes as two INFO lines of 32 hex digits. */
+static int oem_hash(int argc, char **argv)
+{
+	Volume *vol;
+	uint64_t offset = 0, length = 0;
+	int algo = HASH_SHA256;
+	unsigned char digest[HASH_DIGEST_MAX];
+	char hex[2 * HASH_DIGEST_MAX + 1];
+	char half[HASH_DIGEST_MAX + 1];
+	size_t len;
+
+	if (argc < 2 || argc > 5) {
+		pr_error("usage: oem hash <partition> [offset] [length] [algo]\n");
+		return -1;
+	}
+	vol = volume_for_name(argv[1]);
+	if (!vol) {
+		pr_error("unknown partition %s\n", argv[1]);
+		return -1;
+	}
+	if (!is_valid_blkdev(vol->device)) {
+		pr_error("invalid destination node. partition disks?\n");
+		return -1;
+	}
+	if ((argc > 2 && parse_offset(argv[2], &offset)) ||
+			(argc > 3 && parse_offset(argv[3], &length))) {
+		pr_error("bad offset or length\n");
+		return -1;
+	}
+	if (argc > 4 && (algo = blockmap_hash_parse(argv[4])) < 0) {
+		pr_error("unknown hash %s\n", argv[4]);
+		return -1;
+	}
+	if (finalize_wait(vol))
+		pr_info("finalize of %s had failed\n", vol->device);
+
+	if (blockmap_hash(vol->device, offset, length, algo, digest))
+		return -1;
+	len = blockmap_hash_size(algo);
+	digest_format(digest, len, hex);
+	pr_info("%s: %s\n", vol->device, hex);
+	/* cmd_oem()'s own OKAY is dropped once this one is sent */
+	if (algo == HASH_SHA256) {
+		memcpy(half, hex, len);
+		half[len] = '\0';
+		fastboot_info(half);
+		fastboot_info(hex + len);
+		fastboot_okay("");
+	} else {
+		fastboot_okay(hex);
+	}
+	return 0;
+}
+
+/* oem fill <partition> <pattern>: fill a whole partition with a 32-bit
+ * pattern, e.g. 0xdeadbeef. Zero fills are offloaded to the device. */
+static int oem_fill(int argc, char **argv)
+{
+	Volume *vol;
+	uint64_t size;
+	uint32_t pattern;
+	char *end;
+	struct blk_writer bw;
+	int ret;
+
+	if (argc != 3) {
+		pr_error("usage: oem fill <partition> <pattern>\n");
+		return -1;
+	}
+	vol = volume_for_name(argv[1]);
+	if (!vol) {
+		pr_error("unknown partition %s\n", argv[1]);
+		return -1;
+	}
+	pattern = strtoul(argv[2], &end, 0);
+	if (*end) {
+		pr_error("bad pattern %s\n", argv[2]);
+		return -1;
+	}
+	if (!is_valid_blkdev(vol->device)) {
+		pr_error("invalid destination node. partition disks?\n");
+		return -1;
+	}
+	finalize_discard(vol);
+
+	if (blk_writer_open(&bw, vol->device, O_WRONLY, 0))
+		return -1;
+	ret = blkdev_size(bw.fd, &size);
+	if (!ret)
+		ret = blk_writer_fill(&bw, size, pattern);
+	if (blk_writer_close(&bw))
+		ret = -1;
+	return ret;
+}
+
+struct format_job {
+	Volume *vol;
+	pthread_t thread;
+	int started;
+	int ret;
+	double secs;
+};
+
+static void *format_thread(void *arg)
+{
+	struct format_job *job = arg;
+	double start = get_time();
+
+	job->ret = format_partition_lazy(job->vol);
+	job->secs = get_time() - start;
+	return NULL;
+}
+
+/* oem format-all: format every ext4 volume of the fstab at once, with
+ * format_partition_lazy(). Each volume's time is reported in an INFO
+ * line. */
+static int oem_format_all(int argc, char **argv)
+{
+	struct format_job *jobs;
+	Volume *vol;
+	char msg[64];
+	double start = get_time();
+	int count = 0;
+	int ret = 0;
+	int i, j;
+
+	for (i = 0; (vol = volume_at(i)); i++)
+		if (!strcmp(vol->fs_type, "ext4"))
+			count++;
+	if (!count) {
+		pr_error("no ext4 volumes\n");
+		return -1;
+	}
+
+	finalize_wait_all(NULL);
+
+	jobs = xmalloc(count * sizeof(*jobs));
+	for (i = 0, j = 0; (vol = volume_at(i)); i++) {
+		if (strcmp(vol->fs_type, "ext4"))
+			continue;
+		jobs[j].vol = vol;
+		jobs[j].started = !pthread_create(&jobs[j].thread, NULL,
+				format_thread, &jobs[j]);
+		if (!jobs[j].started)
+			format_thread(&jobs[j]);
+		j++;
+	}
+
+	for (j = 0; j < count; j++) {
+		if (jobs[j].started)
+			pthread_join(jobs[j].thread, NULL);
+		if (jobs[j].ret) {
+			snprintf(msg, sizeof(msg), "%s: failed",
+					jobs[j].vol->mount_point);
+			ret = -1;
+		} else {
+			snprintf(msg, sizeof(msg), "%s: %.1fs",
+					jobs[j].vol->mount_point,
+					jobs[j].secs);
+		}
+		pr_info("format %s\n", msg);
+		fastboot_info(msg);
+	}
+	free(jobs);
+
+	snprintf(msg, sizeof(msg), "formatted %d volumes in %.1fs", count,
+			get_time() - start);
+	pr_info("%s\n", msg);
+	fastboot_info(msg);
+	return ret;
+}
+
 static void cmd_boot(char *arg, void *data, unsigned sz)
 {
 	fastboot_fail("boot command stubbed on this platform!");
 }
 
+/* Only the devices written in this session need flushing; the mounted
+ * filesystems are synced when android_reboot() remounts them read-only */
 static void cmd_reboot(char *arg, void *data, unsigned sz)
 {
+	finalize_wait_all(NULL);
 	fastboot_okay("");
-	sync();
+	writeback_sync_devices();
 	pr_info("Rebooting!\n");
-	android_reboot(ANDROID_RB_RESTART, 0, 0);
+	android_reboot(ANDROID_RB_RESTART, ANDROID_RB_FLAG_NO_SYNC, 0);
 	pr_error("Reboot failed");
 }
 
 static void cmd_reboot_bl(char *arg, void *data, unsigned sz)
 {
+	finalize_wait_all(NULL);
 	fastboot_okay("");
-	sync();
+	writeback_sync_devices();
 	pr_info("Restarting Droidboot...\n");
-	android_reboot(ANDROID_RB_RESTART2, 0, "fastboot");
+	android_reboot(ANDROID_RB_RESTART2, ANDROID_RB_FLAG_NO_SYNC, "fastboot");
 	pr_error("Reboot failed");
 }
 
@@ -430,11 +1005,14 @@ void aboot_register_commands(void)
 	fastboot_register("reboot-bootloader", cmd_reboot_bl);
 	fastboot_register("erase:", cmd_erase);
 	fastboot_register("flash:", cmd_flash);
+	fastboot_register("flash-stream:", cmd_flash_stream);
 	fastboot_register("continue", cmd_reboot);
 
 	fastboot_publish("product", DEVICE_NAME);
 	fastboot_publish("kernel", "droidboot");
 	fastboot_publish("droidboot", DROIDBOOT_VERSION);
+	fastboot_publish_func("finalize-status", finalize_status);
+	fastboot_publish_func("write-rates", write_rates);
 
 	flash_cmds = hashmapCreate(8, strhash, strcompare);
 	oem_cmds = hashmapCreate(8, strhash, strcompare);
@@ -444,5 +1022,10 @@ void aboot_register_commands(void)
 	}
 
 	aboot_register_flash_cmd("update", cmd_flash_update);
+	aboot_register_oem_cmd("finalize-wait", oem_finalize_wait);
+	aboot_register_oem_cmd("fill", oem_fill);
+	aboot_register_oem_cmd("blockmap", oem_blockmap);
+	aboot_register_oem_cmd("hash", oem_hash);
+	aboot_register_oem_cmd("format-all", oem_format_all);
 
 }
@@ -0,0 +1,107 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "blkdev.h"
+#include "droidboot_ui.h"
+#include "droidboot_util.h"
+
+#define FILL_BUF_SIZE	(1024 * 1024)
+
+int blkdev_size(int fd, uint64_t *size)
+{
+	if (ioctl(fd, BLKGETSIZE64, size) < 0) {
+		pr_perror("BLKGETSIZE64");
+		return -1;
+	}
+	return 0;
+}
+
+int blkdev_discard(int fd, uint64_t offset, uint64_t len, int secure)
+{
+	uint64_t range[2];
+
+	range[0] = offset;
+	range[1] = len;
+	return ioctl(fd, secure ? BLKSECDISCARD : BLKDISCARD, range);
+}
+
+int blkdev_erase(int fd, uint64_t offset, uint64_t len, int secure)
+{
+	unsigned int zeroes = 0;
+
+	if (!blkdev_discard(fd, offset, len, secure)) {
+		if (!ioctl(fd, BLKDISCARDZEROES, &zeroes) && zeroes)
+			return 0;
+	} else if (secure) {
+		pr_info("secure discard failed (%s), overwriting\n",
+				strerror(errno));
+	} else {
+		pr_debug("discard failed (%s)\n", strerror(errno));
+	}
+	/* Make sure the range reads back as zeroes */
+	return blkdev_fill(fd, offset, len, 0);
+}
+
+int blkdev_zeroout(int fd, uint64_t offset, uint64_t len)
+{
+	uint64_t range[2];
+
+	range[0] = offset;
+	range[1] = len;
+	return ioctl(fd, BLKZEROOUT, range);
+}
+
+int blkdev_fill(int fd, uint64_t offset, uint64_t len, uint32_t pattern)
+{
+	uint32_t *buf;
+	size_t xfer;
+	unsigned i;
+	int ret = -1;
+
+	if (!pattern && !blkdev_zeroout(fd, offset, len))
+		return 0;
+
+	buf = xmalloc(FILL_BUF_SIZE);
+	for (i = 0; i < FILL_BUF_SIZE / sizeof(*buf); i++)
+		buf[i] = pattern;
+
+	if (lseek64(fd, offset, SEEK_SET) < 0) {
+		pr_perror("lseek64");
+		goto out;
+	}
+
+	while (len) {
+		xfer = (len > FILL_BUF_SIZE) ? FILL_BUF_SIZE : len;
+		if (write_all(fd, buf, xfer)) {
+			pr_perror("write");
+			goto out;
+		}
+		len -= xfer;
+	}
+	ret = 0;
+out:
+	free(buf);
+	return ret;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DROIDBOOT_BLKDEV_H
+#define DROIDBOOT_BLKDEV_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <linux/fs.h>
+
+/* Not all kernel headers we build against know about these */
+#ifndef BLKDISCARD
+#define BLKDISCARD		_IO(0x12, 119)
+#endif
+#ifndef BLKDISCARDZEROES
+#define BLKDISCARDZEROES	_IO(0x12, 124)
+#endif
+#ifndef BLKSECDISCARD
+#define BLKSECDISCARD		_IO(0x12, 125)
+#endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT		_IO(0x12, 127)
+#endif
+
+/* Size of the block device in bytes */
+int blkdev_size(int fd, uint64_t *size);
+
+/* Discard a byte range, or securely discard it (also purging any stale
+ * copies the device keeps) if secure is set. Returns -1 with errno set
+ * if the device or kernel can't do it. */
+int blkdev_discard(int fd, uint64_t offset, uint64_t len, int secure);
+
+/* Erase a byte range so that it reads back as zeroes, as cheaply as the
+ * device allows: discard if discarded blocks read back as zeroes,
+ * otherwise zero-out. With secure set, the range is securely discarded
+ * first. */
+int blkdev_erase(int fd, uint64_t offset, uint64_t len, int secure);
+
+/* Ask the device to write zeroes over a byte range. Returns -1 with
+ * errno set if the device or kernel can't do it. */
+int blkdev_zeroout(int fd, uint64_t offset, uint64_t len);
+
+/* Fill a byte range with a repeating 32-bit pattern. All-zero fills are
+ * offloaded with BLKZEROOUT where possible. */
+int blkdev_fill(int fd, uint64_t offset, uint64_t len, uint32_t pattern);
+
+#endif
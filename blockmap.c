@@ -0,0 +1,573 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "mincrypt/sha256.h"
+
+#include "blkdev.h"
+#include "blockmap.h"
+#include "digest.h"
+#include "writer.h"
+#include "xxhash.h"
+#include "droidboot_fstab.h"
+#include "droidboot_ui.h"
+#include "droidboot_util.h"
+
+#define BLOCKMAP_DIR		"/mnt/cache/droidboot"
+#define BLOCKMAP_THREADS_MAX	8
+/* Each thread reads this much at a time, or a block if larger */
+#define BLOCKMAP_READ_SIZE	(1024 * 1024)
+
+/* Written ahead of a cached manifest. A manifest is only valid in the
+ * droidboot process that made it, since the OS or an earlier droidboot
+ * may have changed the partition in between, and until droidboot
+ * writes to it. Generations count from 0 in every process, so the
+ * process is told apart by its pid and start time as well as the
+ * boot_id. */
+struct blockmap_stamp {
+	char boot_id[40];
+	uint32_t generation;
+	uint32_t pid;
+	uint64_t started;
+};
+
+struct hash_job {
+	int fd;
+	unsigned block_size;
+	uint64_t size;
+	uint64_t first;		/* blocks [first, last) */
+	uint64_t last;
+	uint64_t *digests;
+	pthread_t thread;
+	int started;
+	int ret;
+};
+
+struct tree_job {
+	int fd;
+	int algo;
+	uint64_t offset;	/* of the range on the device */
+	uint64_t length;
+	uint64_t first;		/* leaves [first, last) */
+	uint64_t last;
+	unsigned char *digests;
+	pthread_t thread;
+	int started;
+	int ret;
+};
+
+static const char *hash_names[] = { "sha256", "xxh64", "crc32c" };
+static const size_t hash_sizes[] = { SHA256_DIGEST_SIZE, 8, 4 };
+
+static int pread_full(int fd, void *buf, size_t len, off64_t offset)
+{
+	unsigned char *p = buf;
+	ssize_t r;
+
+	while (len) {
+		r = pread64(fd, p, len, offset);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		p += r;
+		len -= r;
+		offset += r;
+	}
+	return 0;
+}
+
+static void *hash_thread(void *arg)
+{
+	struct hash_job *job = arg;
+	struct xxh64_state st;
+	size_t span, len, bl, i;
+	uint64_t b, n;
+	off64_t offset;
+	void *buf;
+
+	span = BLOCKMAP_READ_SIZE;
+	if (span < job->block_size)
+		span = job->block_size;
+	if (posix_memalign(&buf, 4096, span)) {
+		pr_error("Can't allocate blockmap read buffer\n");
+		job->ret = -1;
+		return NULL;
+	}
+
+	for (b = job->first; b < job->last; b += n) {
+		n = span / job->block_size;
+		if (n > job->last - b)
+			n = job->last - b;
+		offset = b * job->block_size;
+		len = n * job->block_size;
+		if ((uint64_t)offset + len > job->size)
+			len = job->size - offset;
+		if (pread_full(job->fd, buf, len, offset)) {
+			pr_error("blockmap read at %lld: %s\n",
+					(long long)offset, strerror(errno));
+			job->ret = -1;
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			bl = len - i * job->block_size;
+			if (bl > job->block_size)
+				bl = job->block_size;
+			xxh64_reset(&st, 0);
+			xxh64_update(&st, (unsigned char *)buf +
+					i * job->block_size, bl);
+			job->digests[b + i] = xxh64_digest(&st);
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+/* Hash the blocks of device, each core taking a contiguous share */
+static int blockmap_compute(const char *device, unsigned block_size,
+		void **data, size_t *len)
+{
+	struct hash_job jobs[BLOCKMAP_THREADS_MAX];
+	struct blockmap_header *hdr;
+	uint64_t size, blocks;
+	unsigned n, i;
+	double start;
+	int fd;
+	int ret = 0;
+
+	fd = open(device, O_RDONLY | O_DIRECT);
+	if (fd < 0)
+		fd = open(device, O_RDONLY);
+	if (fd < 0) {
+		pr_error("Can't open %s: %s\n", device, strerror(errno));
+		return -1;
+	}
+	if (blkdev_size(fd, &size)) {
+		close(fd);
+		return -1;
+	}
+	blocks = (size + block_size - 1) / block_size;
+
+	*len = sizeof(*hdr) + blocks * sizeof(uint64_t);
+	hdr = xmalloc(*len);
+	hdr->magic = BLOCKMAP_MAGIC;
+	hdr->version = BLOCKMAP_VERSION;
+	hdr->header_size = sizeof(*hdr);
+	hdr->block_size = block_size;
+	hdr->digest_size = sizeof(uint64_t);
+	hdr->size = size;
+	hdr->blocks = blocks;
+
+	n = num_cpus();
+	if (n > BLOCKMAP_THREADS_MAX)
+		n = BLOCKMAP_THREADS_MAX;
+	if (n > blocks)
+		n = blocks ? blocks : 1;
+
+	start = get_time();
+	for (i = 0; i < n; i++) {
+		jobs[i].fd = fd;
+		jobs[i].block_size = block_size;
+		jobs[i].size = size;
+		jobs[i].first = blocks * i / n;
+		jobs[i].last = blocks * (i + 1) / n;
+		jobs[i].digests = (uint64_t *)(hdr + 1);
+		jobs[i].ret = 0;
+		jobs[i].started = !pthread_create(&jobs[i].thread, NULL,
+				hash_thread, &jobs[i]);
+		if (!jobs[i].started) {
+			pr_error("Can't start blockmap thread %u\n", i);
+			jobs[i].ret = -1;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		if (jobs[i].started)
+			pthread_join(jobs[i].thread, NULL);
+		if (jobs[i].ret)
+			ret = -1;
+	}
+	close(fd);
+
+	if (ret) {
+		free(hdr);
+		return -1;
+	}
+	pr_info("hashed %llu MiB of %s in %.2fs on %u threads\n",
+			(unsigned long long)(size >> 20), device,
+			get_time() - start, n);
+	*data = hdr;
+	return 0;
+}
+
+static void read_boot_id(char *buf, size_t len)
+{
+	FILE *f;
+
+	memset(buf, 0, len);
+	f = fopen("/proc/sys/kernel/random/boot_id", "r");
+	if (!f)
+		return;
+	if (!fgets(buf, len, f))
+		buf[0] = '\0';
+	fclose(f);
+}
+
+static uint64_t process_started;
+static pthread_once_t process_once = PTHREAD_ONCE_INIT;
+
+/* Start time of this process in clock ticks since boot, field 22 of
+ * /proc/self/stat. The command name before it may hold spaces, so
+ * fields are counted from the closing parenthesis. */
+static void read_process_started(void)
+{
+	char buf[512], *p;
+	size_t n;
+	FILE *f;
+	int i;
+
+	f = fopen("/proc/self/stat", "r");
+	if (!f)
+		return;
+	n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[n] = '\0';
+	p = strrchr(buf, ')');
+	for (i = 2; p && i < 22; i++)
+		p = strchr(p + 1, ' ');
+	if (p)
+		process_started = strtoull(p + 1, NULL, 10);
+}
+
+static void make_stamp(struct blockmap_stamp *stamp, unsigned generation)
+{
+	pthread_once(&process_once, read_process_started);
+	memset(stamp, 0, sizeof(*stamp));
+	read_boot_id(stamp->boot_id, sizeof(stamp->boot_id));
+	stamp->generation = generation;
+	stamp->pid = getpid();
+	stamp->started = process_started;
+}
+
+static char *cache_path(Volume *vol, unsigned block_size)
+{
+	return xasprintf("%s/blockmap-%s-%u", BLOCKMAP_DIR,
+			vol->mount_point + 1, block_size);
+}
+
+/* Load a cached manifest; -1 if there is none or it is stale */
+static int cache_load(Volume *vol, unsigned block_size, void **data,
+		size_t *len)
+{
+	struct blockmap_stamp stamp, now;
+	struct blockmap_header *hdr;
+	struct stat sb;
+	char *path;
+	int fd;
+
+	path = cache_path(vol, block_size);
+	fd = open(path, O_RDONLY);
+	free(path);
+	if (fd < 0)
+		return -1;
+
+	make_stamp(&now, writeback_device_generation(vol->device));
+	if (fstat(fd, &sb) ||
+			sb.st_size < (off_t)(sizeof(stamp) + sizeof(*hdr)) ||
+			pread_full(fd, &stamp, sizeof(stamp), 0) ||
+			memcmp(&stamp, &now, sizeof(stamp))) {
+		close(fd);
+		return -1;
+	}
+
+	*len = sb.st_size - sizeof(stamp);
+	hdr = xmalloc(*len);
+	if (pread_full(fd, hdr, *len, sizeof(stamp)) ||
+			hdr->magic != BLOCKMAP_MAGIC ||
+			hdr->block_size != block_size ||
+			*len != sizeof(*hdr) + hdr->blocks * sizeof(uint64_t)) {
+		free(hdr);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	*data = hdr;
+	return 0;
+}
+
+static void cache_store(Volume *vol, unsigned block_size, void *data,
+		size_t len, unsigned generation)
+{
+	struct blockmap_stamp stamp;
+	char *path, *tmp;
+	int fd;
+
+	if (mkdir(BLOCKMAP_DIR, 0700) && errno != EEXIST) {
+		pr_perror("mkdir");
+		return;
+	}
+	make_stamp(&stamp, generation);
+
+	path = cache_path(vol, block_size);
+	tmp = xasprintf("%s.tmp", path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		pr_error("Can't create %s: %s\n", tmp, strerror(errno));
+		goto out;
+	}
+	if (write_all(fd, &stamp, sizeof(stamp)) ||
+			write_all(fd, data, len) || fsync(fd)) {
+		pr_error("Can't write %s: %s\n", tmp, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	close(fd);
+	if (rename(tmp, path)) {
+		pr_perror("rename");
+		unlink(tmp);
+	}
+out:
+	free(tmp);
+	free(path);
+}
+
+int blockmap_get(Volume *vol, unsigned block_size, void **data,
+		size_t *len)
+{
+	Volume *cachevol;
+	unsigned generation;
+	int cached = 0;
+	int ret;
+
+	if (block_size < BLOCKMAP_BLOCK_MIN ||
+			block_size > BLOCKMAP_BLOCK_MAX ||
+			(block_size & (block_size - 1))) {
+		pr_error("bad block size %u\n", block_size);
+		return -1;
+	}
+
+	/* The manifest of /cache itself can't be kept on it */
+	cachevol = volume_for_path("/cache");
+	if (cachevol && cachevol != vol && !mount_partition(cachevol))
+		cached = 1;
+
+	if (cached && !cache_load(vol, block_size, data, len)) {
+		pr_info("using cached blockmap of %s\n", vol->device);
+		unmount_partition(cachevol);
+		return 0;
+	}
+
+	generation = writeback_device_generation(vol->device);
+	ret = blockmap_compute(vol->device, block_size, data, len);
+	if (cached) {
+		if (!ret)
+			cache_store(vol, block_size, *data, *len, generation);
+		unmount_partition(cachevol);
+	}
+	return ret;
+}
+
+int blockmap_hash_parse(const char *name)
+{
+	int i;
+
+	for (i = 0; i <= HASH_CRC32C; i++)
+		if (!strcmp(name, hash_names[i]))
+			return i;
+	return -1;
+}
+
+size_t blockmap_hash_size(int algo)
+{
+	return hash_sizes[algo];
+}
+
+/* pread() up to len bytes, stopping short only at the end of the file;
+ * -1 on errors */
+static ssize_t pread_upto(int fd, void *buf, size_t len, off64_t offset)
+{
+	unsigned char *p = buf;
+	size_t got = 0;
+	ssize_t r;
+
+	while (got < len) {
+		r = pread64(fd, p + got, len - got, offset + got);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -1;
+		if (!r)
+			break;
+		got += r;
+	}
+	return got;
+}
+
+static void hash_buf(int algo, const void *buf, size_t len,
+		unsigned char *digest)
+{
+	SHA256_CTX sha;
+	struct xxh64_state st;
+	uint64_t h;
+	uint32_t crc;
+
+	switch (algo) {
+	case HASH_SHA256:
+		SHA256_init(&sha);
+		SHA256_update(&sha, buf, len);
+		memcpy(digest, SHA256_final(&sha), SHA256_DIGEST_SIZE);
+		break;
+	case HASH_XXH64:
+		xxh64_reset(&st, 0);
+		xxh64_update(&st, buf, len);
+		h = xxh64_digest(&st);
+		memcpy(digest, &h, sizeof(h));
+		break;
+	case HASH_CRC32C:
+		crc = crc32c(0, buf, len);
+		memcpy(digest, &crc, sizeof(crc));
+		break;
+	}
+}
+
+static void *tree_thread(void *arg)
+{
+	struct tree_job *job = arg;
+	size_t len, rlen, skew;
+	uint64_t leaf, pos;
+	ssize_t got;
+	off64_t lo;
+	void *buf;
+
+	/* A leaf plus the alignment slack on either side of it */
+	if (posix_memalign(&buf, 4096, HASH_LEAF_SIZE + 2 * 4096)) {
+		pr_error("Can't allocate hash read buffer\n");
+		job->ret = -1;
+		return NULL;
+	}
+
+	for (leaf = job->first; leaf < job->last; leaf++) {
+		pos = leaf * HASH_LEAF_SIZE;
+		len = job->length - pos;
+		if (len > HASH_LEAF_SIZE)
+			len = HASH_LEAF_SIZE;
+		/* O_DIRECT wants aligned reads; the device's own end is
+		 * the only place they can come up short */
+		pos += job->offset;
+		lo = pos - pos % 4096;
+		skew = pos - lo;
+		rlen = (skew + len + 4095) / 4096 * 4096;
+		got = pread_upto(job->fd, buf, rlen, lo);
+		if (got < (ssize_t)(skew + len)) {
+			pr_error("hash read at %llu: %s\n",
+					(unsigned long long)pos,
+					got < 0 ? strerror(errno) : "short read");
+			job->ret = -1;
+			break;
+		}
+		hash_buf(job->algo, (unsigned char *)buf + skew, len,
+				job->digests + leaf * hash_sizes[job->algo]);
+	}
+	free(buf);
+	return NULL;
+}
+
+int blockmap_hash(const char *device, uint64_t offset, uint64_t length,
+		int algo, unsigned char *digest)
+{
+	struct tree_job jobs[BLOCKMAP_THREADS_MAX];
+	unsigned char *digests;
+	uint64_t size, leaves;
+	unsigned n, i;
+	double start;
+	int fd;
+	int ret = 0;
+
+	fd = open(device, O_RDONLY | O_DIRECT);
+	if (fd < 0)
+		fd = open(device, O_RDONLY);
+	if (fd < 0) {
+		pr_error("Can't open %s: %s\n", device, strerror(errno));
+		return -1;
+	}
+	if (blkdev_size(fd, &size)) {
+		close(fd);
+		return -1;
+	}
+	if (offset > size || length > size - offset) {
+		pr_error("range %llu+%llu is past the end of %s\n",
+				(unsigned long long)offset,
+				(unsigned long long)length, device);
+		close(fd);
+		return -1;
+	}
+	if (!length)
+		length = size - offset;
+	leaves = (length + HASH_LEAF_SIZE - 1) / HASH_LEAF_SIZE;
+	/* An empty range still hashes the empty list of leaves */
+	digests = xmalloc(leaves ? leaves * hash_sizes[algo] : 1);
+
+	n = num_cpus();
+	if (n > BLOCKMAP_THREADS_MAX)
+		n = BLOCKMAP_THREADS_MAX;
+	if (n > leaves)
+		n = leaves ? leaves : 1;
+
+	start = get_time();
+	for (i = 0; i < n; i++) {
+		jobs[i].fd = fd;
+		jobs[i].algo = algo;
+		jobs[i].offset = offset;
+		jobs[i].length = length;
+		jobs[i].first = leaves * i / n;
+		jobs[i].last = leaves * (i + 1) / n;
+		jobs[i].digests = digests;
+		jobs[i].ret = 0;
+		jobs[i].started = !pthread_create(&jobs[i].thread, NULL,
+				tree_thread, &jobs[i]);
+		if (!jobs[i].started) {
+			pr_error("Can't start hash thread %u\n", i);
+			jobs[i].ret = -1;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		if (jobs[i].started)
+			pthread_join(jobs[i].thread, NULL);
+		if (jobs[i].ret)
+			ret = -1;
+	}
+	close(fd);
+
+	if (!ret) {
+		hash_buf(algo, digests, leaves * hash_sizes[algo], digest);
+		pr_info("%s of %llu MiB of %s in %.2fs on %u threads\n",
+				hash_names[algo],
+				(unsigned long long)(length >> 20), device,
+				get_time() - start, n);
+	}
+	free(digests);
+	return ret;
+}
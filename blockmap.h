@@ -0,0 +1,101 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DROIDBOOT_BLOCKMAP_H
+#define DROIDBOOT_BLOCKMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "droidboot_fstab.h"
+
+/* Block manifests let the host find out what is already on a partition,
+ * so that a re-flash only needs to send the blocks that changed as a
+ * type=blocks image. All fields are little endian. */
+
+#define BLOCKMAP_MAGIC		0x504d4244	/* "DBMP" */
+#define BLOCKS_MAGIC		0x4b424244	/* "DBBK" */
+#define BLOCKMAP_VERSION	1
+
+#define BLOCKMAP_BLOCK_MIN	4096
+#define BLOCKMAP_BLOCK_MAX	(16 * 1024 * 1024)
+
+/* The manifest is this header followed by the xxHash64 (seed 0) of each
+ * block of the partition, 8 bytes apiece, so it can be mapped and
+ * indexed directly. The last block may be short. */
+struct blockmap_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size;
+	uint32_t block_size;
+	uint32_t digest_size;
+	uint64_t size;		/* of the partition, in bytes */
+	uint64_t blocks;
+};
+
+/* A type=blocks image is this header followed by extents, each a
+ * struct blocks_extent and then its data. Only the last extent of the
+ * partition may carry less than nblocks * block_size bytes, when the
+ * partition ends with a short block. */
+struct blocks_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size;
+	uint32_t block_size;
+	uint32_t extents;
+	uint64_t size;		/* of the partition the image was made for */
+};
+
+struct blocks_extent {
+	uint64_t block;
+	uint32_t nblocks;
+	uint32_t reserved;
+};
+
+/* Build the manifest of vol with the given block size (a power of two
+ * between BLOCKMAP_BLOCK_MIN and BLOCKMAP_BLOCK_MAX), hashing on all
+ * cores. Manifests are cached on /cache; a cached one is used only if
+ * it was made since droidboot started and the partition hasn't been
+ * written to since. *data is malloc()ed. */
+int blockmap_get(Volume *vol, unsigned block_size, void **data,
+		size_t *len);
+
+/* Tree hashes identify what is on (a range of) a partition without
+ * transferring it. The range is cut into HASH_LEAF_SIZE leaves, the last
+ * one possibly short, which are hashed in parallel; the result is the
+ * hash of the concatenated leaf digests, so that on a host
+ *
+ *   H(H(leaf 0) || H(leaf 1) || ... || H(leaf n - 1))
+ *
+ * gives the same value. xxh64 (seed 0) and crc32c digests are taken as
+ * little endian 8 and 4 byte numbers. */
+#define HASH_SHA256		0
+#define HASH_XXH64		1
+#define HASH_CRC32C		2
+
+#define HASH_LEAF_SIZE		(1024 * 1024)
+#define HASH_DIGEST_MAX		32
+
+/* "sha256", "xxh64" or "crc32c"; -1 if unknown */
+int blockmap_hash_parse(const char *name);
+/* Size of the algorithm's digest in bytes */
+size_t blockmap_hash_size(int algo);
+/* Tree hash of length bytes of device from offset, or of everything
+ * past offset if length is 0, into digest */
+int blockmap_hash(const char *device, uint64_t offset, uint64_t length,
+		int algo, unsigned char *digest);
+
+#endif
@@ -0,0 +1,194 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#include "mincrypt/sha256.h"
+
+#include "digest.h"
+#include "droidboot_ui.h"
+#include "droidboot_util.h"
+
+#define CRC32C_POLY	0x82f63b78	/* reversed */
+
+/* Both digests are run over a piece this size before moving on, so the
+ * second pass finds it in the cache. Also keeps SHA256_update()'s int
+ * length in range. */
+#define DIGEST_PIECE	(256 * 1024)
+
+static uint32_t crc32c_table[256];
+static int crc32c_hw;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void)
+{
+	uint32_t c;
+	unsigned i, k;
+#if defined(__i386__) || defined(__x86_64__)
+	unsigned eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2))
+		crc32c_hw = 1;
+#endif
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++)
+			c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		crc32c_table[i] = c;
+	}
+	pr_verbose("crc32c: %s\n", crc32c_hw ? "sse4.2" : "table");
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+/* The crc32 instruction, spelled out so it builds without -msse4.2 */
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p,
+		size_t len)
+{
+#ifdef __x86_64__
+	uint64_t c;
+#endif
+
+	for (; len && ((uintptr_t)p & 7); p++, len--)
+		__asm__("crc32b %1, %0" : "+r" (crc) : "rm" (*p));
+#ifdef __x86_64__
+	c = crc;
+	for (; len >= 8; p += 8, len -= 8)
+		__asm__("crc32q %1, %0" : "+r" (c)
+				: "rm" (*(const uint64_t *)p));
+	crc = c;
+#else
+	for (; len >= 4; p += 4, len -= 4)
+		__asm__("crc32l %1, %0" : "+r" (crc)
+				: "rm" (*(const uint32_t *)p));
+#endif
+	for (; len; p++, len--)
+		__asm__("crc32b %1, %0" : "+r" (crc) : "rm" (*p));
+	return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+	crc = ~crc;
+#if defined(__i386__) || defined(__x86_64__)
+	if (crc32c_hw)
+		return ~crc32c_sse42(crc, buf, len);
+#endif
+	return ~crc32c_sw(crc, buf, len);
+}
+
+/* Hash what was fed up to avail */
+static void digest_update(struct digest_stream *ds, size_t avail)
+{
+	size_t xfer;
+
+	while (ds->done < avail) {
+		xfer = avail - ds->done;
+		if (xfer > DIGEST_PIECE)
+			xfer = DIGEST_PIECE;
+		SHA256_update(&ds->sha, ds->base + ds->done, xfer);
+		ds->crc = crc32c(ds->crc, ds->base + ds->done, xfer);
+		ds->done += xfer;
+	}
+}
+
+static void *digest_thread(void *arg)
+{
+	struct digest_stream *ds = arg;
+	size_t avail;
+
+	for (;;) {
+		pthread_mutex_lock(&ds->lock);
+		while (ds->done == ds->avail && !ds->closed)
+			pthread_cond_wait(&ds->cond, &ds->lock);
+		avail = ds->avail;
+		pthread_mutex_unlock(&ds->lock);
+		if (ds->done == avail)
+			break;
+		digest_update(ds, avail);
+	}
+	return NULL;
+}
+
+void digest_stream_start(struct digest_stream *ds, const void *base)
+{
+	pthread_mutex_init(&ds->lock, NULL);
+	pthread_cond_init(&ds->cond, NULL);
+	ds->base = base;
+	ds->avail = 0;
+	ds->done = 0;
+	ds->closed = 0;
+	SHA256_init(&ds->sha);
+	ds->crc = 0;
+	/* Without the thread, everything is hashed at the end */
+	ds->started = !pthread_create(&ds->thread, NULL, digest_thread, ds);
+	if (!ds->started)
+		pr_verbose("digest thread not started, hashing afterwards\n");
+}
+
+void digest_stream_feed(struct digest_stream *ds, size_t len)
+{
+	pthread_mutex_lock(&ds->lock);
+	ds->avail += len;
+	pthread_cond_signal(&ds->cond);
+	pthread_mutex_unlock(&ds->lock);
+}
+
+void digest_stream_finish(struct digest_stream *ds, unsigned char *sha256,
+		uint32_t *crc)
+{
+	double start = get_time();
+
+	pthread_mutex_lock(&ds->lock);
+	ds->closed = 1;
+	pthread_cond_signal(&ds->cond);
+	pthread_mutex_unlock(&ds->lock);
+	if (ds->started)
+		pthread_join(ds->thread, NULL);
+	else
+		digest_update(ds, ds->avail);
+	pr_debug("digest of %zu bytes done %.3fs after the data\n",
+			ds->avail, get_time() - start);
+
+	memcpy(sha256, SHA256_final(&ds->sha), SHA256_DIGEST_SIZE);
+	*crc = ds->crc;
+	pthread_cond_destroy(&ds->cond);
+	pthread_mutex_destroy(&ds->lock);
+}
+
+void digest_format(const unsigned char *digest, size_t len, char *out)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		sprintf(out + 2 * i, "%02x", digest[i]);
+	out[2 * len] = '\0';
+}
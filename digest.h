@@ -0,0 +1,58 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DROIDBOOT_DIGEST_H
+#define DROIDBOOT_DIGEST_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mincrypt/sha256.h"
+
+/* CRC32C (Castagnoli), chained like zlib's crc32(): start with 0 and
+ * pass the previous result back in. Uses the SSE4.2 crc32 instruction
+ * when the CPU has it. */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* SHA-256 and CRC32C of a buffer that is being filled front to back,
+ * computed on a thread of their own as the data arrives so that hashing
+ * overlaps the transfer */
+struct digest_stream {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	const unsigned char *base;
+	size_t avail;		/* bytes of base filled in so far */
+	size_t done;		/* bytes hashed, only touched by the hasher */
+	int closed;
+	pthread_t thread;
+	int started;
+	SHA256_CTX sha;
+	uint32_t crc;
+};
+
+void digest_stream_start(struct digest_stream *ds, const void *base);
+/* The next len bytes of base are in */
+void digest_stream_feed(struct digest_stream *ds, size_t len);
+/* Wait for the hasher to catch up with what was fed and get the
+ * results; sha256 must hold SHA256_DIGEST_SIZE bytes */
+void digest_stream_finish(struct digest_stream *ds, unsigned char *sha256,
+		uint32_t *crc);
+
+/* Lower case hex; out must hold 2 * len + 1 bytes */
+void digest_format(const unsigned char *digest, size_t len, char *out);
+
+#endif
@@ -67,6 +67,12 @@ pthread_mutex_t action_mutex = PTHREAD_MUTEX_INITIALIZER;
 /* Default size of memory buffer for image data */
 static int g_scratch_size = 400;
 
+/* TCP port fastboot listens on */
+static int g_tcp_port = 1234;
+
+/* Serve USB through FunctionFS instead of /dev/android_adb */
+static int g_usb_ffs;
+
 struct selabel_handle *sehandle;
 
 
@@ -87,6 +93,13 @@ static void parse_cmdline_option(char *name)
 
 	if (!strcmp(name, "droidboot.scratch")) {
 		g_scratch_size = atoi(value);
+	} else if (!strcmp(name, "droidboot.tcp_port")) {
+		g_tcp_port = atoi(value);
+	} else if (!strcmp(name, "droidboot.usb")) {
+		if (!strcmp(value, "ffs"))
+			g_usb_ffs = 1;
+		else if (strcmp(value, "adb"))
+			pr_error("Unknown USB transport %s, ignoring\n", value);
 	} else {
 		pr_error("Unknown parameter %s, ignoring\n", name);
 	}
@@ -122,7 +135,7 @@ int main(int argc, char **argv)
 	load_volume_table();
 	aboot_register_commands();
 	register_droidboot_plugins();
-	fastboot_init(g_scratch_size * MEGABYTE);
+	fastboot_init(g_scratch_size * MEGABYTE, g_tcp_port, g_usb_ffs);
 
 	/* Shouldn't get here */
 	exit(1);
@@ -33,6 +33,10 @@ typedef struct {
                               // partition.  0 or negative number
                               // means to format all but the last
                               // (that much).
+
+    int write_engine;         // WRITE_* engine used to flash images
+    int write_depth;          // and its queue depth, see writer.h
+    int write_regions;        // regions written at once, 0 for default
 } Volume;
 
 // Load and parse volume data from /etc/recovery.fstab.
@@ -47,5 +51,8 @@ Volume *volume_for_name(const char *name);
 // Return Volume* record for a particular device node (or NULL)
 Volume* volume_for_device(const char* device);
 
+// Return the i-th Volume* record of the table (or NULL past its end)
+Volume *volume_at(int i);
+
 #endif
 
@@ -6,11 +6,18 @@
 
 /* File I/O */
 int named_file_write(const char *filename, const unsigned char *what,
-		size_t sz, off_t offset, int append);
+		size_t sz, off64_t offset, int append);
 int named_file_write_decompress_gzip(const char *filename,
-		unsigned char *what, size_t sz, off_t offset, int append);
+		unsigned char *what, size_t sz, off64_t offset, int append);
+int named_file_write_decompress_lz4(const char *filename,
+		unsigned char *what, size_t sz, off64_t offset, int append);
+int named_file_write_decompress_zstd(const char *filename,
+		unsigned char *what, size_t sz, off64_t offset, int append);
 int named_file_write_ext4_sparse(const char *filename,
 		unsigned char *what, size_t sz);
+int named_file_write_blocks(const char *filename, unsigned char *what,
+		size_t sz);
+int write_all(int fd, const void *buf, size_t sz);
 
 /* Attribute specification and -Werror prevents most security shenanigans with
  * these functions */
@@ -25,6 +32,8 @@ void apply_sw_update(const char *location, int send_fb_ok);
 int mount_partition_device(const char *device, const char *type, char *mountpoint);
 void import_kernel_cmdline(void (*callback)(char *name));
 int is_valid_blkdev(const char *node);
+double get_time(void);
+unsigned num_cpus(void);
 
 /* Fails assertion if memory allocations fail */
 char *xstrdup(const char *s);
@@ -34,6 +43,8 @@ void *xmalloc(size_t size);
 /* Volume operations */
 int mount_partition(Volume *vol);
 int erase_partition(Volume *vol);
+int secure_erase_partition(Volume *vol);
+int format_partition_lazy(Volume *vol);
 int check_ext_superblock(Volume *vol, int *sb_present);
 int unmount_partition(Volume *vol);
 int ext4_filesystem_checks(Volume *vol);
@@ -27,29 +27,78 @@
  */
 #define LOG_TAG "fastboot"
 
+#include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <pthread.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
 
+#include <cutils/hashmap.h>
+
+#include "digest.h"
 #include "droidboot.h"
 #include "droidboot_ui.h"
 #include "fastboot.h"
 #include "droidboot_util.h"
+#include "ring.h"
+#include "usb_ffs.h"
+#include "writer.h"
 
 #define MAGIC_LENGTH 64
 
+/* Streaming downloads are received in STREAM_SLOTS buffers of up to
+ * STREAM_SLOT_SIZE bytes, charged to the scratch budget like a download */
+#define STREAM_SLOTS		3
+#define STREAM_SLOT_SIZE	(4 * 1024 * 1024)
+
+/* Largest piece of a framed TCP download read before it is handed to
+ * the digest thread */
+#define DIGEST_FEED_SIZE	(256 * 1024)
+
+/* Not in older bionic headers */
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB		0x40000
+#endif
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE		14
+#endif
+
+#define HUGEPAGE_SIZE		(2 * 1024 * 1024)
+
+/* Framed TCP transport: after a 4 byte "FBnn" handshake in each
+ * direction, every packet is preceded by its length as a 64 bit big
+ * endian number */
+#define TCP_HANDSHAKE		"FB01"
+#define TCP_HANDSHAKE_LEN	4
+#define TCP_HEADER_LEN		8
+#define TCP_RCVBUF		(1024 * 1024)
+
+/* Pipe between the socket and the destination of spliced downloads */
+#define SPLICE_PIPE_SIZE	(1024 * 1024)
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ		1031
+#endif
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE		1
+#define SPLICE_F_MORE		4
+#endif
+
 struct fastboot_cmd {
 	struct fastboot_cmd *next;
 	const char *prefix;
 	unsigned prefix_len;
+	unsigned flags;
 	void (*handle) (char *arg, void *data, unsigned sz);
 };
 
@@ -57,60 +106,429 @@ struct fastboot_var {
 	struct fastboot_var *next;
 	const char *name;
 	const char *value;
+	void (*func) (char *buf, size_t len);
+};
+
+/* Command latency histograms, in decade buckets: under 100us, 1ms,
+ * 10ms, 100ms, 1s, and anything slower */
+#define LATENCY_BUCKETS	6
+
+struct latency_hist {
+	unsigned count[LATENCY_BUCKETS];
+};
+
+#define STATE_OFFLINE	0
+#define STATE_COMMAND	1
+#define STATE_COMPLETE	2
+#define STATE_ERROR	3
+
+/* One connected host, served by its own thread */
+struct fastboot_session {
+	int fd;
+	int wfd;		/* differs from fd for FunctionFS endpoints */
+	unsigned state;
+	int is_usb;
+	int use_ffs;
+	struct usb_ffs ffs;
+	int framed;		/* framed TCP rather than the raw USB protocol */
+	uint64_t frame_left;	/* payload bytes left in the current packet */
+	void *download_base;	/* mapping holding the last download */
+	size_t download_map_len;
+	unsigned download_max;	/* bytes charged to the scratch budget */
+	unsigned download_size;
+	int download_hashed;	/* the digests below are of the download */
+	unsigned char download_sha256[SHA256_DIGEST_SIZE];
+	uint32_t download_crc32c;
+	struct digest_stream *digest;	/* fed by usb_read() if set */
+	void *upload_data;	/* staged for the next upload command */
+	size_t upload_len;
+	unsigned char buffer[MAGIC_LENGTH + 1];
 };
 
+static pthread_key_t session_key;
+
+/* The download buffers of all sessions together may not exceed the
+ * scratch budget passed to fastboot_init() */
+static pthread_mutex_t scratch_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned scratch_max;
+static unsigned scratch_used;
+
+/* Written to by a USB session thread when it exits, so the handler
+ * starts listening on the USB device node again */
+static int wake_pipe[2] = { -1, -1 };
+
+static int tcp_port;
+static int usb_ffs_mode;
+
 static struct fastboot_cmd *cmdlist;
+static Hashmap *cmd_map;
 
-void fastboot_register(const char *prefix,
-		       void (*handle) (char *arg, void *data,
-				       unsigned sz))
+static bool strcompare(void *keyA, void *keyB)
+{
+	return !strcmp(keyA, keyB);
+}
+
+static int strhash(void *key)
+{
+	return hashmapHash(key, strlen((char *)key));
+}
+
+void fastboot_register_flags(const char *prefix,
+		void (*handle) (char *arg, void *data, unsigned sz),
+		unsigned flags)
 {
 	struct fastboot_cmd *cmd;
 	cmd = xmalloc(sizeof(*cmd));
 	cmd->prefix = prefix;
 	cmd->prefix_len = strlen(prefix);
+	cmd->flags = flags;
 	cmd->handle = handle;
 	cmd->next = cmdlist;
 	cmdlist = cmd;
+
+	if (!cmd_map)
+		cmd_map = hashmapCreate(16, strhash, strcompare);
+	if (!cmd_map) {
+		pr_error("hashmapCreate failed\n");
+		die();
+	}
+	hashmapPut(cmd_map, (void *)prefix, cmd);
+}
+
+void fastboot_register(const char *prefix,
+		       void (*handle) (char *arg, void *data,
+				       unsigned sz))
+{
+	fastboot_register_flags(prefix, handle, 0);
+}
+
+/* Commands are looked up by name: everything up to and including the
+ * first ':', or up to the first space, as in "flash:system" or
+ * "oem unlock". Handlers registered with some other kind of prefix are
+ * still found by walking the list. */
+static struct fastboot_cmd *find_command(const char *buf)
+{
+	struct fastboot_cmd *cmd;
+	char key[MAGIC_LENGTH + 1];
+	size_t n;
+
+	n = strcspn(buf, ": ");
+	memcpy(key, buf, n);
+	if (buf[n] == ':')
+		key[n++] = ':';
+	key[n] = '\0';
+
+	cmd = hashmapGet(cmd_map, key);
+	if (cmd)
+		return cmd;
+
+	for (cmd = cmdlist; cmd; cmd = cmd->next)
+		if (!memcmp(buf, cmd->prefix, cmd->prefix_len))
+			return cmd;
+	return NULL;
 }
 
+/* Variables are kept in publication order for getvar:all, and hashed
+ * by name for lookups. Publishing a name again replaces its value. */
 static struct fastboot_var *varlist;
+static struct fastboot_var **var_tail = &varlist;
+static unsigned var_count;
+static Hashmap *var_map;
+static pthread_mutex_t var_lock = PTHREAD_MUTEX_INITIALIZER;
 
-void fastboot_publish(const char *name, const char *value)
+static void publish_var(const char *name, const char *value,
+		void (*func) (char *buf, size_t len))
 {
 	struct fastboot_var *var;
-	var = xmalloc(sizeof(*var));
-	var->name = name;
+
+	pthread_mutex_lock(&var_lock);
+	if (!var_map)
+		var_map = hashmapCreate(16, strhash, strcompare);
+	if (!var_map) {
+		pr_error("hashmapCreate failed\n");
+		die();
+	}
+	var = hashmapGet(var_map, (void *)name);
+	if (!var) {
+		var = xmalloc(sizeof(*var));
+		var->name = name;
+		var->next = NULL;
+		*var_tail = var;
+		var_tail = &var->next;
+		var_count++;
+		hashmapPut(var_map, (void *)name, var);
+	}
 	var->value = value;
-	var->next = varlist;
-	varlist = var;
+	var->func = func;
+	pthread_mutex_unlock(&var_lock);
+}
+
+void fastboot_publish(const char *name, const char *value)
+{
+	publish_var(name, value, NULL);
+}
+
+void fastboot_publish_func(const char *name,
+		void (*func) (char *buf, size_t len))
+{
+	publish_var(name, NULL, func);
+}
+
+static const char *var_value(struct fastboot_var *var, char *buf,
+		size_t len)
+{
+	if (!var->func)
+		return var->value;
+	buf[0] = '\0';
+	var->func(buf, len);
+	return buf;
+}
+
+/* Copy out a variable, as it may be published again meanwhile */
+static int find_var(const char *name, struct fastboot_var *out)
+{
+	struct fastboot_var *var = NULL;
+
+	pthread_mutex_lock(&var_lock);
+	if (var_map)
+		var = hashmapGet(var_map, (void *)name);
+	if (var)
+		*out = *var;
+	pthread_mutex_unlock(&var_lock);
+	return var ? 0 : -1;
 }
 
 const char *fastboot_getvar(const char *name)
 {
-	struct fastboot_var *var;
-	for (var = varlist; var; var = var->next)
-		if (!strcmp(name, var->name))
-			return (var->value);
-	return NULL;
+	struct fastboot_var var;
+
+	return !find_var(name, &var) && !var.func ? var.value : NULL;
+}
+
+/* Commands registered FASTBOOT_READ_ONLY, and all the others */
+static struct latency_hist fast_latency;
+static struct latency_hist slow_latency;
+static pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void latency_add(struct latency_hist *h, double secs)
+{
+	double limit = 0.0001;
+	int i;
+
+	for (i = 0; i < LATENCY_BUCKETS - 1 && secs >= limit; i++)
+		limit *= 10;
+	pthread_mutex_lock(&latency_lock);
+	h->count[i]++;
+	pthread_mutex_unlock(&latency_lock);
 }
 
-static unsigned char buffer[4096];
+static void latency_format(struct latency_hist *h, char *buf, size_t len)
+{
+	pthread_mutex_lock(&latency_lock);
+	snprintf(buf, len, "%u/%u/%u/%u/%u/%u", h->count[0], h->count[1],
+			h->count[2], h->count[3], h->count[4], h->count[5]);
+	pthread_mutex_unlock(&latency_lock);
+}
 
-static void *download_base;
-static unsigned download_max;
-static unsigned download_size;
+static void get_fast_latency(char *buf, size_t len)
+{
+	latency_format(&fast_latency, buf, len);
+}
 
-#define STATE_OFFLINE	0
-#define STATE_COMMAND	1
-#define STATE_COMPLETE	2
-#define STATE_ERROR	3
+static void get_slow_latency(char *buf, size_t len)
+{
+	latency_format(&slow_latency, buf, len);
+}
+
+static struct fastboot_session *current_session(void)
+{
+	return pthread_getspecific(session_key);
+}
+
+/* Take len bytes of scratch space. On failure *in_use is what the
+ * other sessions were holding at the time. */
+static int scratch_admit(unsigned len, unsigned *in_use)
+{
+	int ret = -1;
 
-static unsigned fastboot_state = STATE_OFFLINE;
-int fb_fp = -1;
-int enable_fp;
+	pthread_mutex_lock(&scratch_lock);
+	*in_use = scratch_used;
+	if (len <= scratch_max - scratch_used) {
+		scratch_used += len;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&scratch_lock);
+	return ret;
+}
 
-static int usb_read(void *_buf, unsigned len)
+static void scratch_return(unsigned len)
+{
+	pthread_mutex_lock(&scratch_lock);
+	scratch_used -= len;
+	pthread_mutex_unlock(&scratch_lock);
+}
+
+static void download_free(struct fastboot_session *s)
+{
+	if (s->download_base)
+		munmap(s->download_base, s->download_map_len);
+	scratch_return(s->download_max);
+	s->download_base = NULL;
+	s->download_map_len = 0;
+	s->download_max = 0;
+	s->download_size = 0;
+	s->download_hashed = 0;
+}
+
+/* Replace the session's download buffer with one of len bytes. The
+ * buffer only reserves address space: pages get committed as usb_read()
+ * fills them and are given back by download_free(). Preallocated
+ * hugetlbfs pages are used if there are enough of them, otherwise
+ * transparent hugepages are requested to cut down on TLB misses over the
+ * large copies. */
+static int download_alloc(struct fastboot_session *s, unsigned len)
+{
+	size_t huge_len = ((size_t)len + HUGEPAGE_SIZE - 1) &
+		~(size_t)(HUGEPAGE_SIZE - 1);
+	unsigned in_use;
+	void *p;
+
+	download_free(s);
+	if (!len)
+		return 0;
+	if (scratch_admit(len, &in_use)) {
+		pr_error("fastboot: no scratch space for %u bytes (%u of %u in use)\n",
+				len, in_use, scratch_max);
+		return -1;
+	}
+	s->download_max = len;
+
+	p = mmap(NULL, huge_len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED) {
+		pr_verbose("download buffer in hugetlbfs pages\n");
+		s->download_base = p;
+		s->download_map_len = huge_len;
+		return 0;
+	}
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED) {
+		pr_perror("mmap");
+		download_free(s);
+		return -1;
+	}
+	if (madvise(p, len, MADV_HUGEPAGE))
+		pr_verbose("transparent hugepages not available\n");
+	s->download_base = p;
+	s->download_map_len = len;
+	return 0;
+}
+
+void fastboot_release_download(void)
+{
+	struct fastboot_session *s = current_session();
+
+	if (s)
+		download_free(s);
+}
+
+/* read() exactly len bytes */
+static int read_full(int fd, void *_buf, size_t len)
+{
+	unsigned char *buf = _buf;
+	ssize_t r;
+
+	while (len) {
+		r = read(fd, buf, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0) {
+			pr_perror("read");
+			return -1;
+		} else if (r == 0) {
+			pr_info("Connection closed\n");
+			return -1;
+		}
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+/* Length of the next packet of a framed TCP session */
+static int tcp_read_header(struct fastboot_session *s, uint64_t *len)
+{
+	unsigned char hdr[TCP_HEADER_LEN];
+	int i;
+
+	if (read_full(s->fd, hdr, sizeof(hdr)))
+		return -1;
+	*len = 0;
+	for (i = 0; i < TCP_HEADER_LEN; i++)
+		*len = (*len << 8) | hdr[i];
+	return 0;
+}
+
+/* Data read of a framed TCP session. Reads are sized to what is left of
+ * the current packet rather than split into 4K pieces, and may span any
+ * number of packets. */
+static int tcp_read(struct fastboot_session *s, unsigned char *buf,
+		unsigned len)
+{
+	unsigned xfer;
+
+	while (len) {
+		if (!s->frame_left && tcp_read_header(s, &s->frame_left))
+			return -1;
+		xfer = (s->frame_left < len) ? s->frame_left : len;
+		if (s->digest && xfer > DIGEST_FEED_SIZE)
+			xfer = DIGEST_FEED_SIZE;
+		if (read_full(s->fd, buf, xfer))
+			return -1;
+		if (s->digest)
+			digest_stream_feed(s->digest, xfer);
+		s->frame_left -= xfer;
+		buf += xfer;
+		len -= xfer;
+	}
+	return 0;
+}
+
+static int tcp_write(struct fastboot_session *s, void *buf, unsigned len)
+{
+	unsigned char hdr[TCP_HEADER_LEN];
+	struct iovec iov[2];
+	uint64_t n = len;
+	size_t left = sizeof(hdr) + len;
+	ssize_t r;
+	int i;
+
+	for (i = TCP_HEADER_LEN - 1; i >= 0; i--, n >>= 8)
+		hdr[i] = n & 0xff;
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = len;
+
+	/* A response is short; a partial write is an error */
+	do {
+		r = writev(s->wfd, iov, 2);
+	} while (r < 0 && errno == EINTR);
+	if (r < 0 || (size_t)r != left) {
+		pr_perror("writev");
+		return -1;
+	}
+	return len;
+}
+
+static void feed_digest(void *arg, size_t len)
+{
+	digest_stream_feed(arg, len);
+}
+
+static int usb_read(struct fastboot_session *s, void *_buf, unsigned len)
 {
 	int r = 0;
 	unsigned xfer;
@@ -118,14 +536,26 @@ static int usb_read(void *_buf, unsigned len)
 	int count = 0;
 	unsigned const len_orig = len;
 
-	if (fastboot_state == STATE_ERROR)
+	if (s->state == STATE_ERROR)
 		goto oops;
 
+	if (s->framed) {
+		if (tcp_read(s, buf, len))
+			goto oops;
+		return len;
+	}
+	if (s->use_ffs && len != MAGIC_LENGTH) {
+		if (usb_ffs_read(&s->ffs, buf, len,
+					s->digest ? feed_digest : NULL, s->digest))
+			goto oops;
+		return len;
+	}
+
 	pr_verbose("usb_read %d\n", len);
 	while (len > 0) {
 		xfer = (len > 4096) ? 4096 : len;
 
-		r = read(fb_fp, buf, xfer);
+		r = read(s->fd, buf, xfer);
 		if (r < 0) {
 			pr_perror("read");
 			goto oops;
@@ -134,6 +564,8 @@ static int usb_read(void *_buf, unsigned len)
 			goto oops;
 		}
 
+		if (s->digest)
+			digest_stream_feed(s->digest, r);
 		count += r;
 		buf += r;
 		len -= r;
@@ -150,46 +582,92 @@ static int usb_read(void *_buf, unsigned len)
 	return count;
 
 oops:
-	fastboot_state = STATE_ERROR;
+	s->state = STATE_ERROR;
+	return -1;
+}
+
+/* Read the next command. Framed TCP sessions get exactly one packet;
+ * raw sessions rely on the command arriving in a single read(). */
+static int read_command(struct fastboot_session *s, unsigned char *buf)
+{
+	uint64_t len;
+
+	if (!s->framed)
+		return usb_read(s, buf, MAGIC_LENGTH);
+
+	if (s->state == STATE_ERROR)
+		return -1;
+	if (s->frame_left) {
+		pr_error("fastboot: %llu stray bytes before command\n",
+				(unsigned long long)s->frame_left);
+		goto oops;
+	}
+	if (tcp_read_header(s, &len))
+		goto oops;
+	if (len > MAGIC_LENGTH) {
+		pr_error("fastboot: command packet of %llu bytes\n",
+				(unsigned long long)len);
+		goto oops;
+	}
+	if (read_full(s->fd, buf, len))
+		goto oops;
+	return len;
+
+oops:
+	s->state = STATE_ERROR;
 	return -1;
 }
 
-static int usb_write(void *buf, unsigned len)
+static int usb_write(struct fastboot_session *s, void *buf, unsigned len)
 {
 	int r;
 
 	pr_verbose("usb_write %d\n", len);
-	if (fastboot_state == STATE_ERROR)
+	if (s->state == STATE_ERROR)
 		goto oops;
 
-	r = write(fb_fp, buf, len);
-	if (r < 0) {
+	if (s->framed)
+		r = tcp_write(s, buf, len);
+	else if ((r = write(s->wfd, buf, len)) < 0)
 		pr_perror("write");
+	if (r < 0)
 		goto oops;
-	}
 
 	return r;
 
 oops:
-	fastboot_state = STATE_ERROR;
+	s->state = STATE_ERROR;
 	return -1;
 }
 
 void fastboot_ack(const char *code, const char *reason)
 {
+	struct fastboot_session *s = current_session();
 	char response[MAGIC_LENGTH];
 
-	if (fastboot_state != STATE_COMMAND)
+	if (!s || s->state != STATE_COMMAND)
 		return;
 
 	if (reason == 0)
 		reason = "";
 
 	snprintf(response, MAGIC_LENGTH, "%s%s", code, reason);
-	fastboot_state = STATE_COMPLETE;
+	s->state = STATE_COMPLETE;
+
+	usb_write(s, response, strlen(response));
+
+}
 
-	usb_write(response, strlen(response));
+void fastboot_info(const char *info)
+{
+	struct fastboot_session *s = current_session();
+	char response[MAGIC_LENGTH];
 
+	if (!s || s->state != STATE_COMMAND)
+		return;
+
+	snprintf(response, MAGIC_LENGTH, "INFO%s", info);
+	usb_write(s, response, strlen(response));
 }
 
 void fastboot_fail(const char *reason)
@@ -204,91 +682,527 @@ void fastboot_okay(const char *info)
 	fastboot_ack("OKAY", info);
 }
 
+int fastboot_download_sha256(unsigned char *digest)
+{
+	struct fastboot_session *s = current_session();
+
+	if (!s || !s->download_hashed)
+		return -1;
+	memcpy(digest, s->download_sha256, SHA256_DIGEST_SIZE);
+	return 0;
+}
+
+static void get_download_crc32c(char *buf, size_t len)
+{
+	struct fastboot_session *s = current_session();
+
+	if (s && s->download_hashed)
+		snprintf(buf, len, "%08x", s->download_crc32c);
+}
+
+/* A SHA-256 in hex doesn't fit in a response, so it is sent as two INFO
+ * lines of 32 digits each */
+static void getvar_download_sha256(void)
+{
+	struct fastboot_session *s = current_session();
+	char hex[2 * SHA256_DIGEST_SIZE + 1];
+	char half[SHA256_DIGEST_SIZE + 1];
+
+	if (s->download_hashed) {
+		digest_format(s->download_sha256, SHA256_DIGEST_SIZE, hex);
+		memcpy(half, hex, SHA256_DIGEST_SIZE);
+		half[SHA256_DIGEST_SIZE] = '\0';
+		fastboot_info(half);
+		fastboot_info(hex + SHA256_DIGEST_SIZE);
+	}
+	fastboot_okay("");
+}
+
+/* "getvar:all" answers with an INFO line per variable and a final OKAY,
+ * saving the host a round trip per variable. The list is copied under
+ * the lock, so that neither the value callbacks nor the USB writes hold
+ * up other sessions publishing or looking up variables. */
+static void getvar_all(void)
+{
+	struct fastboot_var *var, *vars;
+	const char *value;
+	char line[MAGIC_LENGTH];
+	char buf[MAGIC_LENGTH];
+	unsigned i, n = 0;
+
+	pthread_mutex_lock(&var_lock);
+	vars = xmalloc((var_count ? var_count : 1) * sizeof(*vars));
+	for (var = varlist; var; var = var->next)
+		vars[n++] = *var;
+	pthread_mutex_unlock(&var_lock);
+
+	for (i = 0; i < n; i++) {
+		value = var_value(&vars[i], buf, sizeof(buf));
+		snprintf(line, sizeof(line), "%s: %s", vars[i].name,
+				value ? value : "");
+		fastboot_info(line);
+	}
+	free(vars);
+	fastboot_okay("");
+}
+
 static void cmd_getvar(char *arg, void *data, unsigned sz)
 {
-	struct fastboot_var *var;
+	struct fastboot_var var;
+	const char *value;
+	char buf[MAGIC_LENGTH];
 
 	pr_debug("fastboot: cmd_getvar %s\n", arg);
-	for (var = varlist; var; var = var->next) {
-		if (!strcmp(var->name, arg)) {
-			fastboot_okay(var->value);
-			return;
-		}
+	if (!strcmp(arg, "download-sha256")) {
+		getvar_download_sha256();
+		return;
 	}
-	fastboot_okay("");
+	if (!strcmp(arg, "all")) {
+		getvar_all();
+		return;
+	}
+
+	value = find_var(arg, &var) ? NULL : var_value(&var, buf, sizeof(buf));
+	fastboot_okay(value ? value : "");
 }
 
+/* The data is hashed while it comes in, for getvar:download-sha256,
+ * getvar:download-crc32c and the sha256= flash option */
 static void cmd_download(char *arg, void *data, unsigned sz)
 {
+	struct fastboot_session *s = current_session();
 	char response[MAGIC_LENGTH];
+	struct digest_stream ds;
 	unsigned len;
 	int r;
 
 	len = strtoul(arg, NULL, 16);
 	pr_debug("fastboot: cmd_download %d bytes\n", len);
 
-	download_size = 0;
-	if (len > download_max) {
+	download_free(s);
+	if (len > scratch_max) {
 		fastboot_fail("data too large");
 		return;
 	}
+	if (download_alloc(s, len)) {
+		fastboot_fail("out of memory, other downloads in progress");
+		return;
+	}
 
 	sprintf(response, "DATA%08x", len);
-	if (usb_write(response, strlen(response)) < 0)
+	if (usb_write(s, response, strlen(response)) < 0)
 		return;
 
-	r = usb_read(download_base, len);
+	digest_stream_start(&ds, s->download_base);
+	s->digest = &ds;
+	r = usb_read(s, s->download_base, len);
+	s->digest = NULL;
+	digest_stream_finish(&ds, s->download_sha256, &s->download_crc32c);
 
 	if ((r < 0) || ((unsigned int)r != len)) {
 		pr_error("fastboot: cmd_download error only got %d bytes\n", r);
-		fastboot_state = STATE_ERROR;
+		s->state = STATE_ERROR;
 		return;
 	}
-	download_size = len;
+	s->download_size = len;
+	s->download_hashed = 1;
 	fastboot_okay("");
 }
 
-static void fastboot_command_loop(void)
+void fastboot_stage_upload(void *data, size_t len)
+{
+	struct fastboot_session *s = current_session();
+
+	if (!s) {
+		free(data);
+		return;
+	}
+	free(s->upload_data);
+	s->upload_data = data;
+	s->upload_len = len;
+}
+
+/* Data is sent in pieces no larger than what a USB write takes */
+#define UPLOAD_CHUNK	16384
+
+/* "upload": send the data staged by the last command that produced any,
+ * such as oem blockmap */
+static void cmd_upload(char *arg, void *data, unsigned sz)
+{
+	struct fastboot_session *s = current_session();
+	char response[MAGIC_LENGTH];
+	unsigned char *p;
+	size_t left, xfer;
+
+	if (!s->upload_data) {
+		fastboot_fail("nothing staged for upload");
+		return;
+	}
+	if (s->upload_len > 0xffffffff) {
+		fastboot_fail("staged data too large");
+		return;
+	}
+
+	sprintf(response, "DATA%08x", (unsigned)s->upload_len);
+	if (usb_write(s, response, strlen(response)) < 0)
+		return;
+	p = s->upload_data;
+	for (left = s->upload_len; left; left -= xfer, p += xfer) {
+		xfer = left > UPLOAD_CHUNK ? UPLOAD_CHUNK : left;
+		if (usb_write(s, p, xfer) != (int)xfer) {
+			pr_error("fastboot: upload failed with %zu bytes left\n",
+					left);
+			s->state = STATE_ERROR;
+			return;
+		}
+	}
+	free(s->upload_data);
+	s->upload_data = NULL;
+	s->upload_len = 0;
+	fastboot_okay("");
+}
+
+/* Swallow len bytes of download data after the destination failed, so
+ * the host sees a FAIL response instead of a hung connection */
+static void download_discard(struct fastboot_session *s, unsigned len,
+		unsigned char *buf, size_t buf_len)
+{
+	unsigned xfer;
+	int r;
+
+	while (len && s->state != STATE_ERROR) {
+		xfer = (len > buf_len) ? buf_len : len;
+
+		r = usb_read(s, buf, xfer);
+		if ((r < 0) || ((unsigned)r != xfer))
+			s->state = STATE_ERROR;
+		len -= xfer;
+	}
+}
+
+/* Our bionic has no splice() wrapper */
+static ssize_t sys_splice(int fd_in, int fd_out, size_t len, unsigned flags)
+{
+	return syscall(__NR_splice, fd_in, NULL, fd_out, NULL, len, flags);
+}
+
+/* Move len bytes of download data from a TCP session's socket to fd
+ * with splice() through a pipe, so the data is never copied through
+ * user space. buf is only used if fd turns out not to support splice,
+ * and to discard the rest of the transfer after an error. Returns 1 if
+ * the socket can't be spliced, in which case nothing was consumed. */
+static int download_splice(struct fastboot_session *s, int fd, unsigned len,
+		unsigned char *buf, size_t buf_len)
+{
+	unsigned total = len;
+	double start = get_time();
+	double elapsed;
+	ssize_t n, m;
+	int copy = 0;
+	int p[2];
+
+	if (pipe(p)) {
+		pr_perror("pipe");
+		return 1;
+	}
+	/* Best effort; the default pipe is 64K */
+	fcntl(p[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+
+	while (len) {
+		if (s->framed && !s->frame_left &&
+				tcp_read_header(s, &s->frame_left)) {
+			s->state = STATE_ERROR;
+			goto fail;
+		}
+		n = (len > SPLICE_PIPE_SIZE) ? SPLICE_PIPE_SIZE : len;
+		if (s->framed && s->frame_left < (uint64_t)n)
+			n = s->frame_left;
+
+		n = sys_splice(s->fd, p[1], n, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EINVAL && len == total) {
+			close(p[0]);
+			close(p[1]);
+			return 1;
+		}
+		if (n <= 0) {
+			if (n < 0)
+				pr_perror("splice");
+			else
+				pr_info("Connection closed\n");
+			s->state = STATE_ERROR;
+			goto fail;
+		}
+		len -= n;
+		if (s->framed)
+			s->frame_left -= n;
+
+		while (n) {
+			if (copy) {
+				m = read(p[0], buf, ((size_t)n < buf_len) ?
+						(size_t)n : buf_len);
+				if (m > 0 && write_all(fd, buf, m))
+					m = -1;
+			} else {
+				m = sys_splice(p[0], fd, n,
+						SPLICE_F_MOVE | SPLICE_F_MORE);
+				if (m < 0 && errno == EINVAL) {
+					/* fd can't be spliced to */
+					copy = 1;
+					continue;
+				}
+			}
+			if (m < 0 && errno == EINTR)
+				continue;
+			if (m <= 0) {
+				pr_perror("write");
+				goto fail;
+			}
+			n -= m;
+		}
+	}
+	close(p[0]);
+	close(p[1]);
+
+	elapsed = get_time() - start;
+	pr_debug("fastboot: spliced %u bytes in %.2fs (%.1f MB/s)%s\n",
+			total, elapsed,
+			elapsed > 0 ? total / elapsed / MEGABYTE : 0.0,
+			copy ? ", copying out of the pipe" : "");
+	return 0;
+
+fail:
+	close(p[0]);
+	close(p[1]);
+	download_discard(s, len, buf, buf_len);
+	return -1;
+}
+
+int fastboot_download_to_fd(int fd, unsigned len)
+{
+	struct fastboot_session *s = current_session();
+	char response[MAGIC_LENGTH];
+	struct blk_writer out;
+	struct ring_writer w;
+	struct ring ring;
+	struct ring_slot *slot;
+	size_t slot_size;
+	int r;
+
+	pr_debug("fastboot: streaming %u bytes\n", len);
+
+	slot_size = scratch_max / STREAM_SLOTS;
+	if (slot_size > STREAM_SLOT_SIZE)
+		slot_size = STREAM_SLOT_SIZE;
+	slot_size &= ~4095;
+	if (!slot_size) {
+		pr_error("download buffer too small for streaming\n");
+		return -1;
+	}
+	/* The previous download, if any, is dropped for the slots */
+	if (download_alloc(s, STREAM_SLOTS * slot_size))
+		return -1;
+
+	sprintf(response, "DATA%08x", len);
+	if (usb_write(s, response, strlen(response)) < 0) {
+		download_free(s);
+		return -1;
+	}
+
+	/* Over TCP the data can go from the socket to fd without passing
+	 * through the download buffer */
+	if (!s->is_usb) {
+		r = download_splice(s, fd, len, s->download_base,
+				STREAM_SLOTS * slot_size);
+		if (r <= 0) {
+			download_free(s);
+			return r;
+		}
+	}
+
+	ring_init(&ring, STREAM_SLOTS, slot_size, s->download_base);
+	blk_writer_fdopen(&out, fd);
+	if (ring_writer_start(&w, &ring, &out)) {
+		ring_destroy(&ring);
+		download_free(s);
+		s->state = STATE_ERROR;
+		return -1;
+	}
+
+	while (len) {
+		slot = ring_get_free(&ring);
+		if (!slot)
+			break;
+		slot->len = (len > slot->size) ? slot->size : len;
+		r = usb_read(s, slot->buf, slot->len);
+		if ((r < 0) || ((unsigned)r != slot->len)) {
+			pr_error("fastboot: stream error, got %d of %zu bytes\n",
+					r, slot->len);
+			s->state = STATE_ERROR;
+			ring_abort(&ring);
+			break;
+		}
+		len -= slot->len;
+		ring_put_full(&ring);
+	}
+	ring_writer_finish(&w);
+	ring_destroy(&ring);
+	blk_writer_close(&out);
+
+	/* If the writer gave up, swallow the rest of the transfer */
+	download_discard(s, len, s->download_base, slot_size);
+
+	download_free(s);
+	if (len || w.ret)
+		return -1;
+	return 0;
+}
+
+static void fastboot_command_loop(struct fastboot_session *s)
 {
 	struct fastboot_cmd *cmd;
+	unsigned char *buffer = s->buffer;
+	double start;
 	int r;
 	pr_debug("fastboot: processing commands\n");
 
 again:
-	while (fastboot_state != STATE_ERROR) {
+	while (s->state != STATE_ERROR) {
 		memset(buffer, 0, MAGIC_LENGTH);
-		r = usb_read(buffer, MAGIC_LENGTH);
+		r = read_command(s, buffer);
 		if (r < 0)
 			break;
 		buffer[r] = 0;
 		pr_debug("fastboot got command: %s\n", buffer);
 
-		for (cmd = cmdlist; cmd; cmd = cmd->next) {
-			if (memcmp(buffer, cmd->prefix, cmd->prefix_len))
-				continue;
-			fastboot_state = STATE_COMMAND;
-			ui_show_indeterminate_progress();
-			pthread_mutex_lock(&action_mutex);
+		cmd = find_command((char *)buffer);
+		if (cmd) {
+			start = get_time();
+			s->state = STATE_COMMAND;
+			if (!(cmd->flags & FASTBOOT_NO_UI))
+				ui_show_indeterminate_progress();
+			if (!(cmd->flags & FASTBOOT_NO_DISK))
+				pthread_mutex_lock(&action_mutex);
 			cmd->handle((char *)buffer + cmd->prefix_len,
-				    (void *)download_base, download_size);
-			pthread_mutex_unlock(&action_mutex);
-			ui_reset_progress();
-			if (fastboot_state == STATE_COMMAND)
+				    s->download_base, s->download_size);
+			if (!(cmd->flags & FASTBOOT_NO_DISK))
+				pthread_mutex_unlock(&action_mutex);
+			if (!(cmd->flags & FASTBOOT_NO_UI))
+				ui_reset_progress();
+			if (s->state == STATE_COMMAND)
 				fastboot_fail("unknown reason");
+			latency_add((cmd->flags & FASTBOOT_READ_ONLY) ==
+					FASTBOOT_READ_ONLY ? &fast_latency :
+					&slow_latency, get_time() - start);
 			goto again;
 		}
 		pr_error("unknown command '%s'\n", buffer);
+		s->state = STATE_COMMAND;
 		fastboot_fail("unknown command");
 
 	}
-	fastboot_state = STATE_OFFLINE;
+	s->state = STATE_OFFLINE;
+}
+
+/* Framed TCP clients open with "FBnn"; anything else is a legacy client
+ * speaking the raw USB protocol over the stream */
+static int tcp_handshake(struct fastboot_session *s)
+{
+	char hs[TCP_HANDSHAKE_LEN];
+	ssize_t r;
+
+	do {
+		r = recv(s->fd, hs, sizeof(hs), MSG_PEEK | MSG_WAITALL);
+	} while (r < 0 && errno == EINTR);
+	if (r < 0) {
+		pr_perror("recv");
+		return -1;
+	}
+	if (r < TCP_HANDSHAKE_LEN || memcmp(hs, "FB", 2)) {
+		pr_debug("fastboot: raw TCP session\n");
+		return 0;
+	}
+
+	if (read_full(s->fd, hs, sizeof(hs)))
+		return -1;
+	if (!isdigit(hs[2]) || !isdigit(hs[3]) || atoi(hs + 2) < 1) {
+		pr_error("fastboot: bad TCP handshake\n");
+		return -1;
+	}
+	if (write(s->fd, TCP_HANDSHAKE, TCP_HANDSHAKE_LEN) != TCP_HANDSHAKE_LEN) {
+		pr_perror("write");
+		return -1;
+	}
+	s->framed = 1;
+	pr_debug("fastboot: framed TCP session\n");
+	return 0;
+}
+
+static void *session_thread(void *arg)
+{
+	struct fastboot_session *s = arg;
+	char c = 0;
+
+	pthread_setspecific(session_key, s);
+	if (s->is_usb || !tcp_handshake(s))
+		fastboot_command_loop(s);
+	download_free(s);
+	free(s->upload_data);
+	if (s->use_ffs)
+		usb_ffs_close(&s->ffs);
+	else
+		close(s->fd);
+
+	if (s->is_usb && write(wake_pipe[1], &c, 1) != 1)
+		pr_perror("write");
+	free(s);
+	return NULL;
+}
+
+/* ffs is given for FunctionFS USB sessions, fd for anything else */
+static int session_start(int fd, int is_usb, struct usb_ffs *ffs)
+{
+	struct fastboot_session *s;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	s = xmalloc(sizeof(*s));
+	memset(s, 0, sizeof(*s));
+	s->fd = fd;
+	s->wfd = fd;
+	s->is_usb = is_usb;
+	if (ffs) {
+		s->use_ffs = 1;
+		s->ffs = *ffs;
+		s->fd = ffs->ep_out;
+		s->wfd = ffs->ep_in;
+	}
+	s->state = STATE_OFFLINE;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, session_thread, s);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		pr_error("Can't start fastboot session: %s\n", strerror(ret));
+		if (ffs)
+			usb_ffs_close(ffs);
+		else
+			close(fd);
+		free(s);
+		return -1;
+	}
+	return 0;
 }
 
 static int open_tcp(void)
 {
 	pr_verbose("Beginning TCP init\n");
 	int tcp_fd = -1;
-	int portno = 1234;
+	int on = 1;
+	int rcvbuf = TCP_RCVBUF;
 	struct sockaddr_in serv_addr;
 
 	pr_verbose("Allocating socket\n");
@@ -298,10 +1212,18 @@ static int open_tcp(void)
 		return -1;
 	}
 
-	memset(&serv_addr, sizeof(serv_addr), 0);
+	/* Rebind straight away after a restart. The receive buffer has to
+	 * be sized before listen() for the window scale to take it into
+	 * account; accepted sockets inherit it. */
+	if (setsockopt(tcp_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)))
+		pr_perror("SO_REUSEADDR");
+	if (setsockopt(tcp_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)))
+		pr_perror("SO_RCVBUF");
+
+	memset(&serv_addr, 0, sizeof(serv_addr));
 	serv_addr.sin_family = AF_INET;
 	serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	serv_addr.sin_port = htons(portno);
+	serv_addr.sin_port = htons(tcp_port);
 	pr_verbose("Binding socket\n");
 	if (bind(tcp_fd, (struct sockaddr *) &serv_addr,
 		 sizeof(serv_addr)) < 0) {
@@ -317,7 +1239,7 @@ static int open_tcp(void)
 		return -1;
 	}
 
-	pr_info("Listening on TCP port %d\n", portno);
+	pr_info("Listening on TCP port %d\n", tcp_port);
 	return tcp_fd;
 }
 
@@ -345,16 +1267,35 @@ static int fastboot_handler(void *arg)
 {
 	int usb_fd_idx = 0;
 	int tcp_fd_idx = 1;
-	int const nfds = 2;
+	int wake_fd_idx = 2;
+	int const nfds = 3;
 	struct pollfd fds[nfds];
+	int usb_busy = 0;
+	int timeout;
+	char c;
 
-	memset(&fds, sizeof fds, 0);
+	memset(&fds, 0, sizeof fds);
 
 	fds[usb_fd_idx].fd = -1;
 	fds[tcp_fd_idx].fd = -1;
+	fds[wake_fd_idx].fd = wake_pipe[0];
+	fds[wake_fd_idx].events = POLLIN;
 
 	for (;;) {
-		if (fds[usb_fd_idx].fd == -1)
+		/* FunctionFS endpoints can't be polled; a session is
+		 * started right away and blocks until the host shows up */
+		timeout = -1;
+		if (usb_ffs_mode && !usb_busy) {
+			struct usb_ffs ffs;
+
+			if (!usb_ffs_init() && !usb_ffs_open(&ffs) &&
+					!session_start(-1, 1, &ffs))
+				usb_busy = 1;
+			else
+				timeout = 1000;
+		}
+
+		if (fds[usb_fd_idx].fd == -1 && !usb_busy && !usb_ffs_mode)
 			fds[usb_fd_idx].fd = open_usb();
 		if (fds[tcp_fd_idx].fd == -1)
 			fds[tcp_fd_idx].fd = open_tcp();
@@ -364,42 +1305,62 @@ static int fastboot_handler(void *arg)
 		if (fds[tcp_fd_idx].fd >= 0)
 			fds[tcp_fd_idx].events |= POLLIN;
 
-		while (poll(fds, nfds, -1) == -1) {
+		while (poll(fds, nfds, timeout) == -1) {
 			if (errno == EINTR)
 				continue;
 			pr_error("Poll failed: %s\n", strerror(errno));
 			return -1;
 		}
 
+		/* The USB session ended; listen on the device node again */
+		if (fds[wake_fd_idx].revents & POLLIN) {
+			if (read(wake_pipe[0], &c, 1) == 1)
+				usb_busy = 0;
+		}
+
 		if (fds[usb_fd_idx].revents & POLLIN) {
-			fb_fp = fds[usb_fd_idx].fd;
-			fastboot_command_loop();
-			close(fb_fp);
+			if (!session_start(fds[usb_fd_idx].fd, 1, NULL))
+				usb_busy = 1;
 			fds[usb_fd_idx].fd = -1;
+			fds[usb_fd_idx].revents = 0;
 		}
 
 		if (fds[tcp_fd_idx].revents & POLLIN) {
-			fb_fp = accept(fds[tcp_fd_idx].fd, NULL, NULL);
-			if (fb_fp < 0)
+			int fd = accept(fds[tcp_fd_idx].fd, NULL, NULL);
+			int on = 1;
+
+			if (fd < 0) {
 				pr_error("Accept failure: %s\n", strerror(errno));
-			else
-				fastboot_command_loop();
-			close(fb_fp);
+			} else {
+				/* Responses are small and latency bound */
+				if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+							&on, sizeof(on)))
+					pr_perror("TCP_NODELAY");
+				session_start(fd, 0, NULL);
+			}
 		}
-		fb_fp = -1;
 	}
 	return 0;
 }
 
-int fastboot_init(unsigned size)
+int fastboot_init(unsigned size, int port, int ffs)
 {
 	pr_verbose("fastboot_init()\n");
-	download_max = size;
-	download_base = xmalloc(size);
-
-	fastboot_register("getvar:", cmd_getvar);
-	fastboot_register("download:", cmd_download);
+	scratch_max = size;
+	tcp_port = port;
+	usb_ffs_mode = ffs;
+	if (pthread_key_create(&session_key, NULL))
+		die_errno("pthread_key_create");
+	if (pipe(wake_pipe))
+		die_errno("pipe");
+
+	fastboot_register_flags("getvar:", cmd_getvar, FASTBOOT_READ_ONLY);
+	fastboot_register_flags("download:", cmd_download, FASTBOOT_NO_DISK);
+	fastboot_register_flags("upload", cmd_upload, FASTBOOT_NO_DISK);
 	fastboot_publish("version", "0.5");
+	fastboot_publish_func("latency-fast", get_fast_latency);
+	fastboot_publish_func("latency-slow", get_slow_latency);
+	fastboot_publish_func("download-crc32c", get_download_crc32c);
 
 	fastboot_handler(NULL);
 
@@ -29,7 +29,12 @@
 #ifndef __APP_FASTBOOT_H
 #define __APP_FASTBOOT_H
 
-int fastboot_init(unsigned buffer_size);
+#include <stddef.h>
+
+/* Serve fastboot over USB and on TCP port tcp_port; never returns.
+ * USB goes through FunctionFS if usb_ffs is set, otherwise through the
+ * android_adb device node. */
+int fastboot_init(unsigned buffer_size, int tcp_port, int usb_ffs);
 
 /* register a command handler 
  * - command handlers will be called if their prefix matches
@@ -39,12 +44,57 @@ int fastboot_init(unsigned buffer_size);
 void fastboot_register(const char *prefix,
                        void (*handle)(char *arg, void *data, unsigned size));
 
-/* Fetch the value of a fastboot_publish variable */
+/* The handler doesn't touch the disks, so it runs without action_mutex
+ * and can be served while another session is flashing */
+#define FASTBOOT_NO_DISK	(1 << 0)
+/* The handler is quick; don't show progress on the screen for it */
+#define FASTBOOT_NO_UI		(1 << 1)
+/* The handler only reports state, like getvar */
+#define FASTBOOT_READ_ONLY	(FASTBOOT_NO_DISK | FASTBOOT_NO_UI)
+
+/* fastboot_register() with FASTBOOT_* flags */
+void fastboot_register_flags(const char *prefix,
+		void (*handle)(char *arg, void *data, unsigned size),
+		unsigned flags);
+
+/* Publish a variable whose value is formatted into buf by func each
+ * time the host asks for it, like the command latency histograms
+ * latency-fast and latency-slow (counts of commands taking under 100us,
+ * 1ms, 10ms, 100ms, 1s and longer) */
+void fastboot_publish_func(const char *name,
+		void (*func)(char *buf, size_t len));
+
+/* Fetch the value of a fastboot_publish variable; NULL for unknown and
+ * fastboot_publish_func variables */
 const char *fastboot_getvar(const char *name);
 
 /* only callable from within a command handler */
 void fastboot_okay(const char *result);
 void fastboot_fail(const char *reason);
+/* Send an INFO line to the host ahead of the final OKAY/FAIL; also only
+ * callable from within a command handler */
+void fastboot_info(const char *info);
+
+/* Receive len bytes of data from the host and write them to fd as they
+ * arrive, with the transfer and the writes running on separate threads.
+ * The download buffer is used as scratch space and is discarded. Only
+ * callable from within a command handler; the handler must still call
+ * fastboot_okay() or fastboot_fail() afterwards. */
+int fastboot_download_to_fd(int fd, unsigned len);
+
+/* SHA-256 of the data of the last download command, computed while it
+ * was received; -1 if there is none. Only callable from within a command
+ * handler. */
+int fastboot_download_sha256(unsigned char *digest);
+
+/* Discard the downloaded data and hand the download buffer's pages back
+ * to the kernel, once a command is done with them */
+void fastboot_release_download(void);
+
+/* Hand data (malloc()ed, now owned by fastboot) to the host on its next
+ * "upload" command, replacing anything staged before. Only callable
+ * from within a command handler. */
+void fastboot_stage_upload(void *data, size_t len);
 
 
 #endif
@@ -0,0 +1,301 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/hashmap.h>
+
+#include "droidboot.h"
+#include "droidboot_ui.h"
+#include "droidboot_util.h"
+#include "finalize.h"
+
+#define JOB_QUEUED	0	/* waiting for its disk */
+#define JOB_RUNNING	1
+#define JOB_DONE	2
+
+/* Checks of partitions on the same disk are serialized by its lock */
+struct finalize_disk {
+	pthread_mutex_t lock;
+};
+
+struct finalize_job {
+	struct finalize_job *next;
+	Volume *vol;
+	struct finalize_disk *disk;
+	int state;
+	int status;
+};
+
+static struct finalize_job *jobs;
+static Hashmap *disks;
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+
+static bool strcompare(void *keyA, void *keyB)
+{
+	return !strcmp(keyA, keyB);
+}
+
+static int strhash(void *key)
+{
+	return hashmapHash(key, strlen((char *)key));
+}
+
+/* Whole disk holding a partition device node, e.g. "mmcblk0" for
+ * /dev/block/by-name/system -> /dev/block/mmcblk0p5 */
+static char *disk_name(const char *device)
+{
+	char path[PATH_MAX];
+	char *name;
+	size_t len;
+
+	if (!realpath(device, path)) {
+		strncpy(path, device, sizeof(path) - 1);
+		path[sizeof(path) - 1] = '\0';
+	}
+	name = strrchr(path, '/');
+	name = xstrdup(name ? name + 1 : path);
+
+	len = strlen(name);
+	while (len && name[len - 1] >= '0' && name[len - 1] <= '9')
+		len--;
+	if (len > 1 && name[len - 1] == 'p' &&
+			name[len - 2] >= '0' && name[len - 2] <= '9')
+		len--;
+	if (len)
+		name[len] = '\0';
+	return name;
+}
+
+/* Called with jobs_lock held */
+static struct finalize_disk *get_disk(const char *device)
+{
+	struct finalize_disk *disk;
+	char *name;
+
+	if (!disks)
+		disks = hashmapCreate(4, strhash, strcompare);
+	if (!disks) {
+		pr_error("Memory allocation error\n");
+		die();
+	}
+
+	name = disk_name(device);
+	disk = hashmapGet(disks, name);
+	if (disk) {
+		free(name);
+		return disk;
+	}
+	disk = xmalloc(sizeof(*disk));
+	pthread_mutex_init(&disk->lock, NULL);
+	hashmapPut(disks, name, disk);
+	return disk;
+}
+
+/* Called with jobs_lock held */
+static struct finalize_job *find_job(Volume *vol)
+{
+	struct finalize_job *job;
+
+	for (job = jobs; job; job = job->next)
+		if (job->vol == vol)
+			return job;
+	return NULL;
+}
+
+static const char *vol_name(Volume *vol)
+{
+	const char *name = vol->mount_point;
+
+	return name[0] == '/' ? name + 1 : name;
+}
+
+static void *finalize_thread(void *arg)
+{
+	struct finalize_job *job = arg;
+	double start;
+	int ret;
+
+	pthread_mutex_lock(&job->disk->lock);
+	pthread_mutex_lock(&jobs_lock);
+	job->state = JOB_RUNNING;
+	pthread_mutex_unlock(&jobs_lock);
+
+	start = get_time();
+	ret = ext4_filesystem_checks(job->vol);
+	pthread_mutex_unlock(&job->disk->lock);
+
+	if (ret)
+		pr_error("%s: filesystem checks failed\n", vol_name(job->vol));
+	else
+		pr_info("%s: filesystem checks done in %.1fs\n",
+				vol_name(job->vol), get_time() - start);
+
+	pthread_mutex_lock(&jobs_lock);
+	job->status = ret;
+	job->state = JOB_DONE;
+	pthread_cond_broadcast(&jobs_cond);
+	pthread_mutex_unlock(&jobs_lock);
+	return NULL;
+}
+
+/* Called with jobs_lock held */
+static int wait_job(struct finalize_job *job)
+{
+	while (job->state != JOB_DONE)
+		pthread_cond_wait(&jobs_cond, &jobs_lock);
+	return job->status;
+}
+
+/* Called with jobs_lock held, once the job is done */
+static void unlink_job(struct finalize_job *job)
+{
+	struct finalize_job **p;
+
+	for (p = &jobs; *p; p = &(*p)->next) {
+		if (*p == job) {
+			*p = job->next;
+			return;
+		}
+	}
+}
+
+static void remove_job(struct finalize_job *job)
+{
+	unlink_job(job);
+	free(job);
+}
+
+int finalize_start(Volume *vol)
+{
+	struct finalize_job *job;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	finalize_discard(vol);
+
+	job = xmalloc(sizeof(*job));
+	job->vol = vol;
+	job->state = JOB_QUEUED;
+	job->status = 0;
+
+	pthread_mutex_lock(&jobs_lock);
+	job->disk = get_disk(vol->device);
+	job->next = jobs;
+	jobs = job;
+	pthread_mutex_unlock(&jobs_lock);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, finalize_thread, job);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		pr_error("pthread_create: %s\n", strerror(ret));
+		pthread_mutex_lock(&jobs_lock);
+		remove_job(job);
+		pthread_mutex_unlock(&jobs_lock);
+		return -1;
+	}
+	pr_debug("%s: filesystem checks deferred\n", vol_name(vol));
+	return 0;
+}
+
+int finalize_wait(Volume *vol)
+{
+	struct finalize_job *job;
+	int ret = 0;
+
+	pthread_mutex_lock(&jobs_lock);
+	job = find_job(vol);
+	if (job)
+		ret = wait_job(job);
+	pthread_mutex_unlock(&jobs_lock);
+	return ret;
+}
+
+int finalize_discard(Volume *vol)
+{
+	struct finalize_job *job;
+	int ret = 0;
+
+	pthread_mutex_lock(&jobs_lock);
+	job = find_job(vol);
+	if (job) {
+		ret = wait_job(job);
+		remove_job(job);
+	}
+	pthread_mutex_unlock(&jobs_lock);
+	return ret;
+}
+
+int finalize_wait_all(void (*report)(Volume *vol))
+{
+	struct finalize_job *job, *failed = NULL, **tail = &failed;
+	int ret = 0;
+
+	/* Failed jobs are reported once jobs_lock is dropped, so that
+	 * report doesn't run with the lock held */
+	pthread_mutex_lock(&jobs_lock);
+	while (jobs) {
+		job = jobs;
+		if (!wait_job(job)) {
+			remove_job(job);
+			continue;
+		}
+		unlink_job(job);
+		job->next = NULL;
+		*tail = job;
+		tail = &job->next;
+	}
+	pthread_mutex_unlock(&jobs_lock);
+
+	while (failed) {
+		job = failed;
+		failed = job->next;
+		ret = -1;
+		if (report)
+			report(job->vol);
+		free(job);
+	}
+	return ret;
+}
+
+void finalize_status(char *buf, size_t len)
+{
+	static const char *states[] = { "queued", "running" };
+	struct finalize_job *job;
+	size_t pos = 0;
+	int r;
+
+	pthread_mutex_lock(&jobs_lock);
+	snprintf(buf, len, "idle");
+	for (job = jobs; job && pos < len; job = job->next) {
+		r = snprintf(buf + pos, len - pos, "%s%s:%s", pos ? " " : "",
+				vol_name(job->vol),
+				job->state != JOB_DONE ? states[job->state] :
+				job->status ? "failed" : "ok");
+		if (r < 0)
+			break;
+		pos += r;
+	}
+	pthread_mutex_unlock(&jobs_lock);
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DROIDBOOT_FINALIZE_H
+#define DROIDBOOT_FINALIZE_H
+
+#include <stddef.h>
+
+#include "droidboot_fstab.h"
+
+/* Deferred post-flash filesystem checks (fsck, resize, mount count).
+ * They run on background threads so that the host gets its OKAY as soon
+ * as the data is on disk; partitions on the same disk are checked one
+ * after another, different disks in parallel. Except for
+ * finalize_status(), these are called from command handlers holding
+ * action_mutex. */
+
+/* Queue the checks for a freshly written volume */
+int finalize_start(Volume *vol);
+
+/* Wait for the pending checks of vol, if any, and return their status.
+ * finalize_discard() also forgets about them, before vol is rewritten. */
+int finalize_wait(Volume *vol);
+int finalize_discard(Volume *vol);
+
+/* Wait for every pending check and forget about them. Returns -1 if any
+ * failed, after calling report (if set) for each failed volume. */
+int finalize_wait_all(void (*report)(Volume *vol));
+
+/* One line summary such as "system:ok data:running", or "idle" */
+void finalize_status(char *buf, size_t len);
+
+#endif
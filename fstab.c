@@ -30,6 +30,7 @@
 #include "droidboot.h"
 #include "droidboot_ui.h"
 #include "droidboot_util.h"
+#include "writer.h"
 
 static int num_volumes = 0;
 static Volume *device_volumes = NULL;
@@ -42,6 +43,16 @@ static int parse_options(char *options, Volume * volume)
 
 		if (strncmp(option, "length=", 7) == 0) {
 			volume->length = strtoll(option + 7, NULL, 10);
+		} else if (strncmp(option, "engine=", 7) == 0) {
+			volume->write_engine = write_engine_parse(option + 7);
+			if (volume->write_engine < 0) {
+				pr_error("bad write engine \"%s\"\n", option + 7);
+				return -1;
+			}
+		} else if (strncmp(option, "qdepth=", 7) == 0) {
+			volume->write_depth = strtol(option + 7, NULL, 10);
+		} else if (strncmp(option, "regions=", 8) == 0) {
+			volume->write_regions = strtol(option + 8, NULL, 10);
 		} else {
 			pr_error("bad option \"%s\"\n", option);
 			return -1;
@@ -66,6 +77,9 @@ void load_volume_table()
 	device_volumes[0].device = NULL;
 	device_volumes[0].device2 = NULL;
 	device_volumes[0].length = 0;
+	device_volumes[0].write_engine = WRITE_BUFFERED;
+	device_volumes[0].write_depth = 0;
+	device_volumes[0].write_regions = 0;
 	num_volumes = 1;
 
 	property_get("ro.boot.recovery.fstab", fstab_path,
@@ -119,6 +133,9 @@ void load_volume_table()
 			    device2 ? strdup(device2) : NULL;
 
 			device_volumes[num_volumes].length = 0;
+			device_volumes[num_volumes].write_engine = WRITE_BUFFERED;
+			device_volumes[num_volumes].write_depth = 0;
+			device_volumes[num_volumes].write_regions = 0;
 			if (parse_options(options, device_volumes + num_volumes)
 			    != 0) {
 				pr_error("skipping malformed recovery.fstab line: %s\n", buffer);
@@ -182,3 +199,10 @@ Volume *volume_for_device(const char *device)
 	}
 	return NULL;
 }
+
+Volume *volume_at(int i)
+{
+	if (i < 0 || i >= num_volumes)
+		return NULL;
+	return device_volumes + i;
+}
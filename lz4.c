@@ -0,0 +1,156 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* LZ4 block and frame decoder, written from the format descriptions
+ * published with the reference implementation */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "droidboot_ui.h"
+#include "lz4.h"
+#include "xxhash.h"
+
+#define corrupt(msg) do { \
+	pr_error("lz4: %s\n", msg); \
+	return -1; \
+	} while (0)
+
+static inline uint32_t le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+int lz4_frame_info(const unsigned char *src, size_t len,
+		struct lz4_frame_info *fi)
+{
+	size_t pos = 6;
+	int flg, bd, i;
+
+	if (len < 7 || le32(src) != LZ4_MAGIC)
+		corrupt("bad frame magic");
+
+	flg = src[4];
+	bd = src[5];
+	if ((flg >> 6) != 1)
+		corrupt("unsupported frame version");
+	if ((flg & 0x02) || (bd & 0x8F))
+		corrupt("reserved frame descriptor bits set");
+	if (flg & 0x01)
+		corrupt("dictionaries are not supported");
+	if (((bd >> 4) & 7) < 4)
+		corrupt("bad block maximum size");
+
+	fi->independent = (flg >> 5) & 1;
+	fi->block_checksum = (flg >> 4) & 1;
+	fi->has_content_size = (flg >> 3) & 1;
+	fi->content_checksum = (flg >> 2) & 1;
+	fi->block_max = 1 << (8 + 2 * ((bd >> 4) & 7));
+
+	fi->content_size = 0;
+	if (fi->has_content_size) {
+		if (len < pos + 8 + 1)
+			corrupt("truncated frame descriptor");
+		for (i = 7; i >= 0; i--)
+			fi->content_size = (fi->content_size << 8) |
+				src[pos + i];
+		pos += 8;
+	}
+
+	if (src[pos] != ((xxh32(src + 4, pos - 4, 0) >> 8) & 0xFF))
+		corrupt("frame descriptor checksum mismatch");
+	fi->header_len = pos + 1;
+	return 0;
+}
+
+static inline void copy_match(unsigned char *dst, size_t offset, size_t len)
+{
+	const unsigned char *src = dst - offset;
+
+	if (offset >= len) {
+		memcpy(dst, src, len);
+		return;
+	}
+	if (offset >= 8) {
+		while (len >= 8) {
+			memcpy(dst, src, 8);
+			dst += 8;
+			src += 8;
+			len -= 8;
+		}
+	}
+	while (len--)
+		*dst++ = *src++;
+}
+
+ssize_t lz4_decompress_block(const unsigned char *src, size_t len,
+		unsigned char *dst, size_t cap, size_t hist)
+{
+	const unsigned char *p = src;
+	const unsigned char *end = src + len;
+	unsigned char *op = dst;
+	size_t ll, ml, offset;
+	unsigned token, b;
+
+	while (p < end) {
+		token = *p++;
+
+		ll = token >> 4;
+		if (ll == 15) {
+			do {
+				if (p >= end)
+					corrupt("truncated literal length");
+				b = *p++;
+				ll += b;
+			} while (b == 255);
+		}
+		if (ll > (size_t)(end - p) || ll > cap - (op - dst))
+			corrupt("literals out of range");
+		memcpy(op, p, ll);
+		op += ll;
+		p += ll;
+
+		/* The last sequence has literals only */
+		if (p == end)
+			break;
+
+		if (end - p < 2)
+			corrupt("truncated match offset");
+		offset = p[0] | (p[1] << 8);
+		p += 2;
+		if (!offset || offset > (size_t)(op - dst) + hist)
+			corrupt("match offset out of range");
+
+		ml = token & 15;
+		if (ml == 15) {
+			do {
+				if (p >= end)
+					corrupt("truncated match length");
+				b = *p++;
+				ml += b;
+			} while (b == 255);
+		}
+		ml += 4;
+		if (ml > cap - (op - dst))
+			corrupt("match out of range");
+		copy_match(op, offset, ml);
+		op += ml;
+	}
+	return op - dst;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DROIDBOOT_LZ4_H
+#define DROIDBOOT_LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* LZ4 frame format decoder. Legacy frames and dictionaries are not
+ * supported. */
+
+#define LZ4_MAGIC		0x184D2204
+#define LZ4_SKIPPABLE_MAGIC	0x184D2A50
+#define LZ4_SKIPPABLE_MASK	0xFFFFFFF0
+
+/* Blocks may reference up to this much of the previous block's output */
+#define LZ4_HISTORY		(64 * 1024)
+
+struct lz4_frame_info {
+	int independent;	/* blocks don't reference earlier blocks */
+	int block_checksum;
+	int content_checksum;
+	int has_content_size;
+	uint64_t content_size;
+	size_t block_max;
+	size_t header_len;
+};
+
+/* Parse the frame descriptor at src */
+int lz4_frame_info(const unsigned char *src, size_t len,
+		struct lz4_frame_info *fi);
+
+/* Decode one compressed block into dst. Matches may reach back hist
+ * bytes before dst, for blocks of a linked frame. Returns the decoded
+ * size or -1 if the block is corrupt. */
+ssize_t lz4_decompress_block(const unsigned char *src, size_t len,
+		unsigned char *dst, size_t cap, size_t hist);
+
+#endif
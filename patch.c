@@ -0,0 +1,226 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "applypatch/applypatch.h"
+#include "mincrypt/sha.h"
+
+#include "patch.h"
+#include "droidboot_ui.h"
+#include "droidboot_util.h"
+
+struct patch_source {
+	int fd;
+	void *map;
+	size_t map_len;
+	const unsigned char *data;
+};
+
+struct patch_sink {
+	unsigned char *buf;
+	uint64_t len;
+	uint64_t size;
+};
+
+int patch_parse_sha1(const char *str, uint8_t *digest)
+{
+	unsigned i;
+	int hi, lo;
+
+	if (strlen(str) != 2 * SHA_DIGEST_SIZE)
+		return -1;
+	for (i = 0; i < SHA_DIGEST_SIZE; i++) {
+		if (sscanf(str + 2 * i, "%1x%1x", &hi, &lo) != 2)
+			return -1;
+		digest[i] = hi << 4 | lo;
+	}
+	return 0;
+}
+
+/* bionic has no mmap64(); mmap2 takes the offset in 4096 byte units */
+static void *mmap_read(size_t len, int fd, off64_t offset)
+{
+#if defined(__LP64__)
+	return mmap(NULL, len, PROT_READ, MAP_SHARED, fd, offset);
+#else
+	return (void *)syscall(__NR_mmap2, NULL, len, PROT_READ, MAP_SHARED,
+			fd, (unsigned long)(offset >> 12));
+#endif
+}
+
+/* Map the source bytes of device. The page cache brings them in as the
+ * patch touches them, so the source never has to fit in memory. */
+static int source_map(const char *device, const struct patch_spec *spec,
+		struct patch_source *src)
+{
+	off64_t start;
+	long page = sysconf(_SC_PAGESIZE);
+
+	if (!spec->source_size) {
+		pr_error("patch source is empty\n");
+		return -1;
+	}
+	if ((uint64_t)(size_t)spec->source_size != spec->source_size) {
+		pr_error("source of %llu bytes is too large to map\n",
+				(unsigned long long)spec->source_size);
+		return -1;
+	}
+	src->fd = open(device, O_RDONLY);
+	if (src->fd < 0) {
+		pr_error("Can't open %s: %s\n", device, strerror(errno));
+		return -1;
+	}
+	start = spec->offset - spec->offset % page;
+	src->map_len = spec->source_size + (spec->offset - start);
+	src->map = mmap_read(src->map_len, src->fd, start);
+	if (src->map == MAP_FAILED) {
+		pr_perror("mmap");
+		close(src->fd);
+		return -1;
+	}
+	src->data = (unsigned char *)src->map + (spec->offset - start);
+	return 0;
+}
+
+static void source_unmap(struct patch_source *src)
+{
+	munmap(src->map, src->map_len);
+	close(src->fd);
+}
+
+int patch_check_source(const char *device, const struct patch_spec *spec)
+{
+	struct patch_source src;
+	SHA_CTX ctx;
+	uint64_t done;
+	size_t xfer;
+	int ret;
+
+	if (source_map(device, spec, &src))
+		return -1;
+	madvise(src.map, src.map_len, MADV_SEQUENTIAL);
+	/* SHA_update() takes an int length */
+	SHA_init(&ctx);
+	for (done = 0; done < spec->source_size; done += xfer) {
+		xfer = spec->source_size - done;
+		if (xfer > (1 << 30))
+			xfer = 1 << 30;
+		SHA_update(&ctx, src.data + done, xfer);
+	}
+	ret = memcmp(SHA_final(&ctx), spec->source_sha1, SHA_DIGEST_SIZE) ?
+		-1 : 0;
+	source_unmap(&src);
+	if (ret)
+		pr_error("%s doesn't hold the patch's source image\n", device);
+	return ret;
+}
+
+static ssize_t memory_sink(const unsigned char *data, ssize_t len,
+		void *token)
+{
+	struct patch_sink *sink = token;
+
+	if (len < 0 || (uint64_t)len > sink->size - sink->len) {
+		pr_error("patch output exceeds target size of %llu bytes\n",
+				(unsigned long long)sink->size);
+		return -1;
+	}
+	memcpy(sink->buf + sink->len, data, len);
+	sink->len += len;
+	return len;
+}
+
+int patch_apply(const char *device, int type, unsigned char *patch,
+		size_t len, const struct patch_spec *spec,
+		unsigned char **out)
+{
+	struct patch_source src;
+	struct patch_sink sink;
+	Value value;
+	SHA_CTX ctx;
+	void *buf;
+	int ret;
+
+	if (!spec->target_size) {
+		pr_error("patch target is empty\n");
+		return -1;
+	}
+	if ((uint64_t)(size_t)spec->target_size != spec->target_size) {
+		pr_error("target of %llu bytes is too large\n",
+				(unsigned long long)spec->target_size);
+		return -1;
+	}
+	buf = mmap(NULL, spec->target_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (buf == MAP_FAILED) {
+		pr_perror("mmap");
+		return -1;
+	}
+	if (source_map(device, spec, &src)) {
+		munmap(buf, spec->target_size);
+		return -1;
+	}
+
+	sink.buf = buf;
+	sink.len = 0;
+	sink.size = spec->target_size;
+	value.type = VAL_BLOB;
+	value.size = len;
+	value.data = (char *)patch;
+	SHA_init(&ctx);
+
+	if (type == PATCH_IMGDIFF)
+		ret = ApplyImagePatch(src.data, spec->source_size, &value,
+				memory_sink, &sink, &ctx, NULL);
+	else
+		ret = ApplyBSDiffPatch(src.data, spec->source_size, &value, 0,
+				memory_sink, &sink, &ctx);
+	source_unmap(&src);
+
+	if (ret) {
+		pr_error("applying the patch failed\n");
+	} else if (sink.len != spec->target_size) {
+		pr_error("patch produced %llu bytes, expected %llu\n",
+				(unsigned long long)sink.len,
+				(unsigned long long)spec->target_size);
+		ret = -1;
+	} else if (spec->has_target_sha1 &&
+			memcmp(SHA_final(&ctx), spec->target_sha1,
+				SHA_DIGEST_SIZE)) {
+		pr_error("patched image doesn't match target-sha1\n");
+		ret = -1;
+	}
+	if (ret) {
+		munmap(buf, spec->target_size);
+		return -1;
+	}
+	*out = buf;
+	return 0;
+}
+
+void patch_free(unsigned char *out, const struct patch_spec *spec)
+{
+	munmap(out, spec->target_size);
+}
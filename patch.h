@@ -0,0 +1,59 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DROIDBOOT_PATCH_H
+#define DROIDBOOT_PATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "mincrypt/sha.h"
+
+/* Binary patches against what is on a partition now, applied with
+ * recovery's libapplypatch: bsdiff patches (BSDIFF40) and imgdiff
+ * patches (IMGDIFF2), the latter for images holding gzip streams such
+ * as boot.img */
+
+#define PATCH_BSDIFF	0
+#define PATCH_IMGDIFF	1
+
+struct patch_spec {
+	off64_t offset;		/* of the source and target on the device */
+	uint64_t source_size;
+	uint8_t source_sha1[SHA_DIGEST_SIZE];
+	uint64_t target_size;
+	uint8_t target_sha1[SHA_DIGEST_SIZE];
+	int has_target_sha1;
+};
+
+/* 40 hex digits; -1 if str is anything else */
+int patch_parse_sha1(const char *str, uint8_t *digest);
+
+/* Check that the source bytes on device match spec->source_sha1 */
+int patch_check_source(const char *device, const struct patch_spec *spec);
+
+/* Apply a patch of the given type to the source bytes of device. The
+ * source is mapped rather than read in, and the patched image is built
+ * in memory and checked against spec->target_sha1 (if set) before
+ * anything is written. On success *out holds target_size bytes, to be
+ * released with patch_free(). */
+int patch_apply(const char *device, int type, unsigned char *patch,
+		size_t len, const struct patch_spec *spec,
+		unsigned char **out);
+void patch_free(unsigned char *out, const struct patch_spec *spec);
+
+#endif
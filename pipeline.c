@@ -0,0 +1,266 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "droidboot_ui.h"
+#include "droidboot_util.h"
+#include "pipeline.h"
+#include "writer.h"
+
+enum {
+	JOB_FREE,
+	JOB_QUEUED,
+	JOB_RUNNING,
+	JOB_DONE,
+};
+
+static void *pipeline_worker(void *arg)
+{
+	struct pipeline *p = arg;
+	struct pipeline_job *job;
+	int ret;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (!p->error && !p->stop && p->next_run == p->submitted)
+			pthread_cond_wait(&p->cond, &p->lock);
+		if (p->error || p->next_run == p->submitted)
+			break;
+
+		job = &p->jobs[p->next_run++ % p->njobs];
+		job->state = JOB_RUNNING;
+		pthread_mutex_unlock(&p->lock);
+
+		ret = 0;
+		if (job->src)
+			ret = p->decode(p->decode_arg, job->src, job->src_len,
+					job->dst, p->slot_size, &job->len);
+
+		pthread_mutex_lock(&p->lock);
+		if (ret)
+			p->error = 1;
+		job->state = JOB_DONE;
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+static void *pipeline_writer(void *arg)
+{
+	struct pipeline *p = arg;
+	struct pipeline_job *job;
+	int ret;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		job = &p->jobs[p->next_write % p->njobs];
+		while (!p->error && job->state != JOB_DONE &&
+				!(p->stop && p->next_write == p->submitted))
+			pthread_cond_wait(&p->cond, &p->lock);
+		if (p->error || job->state != JOB_DONE)
+			break;
+		pthread_mutex_unlock(&p->lock);
+
+		ret = 0;
+		if (p->hook)
+			ret = p->hook(p->hook_arg, job->dst, job->len);
+		if (!ret)
+			ret = blk_writer_write(p->out, job->dst, job->len);
+
+		pthread_mutex_lock(&p->lock);
+		if (ret) {
+			p->error = 1;
+		} else {
+			p->bytes += job->len;
+			job->state = JOB_FREE;
+			p->next_write++;
+		}
+		pthread_cond_broadcast(&p->cond);
+		if (ret)
+			break;
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+int pipeline_init(struct pipeline *p, unsigned nworkers, size_t slot_size,
+		struct blk_writer *out, pipeline_decode_fn decode, void *arg)
+{
+	void *mem;
+	unsigned i;
+
+	memset(p, 0, sizeof(*p));
+	if (!nworkers)
+		nworkers = 1;
+	/* Two jobs per worker keeps the workers busy while the writer
+	 * waits on the oldest one */
+	p->njobs = 2 * nworkers;
+	if (posix_memalign(&mem, 4096, p->njobs * slot_size)) {
+		pr_error("Can't allocate %u decompression buffers of %zu bytes\n",
+				p->njobs, slot_size);
+		return -1;
+	}
+	p->mem = mem;
+	p->slot_size = slot_size;
+	p->jobs = xmalloc(p->njobs * sizeof(*p->jobs));
+	for (i = 0; i < p->njobs; i++) {
+		p->jobs[i].state = JOB_FREE;
+		p->jobs[i].dst = p->mem + i * slot_size;
+	}
+	p->workers = xmalloc(nworkers * sizeof(*p->workers));
+	p->decode = decode;
+	p->decode_arg = arg;
+	p->out = out;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+
+	if (pthread_create(&p->writer, NULL, pipeline_writer, p)) {
+		pr_perror("pthread_create");
+		goto err;
+	}
+	for (i = 0; i < nworkers; i++) {
+		if (pthread_create(&p->workers[i], NULL, pipeline_worker, p)) {
+			pr_perror("pthread_create");
+			pipeline_abort(p);
+			p->nworkers = i;
+			pipeline_finish(p);
+			return -1;
+		}
+	}
+	p->nworkers = nworkers;
+	return 0;
+err:
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	free(p->workers);
+	free(p->jobs);
+	free(p->mem);
+	return -1;
+}
+
+static struct pipeline_job *pipeline_get_job(struct pipeline *p)
+{
+	struct pipeline_job *job;
+
+	pthread_mutex_lock(&p->lock);
+	job = &p->jobs[p->submitted % p->njobs];
+	while (!p->error && job->state != JOB_FREE)
+		pthread_cond_wait(&p->cond, &p->lock);
+	if (p->error)
+		job = NULL;
+	pthread_mutex_unlock(&p->lock);
+	return job;
+}
+
+static void pipeline_put_job(struct pipeline *p, struct pipeline_job *job)
+{
+	pthread_mutex_lock(&p->lock);
+	job->state = JOB_QUEUED;
+	p->submitted++;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+int pipeline_submit(struct pipeline *p, const unsigned char *src, size_t len)
+{
+	struct pipeline_job *job = pipeline_get_job(p);
+
+	if (!job)
+		return -1;
+	job->src = src;
+	job->src_len = len;
+	job->len = 0;
+	pipeline_put_job(p, job);
+	return 0;
+}
+
+int pipeline_submit_data(struct pipeline *p, const unsigned char *buf,
+		size_t len)
+{
+	struct pipeline_job *job;
+	size_t n;
+
+	while (len) {
+		job = pipeline_get_job(p);
+		if (!job)
+			return -1;
+		n = (len < p->slot_size) ? len : p->slot_size;
+		memcpy(job->dst, buf, n);
+		job->src = NULL;
+		job->len = n;
+		pipeline_put_job(p, job);
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int pipeline_drain(struct pipeline *p)
+{
+	int ret;
+
+	pthread_mutex_lock(&p->lock);
+	while (!p->error && p->next_write != p->submitted)
+		pthread_cond_wait(&p->cond, &p->lock);
+	ret = p->error ? -1 : 0;
+	pthread_mutex_unlock(&p->lock);
+	return ret;
+}
+
+void pipeline_set_hook(struct pipeline *p, pipeline_hook_fn hook, void *arg)
+{
+	pthread_mutex_lock(&p->lock);
+	p->hook = hook;
+	p->hook_arg = arg;
+	pthread_mutex_unlock(&p->lock);
+}
+
+void pipeline_abort(struct pipeline *p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->error = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+int pipeline_finish(struct pipeline *p)
+{
+	unsigned i;
+	int ret;
+
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+
+	for (i = 0; i < p->nworkers; i++)
+		pthread_join(p->workers[i], NULL);
+	pthread_join(p->writer, NULL);
+
+	ret = p->error ? -1 : 0;
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	free(p->workers);
+	free(p->jobs);
+	free(p->mem);
+	return ret;
+}
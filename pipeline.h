@@ -0,0 +1,89 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DROIDBOOT_PIPELINE_H
+#define DROIDBOOT_PIPELINE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Ordered decompression pipeline. Compressed units (blocks, frames) are
+ * decoded by a pool of worker threads into fixed size job buffers, and a
+ * writer thread writes the results to a file descriptor in submission
+ * order. */
+
+typedef int (*pipeline_decode_fn)(void *arg, const unsigned char *src,
+		size_t len, unsigned char *dst, size_t cap, size_t *out_len);
+/* Called by the writer thread with each decoded buffer, in order */
+typedef int (*pipeline_hook_fn)(void *arg, const unsigned char *buf,
+		size_t len);
+
+struct pipeline_job {
+	int state;
+	const unsigned char *src;	/* NULL if dst already holds data */
+	size_t src_len;
+	unsigned char *dst;
+	size_t len;
+};
+
+struct pipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct pipeline_job *jobs;
+	unsigned njobs;
+	unsigned char *mem;
+	size_t slot_size;
+	pthread_t *workers;
+	unsigned nworkers;
+	pthread_t writer;
+	pipeline_decode_fn decode;
+	void *decode_arg;
+	pipeline_hook_fn hook;
+	void *hook_arg;
+	struct blk_writer *out;
+	uint64_t submitted;	/* jobs handed in by the producer */
+	uint64_t next_run;	/* next job a worker picks up */
+	uint64_t next_write;	/* next job the writer waits for */
+	uint64_t bytes;		/* bytes written so far */
+	int error;
+	int stop;
+};
+
+/* Start nworkers decoding threads and a writer thread for out. Every
+ * decoded unit must fit in slot_size bytes. */
+int pipeline_init(struct pipeline *p, unsigned nworkers, size_t slot_size,
+		struct blk_writer *out, pipeline_decode_fn decode, void *arg);
+
+/* Queue src for decoding; src must stay valid until pipeline_finish().
+ * Returns -1 if the pipeline has failed. */
+int pipeline_submit(struct pipeline *p, const unsigned char *src, size_t len);
+/* Queue data which needs no decoding; it is copied */
+int pipeline_submit_data(struct pipeline *p, const unsigned char *buf,
+		size_t len);
+
+/* Wait until everything submitted has been written */
+int pipeline_drain(struct pipeline *p);
+/* Only valid while the pipeline is drained */
+void pipeline_set_hook(struct pipeline *p, pipeline_hook_fn hook, void *arg);
+
+/* Fail the pipeline from the producer side */
+void pipeline_abort(struct pipeline *p);
+/* Wait for the queued work, stop the threads and free the buffers.
+ * Returns -1 if anything failed. */
+int pipeline_finish(struct pipeline *p);
+
+#endif
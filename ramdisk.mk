@@ -28,6 +28,7 @@ droidboot_modules := \
 	libz \
 	resize2fs \
 	tune2fs \
+	mke2fs \
 	e2fsck \
 	gzip \
 	droidboot \
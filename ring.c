@@ -0,0 +1,160 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "droidboot_ui.h"
+#include "droidboot_util.h"
+#include "ring.h"
+#include "writer.h"
+
+void ring_init(struct ring *r, unsigned nslots, size_t slot_size, void *mem)
+{
+	unsigned i;
+
+	memset(r, 0, sizeof(*r));
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	r->nslots = nslots;
+	r->slots = xmalloc(nslots * sizeof(*r->slots));
+	if (!mem)
+		mem = r->mem = xmalloc(nslots * slot_size);
+
+	for (i = 0; i < nslots; i++) {
+		r->slots[i].buf = (unsigned char *)mem + i * slot_size;
+		r->slots[i].size = slot_size;
+		r->slots[i].len = 0;
+		r->slots[i].offset = 0;
+	}
+}
+
+void ring_destroy(struct ring *r)
+{
+	free(r->slots);
+	free(r->mem);
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+}
+
+struct ring_slot *ring_get_free(struct ring *r)
+{
+	struct ring_slot *slot = NULL;
+
+	pthread_mutex_lock(&r->lock);
+	while (!r->aborted && r->count == r->nslots)
+		pthread_cond_wait(&r->cond, &r->lock);
+	if (!r->aborted)
+		slot = &r->slots[r->head];
+	pthread_mutex_unlock(&r->lock);
+	return slot;
+}
+
+void ring_put_full(struct ring *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->head = (r->head + 1) % r->nslots;
+	r->count++;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+void ring_close(struct ring *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->closed = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+struct ring_slot *ring_get_full(struct ring *r)
+{
+	struct ring_slot *slot = NULL;
+
+	pthread_mutex_lock(&r->lock);
+	while (!r->aborted && !r->closed && r->count == 0)
+		pthread_cond_wait(&r->cond, &r->lock);
+	if (!r->aborted && r->count)
+		slot = &r->slots[r->tail];
+	pthread_mutex_unlock(&r->lock);
+	return slot;
+}
+
+void ring_put_free(struct ring *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->tail = (r->tail + 1) % r->nslots;
+	r->count--;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+void ring_abort(struct ring *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->aborted = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+int ring_aborted(struct ring *r)
+{
+	int ret;
+
+	pthread_mutex_lock(&r->lock);
+	ret = r->aborted;
+	pthread_mutex_unlock(&r->lock);
+	return ret;
+}
+
+static void *ring_writer_thread(void *arg)
+{
+	struct ring_writer *w = arg;
+	struct ring_slot *slot;
+
+	while ((slot = ring_get_full(w->ring))) {
+		if (blk_writer_write(w->out, slot->buf, slot->len)) {
+			w->ret = -1;
+			ring_abort(w->ring);
+			break;
+		}
+		ring_put_free(w->ring);
+	}
+	return NULL;
+}
+
+int ring_writer_start(struct ring_writer *w, struct ring *r,
+		struct blk_writer *out)
+{
+	w->ring = r;
+	w->out = out;
+	w->ret = 0;
+	if (pthread_create(&w->thread, NULL, ring_writer_thread, w)) {
+		pr_perror("pthread_create");
+		return -1;
+	}
+	return 0;
+}
+
+int ring_writer_finish(struct ring_writer *w)
+{
+	ring_close(w->ring);
+	pthread_join(w->thread, NULL);
+	return w->ret;
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DROIDBOOT_RING_H
+#define DROIDBOOT_RING_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+/* Bounded single-producer/single-consumer queue of fixed size buffers,
+ * used to overlap a data source (USB, decompression) with a sink (block
+ * device writes). Slots are handed out and returned in FIFO order. */
+
+struct ring_slot {
+	unsigned char *buf;
+	size_t size;		/* capacity of buf */
+	size_t len;		/* bytes of valid data in buf */
+	off_t offset;		/* destination offset, if the user needs one */
+};
+
+struct ring {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct ring_slot *slots;
+	unsigned char *mem;	/* backing store, if allocated by ring_init */
+	unsigned nslots;
+	unsigned head;		/* next slot the producer fills */
+	unsigned tail;		/* next slot the consumer drains */
+	unsigned count;		/* number of filled slots */
+	int closed;
+	int aborted;
+};
+
+/* Set up a ring of nslots buffers of slot_size bytes each. If mem is
+ * NULL the buffers are allocated, otherwise mem must point to at least
+ * nslots * slot_size bytes owned by the caller. */
+void ring_init(struct ring *r, unsigned nslots, size_t slot_size, void *mem);
+void ring_destroy(struct ring *r);
+
+/* Producer side. ring_get_free() blocks until a slot is available and
+ * returns NULL if the ring was aborted. */
+struct ring_slot *ring_get_free(struct ring *r);
+void ring_put_full(struct ring *r);
+/* No more data will be produced */
+void ring_close(struct ring *r);
+
+/* Consumer side. ring_get_full() blocks until data is available and
+ * returns NULL once the ring is closed and drained, or aborted. */
+struct ring_slot *ring_get_full(struct ring *r);
+void ring_put_free(struct ring *r);
+
+/* Either side gives up; wakes up and fails the other side */
+void ring_abort(struct ring *r);
+int ring_aborted(struct ring *r);
+
+struct blk_writer;
+
+/* Consumer thread which writes every slot to out, in order */
+struct ring_writer {
+	struct ring *ring;
+	pthread_t thread;
+	struct blk_writer *out;
+	int ret;
+};
+
+int ring_writer_start(struct ring_writer *w, struct ring *r,
+		struct blk_writer *out);
+/* Close the ring, wait for the writer to drain it and return its status */
+int ring_writer_finish(struct ring_writer *w);
+
+#endif
@@ -0,0 +1,264 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host check of the lz4 and zstd decoders: decode a file written by the
+ * reference lz4 or zstd tool and compare it with the original.
+ *
+ *     decode_test <compressed> <original>
+ *
+ * lz4 frames are walked as named_file_write_decompress_lz4() does.
+ * zstd frames are decoded both whole, when their size is known, and
+ * through the windowed stream decoder. See decode_test.sh. */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "lz4.h"
+#include "xxhash.h"
+#include "zstd.h"
+
+struct buf {
+	unsigned char *data;
+	size_t len;
+	size_t cap;
+};
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int read_file(const char *path, struct buf *b)
+{
+	FILE *f;
+	size_t n;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	b->len = 0;
+	b->cap = 1024 * 1024;
+	b->data = malloc(b->cap);
+	while (b->data && (n = fread(b->data + b->len, 1, b->cap - b->len,
+					f)) > 0) {
+		b->len += n;
+		if (b->len == b->cap) {
+			b->cap *= 2;
+			b->data = realloc(b->data, b->cap);
+		}
+	}
+	fclose(f);
+	if (!b->data) {
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int buf_append(void *arg, const unsigned char *data, size_t len)
+{
+	struct buf *b = arg;
+
+	if (len > b->cap - b->len) {
+		fprintf(stderr, "output exceeds the original\n");
+		return -1;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+	return 0;
+}
+
+static int decode_lz4(const unsigned char *p, const unsigned char *end,
+		struct buf *out)
+{
+	struct lz4_frame_info fi;
+	struct xxh32_state xxh;
+	unsigned frames = 0;
+	size_t start, bsize, csum, cap;
+	ssize_t n;
+	int raw;
+
+	while (end - p >= 4) {
+		uint32_t magic = get_le32(p);
+
+		if ((magic & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE_MAGIC) {
+			if (end - p < 8 ||
+					get_le32(p + 4) > (size_t)(end - p) - 8)
+				return -1;
+			p += 8 + get_le32(p + 4);
+			continue;
+		}
+		if (magic != LZ4_MAGIC && frames)
+			break;
+		if (lz4_frame_info(p, end - p, &fi))
+			return -1;
+		p += fi.header_len;
+		start = out->len;
+
+		for (;;) {
+			if (end - p < 4)
+				return -1;
+			bsize = get_le32(p);
+			p += 4;
+			if (!bsize)
+				break;
+			raw = !!(bsize & 0x80000000);
+			bsize &= 0x7FFFFFFF;
+			csum = fi.block_checksum ? 4 : 0;
+			if (bsize > fi.block_max ||
+					bsize + csum > (size_t)(end - p))
+				return -1;
+			if (csum && xxh32(p, bsize, 0) != get_le32(p + bsize)) {
+				fprintf(stderr, "lz4 block checksum mismatch\n");
+				return -1;
+			}
+			cap = out->cap - out->len;
+			if (cap > fi.block_max)
+				cap = fi.block_max;
+			if (raw) {
+				if (buf_append(out, p, bsize))
+					return -1;
+			} else {
+				/* Linked blocks see the output before them */
+				n = lz4_decompress_block(p, bsize,
+						out->data + out->len, cap,
+						fi.independent ? 0 :
+						out->len - start > LZ4_HISTORY ?
+						LZ4_HISTORY : out->len - start);
+				if (n < 0)
+					return -1;
+				out->len += n;
+			}
+			p += bsize + csum;
+		}
+
+		if (fi.content_checksum) {
+			if (end - p < 4)
+				return -1;
+			xxh32_reset(&xxh, 0);
+			xxh32_update(&xxh, out->data + start, out->len - start);
+			if (xxh32_digest(&xxh) != get_le32(p)) {
+				fprintf(stderr, "lz4 content checksum mismatch\n");
+				return -1;
+			}
+			p += 4;
+		}
+		if (fi.has_content_size &&
+				fi.content_size != out->len - start) {
+			fprintf(stderr, "lz4 content size mismatch\n");
+			return -1;
+		}
+		frames++;
+	}
+	return frames ? 0 : -1;
+}
+
+static int decode_zstd(const unsigned char *p, const unsigned char *end,
+		struct buf *out, int stream)
+{
+	struct zstd_frame_info fi;
+	unsigned frames = 0;
+	ssize_t len;
+	size_t n;
+
+	for (; end - p >= 4; p += len) {
+		uint32_t magic = get_le32(p);
+
+		if ((magic & ZSTD_SKIPPABLE_MASK) != ZSTD_SKIPPABLE_MAGIC &&
+				magic != ZSTD_MAGIC && frames)
+			break;
+		len = zstd_frame_size(p, end - p);
+		if (len < 0)
+			return -1;
+		if (magic != ZSTD_MAGIC)
+			continue;
+		if (zstd_frame_info(p, len, &fi))
+			return -1;
+		if (stream || !fi.has_content_size) {
+			if (zstd_decompress_frame_stream(p, len, buf_append,
+						out))
+				return -1;
+		} else {
+			if (zstd_decompress_frame(p, len, out->data + out->len,
+						out->cap - out->len, &n))
+				return -1;
+			out->len += n;
+		}
+		frames++;
+	}
+	return frames ? 0 : -1;
+}
+
+static int check(const char *what, const struct buf *out,
+		const struct buf *orig)
+{
+	size_t i;
+
+	if (out->len == orig->len && !memcmp(out->data, orig->data, out->len))
+		return 0;
+	for (i = 0; i < out->len && i < orig->len; i++)
+		if (out->data[i] != orig->data[i])
+			break;
+	fprintf(stderr, "%s: %zu bytes decoded, %zu expected, first "
+			"difference at %zu\n", what, out->len, orig->len, i);
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	struct buf in, orig, out;
+	const unsigned char *end;
+	int ret;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <compressed> <original>\n",
+				argv[0]);
+		return 2;
+	}
+	if (read_file(argv[1], &in) || read_file(argv[2], &orig))
+		return 2;
+	end = in.data + in.len;
+
+	/* Room for one block past the original, to catch overruns */
+	out.cap = orig.len + 4 * 1024 * 1024;
+	out.data = malloc(out.cap);
+	if (!out.data) {
+		fprintf(stderr, "out of memory\n");
+		return 2;
+	}
+
+	out.len = 0;
+	if (in.len >= 4 && get_le32(in.data) == LZ4_MAGIC) {
+		ret = decode_lz4(in.data, end, &out) ||
+			check("lz4", &out, &orig);
+	} else {
+		ret = decode_zstd(in.data, end, &out, 0) ||
+			check("zstd", &out, &orig);
+		out.len = 0;
+		if (!ret)
+			ret = decode_zstd(in.data, end, &out, 1) ||
+				check("zstd stream", &out, &orig);
+	}
+	if (ret)
+		fprintf(stderr, "%s: FAILED\n", argv[1]);
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,157 @@
+#!/bin/sh
+#
+# Check the lz4 and zstd decoders against the reference tools: build
+# decode_test for the host, compress a few inputs with lz4 and zstd in
+# the settings that reach the different parts of the formats, and
+# decode them again.
+#
+#     tests/decode_test.sh
+#
+# CC, LZ4 and ZSTD may name the compiler and tools to use.
+
+set -e
+
+here=$(cd "$(dirname "$0")" && pwd)
+top=$(dirname "$here")
+CC=${CC:-cc}
+LZ4=${LZ4:-lz4}
+ZSTD=${ZSTD:-zstd}
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# The decoders only log through droidboot_ui.h, which wants cutils/log.h
+# outside of an Android tree
+mkdir -p "$tmp/include/cutils"
+: > "$tmp/include/cutils/log.h"
+$CC -O2 -std=gnu99 -W -Wall -Wno-unused-parameter \
+	-I"$top" -I"$tmp/include" -o "$tmp/decode_test" \
+	"$here/decode_test.c" "$top/lz4.c" "$top/zstd.c" "$top/xxhash.c"
+
+# Text-like data with matches at all distances, from a fixed seed so
+# that failures can be reproduced
+awk 'BEGIN {
+	s = 12345
+	for (i = 0; i < 2000; i++) {
+		s = (s * 1103515245 + 12345) % 2147483648
+		w[i] = sprintf("%x", s)
+	}
+	for (line = 0; line < 100000; line++) {
+		for (k = 0; k < 4; k++) {
+			s = (s * 1103515245 + 12345) % 2147483648
+			printf "%s ", w[int(s / 65536) % 2000]
+		}
+		printf "%d\n", line
+	}
+}' > "$tmp/text"
+head -c 1500000 /dev/urandom > "$tmp/random"
+head -c 5000000 /dev/zero > "$tmp/zero"
+: > "$tmp/empty"
+cat "$tmp/text" "$tmp/random" "$tmp/zero" "$tmp/text" > "$tmp/mixed"
+# Under 64K, for the 2 byte zstd content size
+head -c 20000 "$tmp/text" > "$tmp/small"
+
+# Inputs shaped for the rarer parts of zstd blocks:
+#  seqs    3 byte copies from a few offsets, over 32K sequences a block
+#  rlelit  copies separated by the same single byte, for RLE literals
+#  fewsym  a skewed 20 symbol alphabet, for Huffman weights sent
+#          uncompressed
+shaped() {
+	LC_ALL=C awk -v mode="$1" 'BEGIN {
+		srand(42)
+		if (mode == "seqs") {
+			for (n = 0; n < 20000; n++)
+				b[n] = int(rand() * 256)
+			for (i = 0; i < 4; i++)
+				off[i] = 1000 + int(rand() * 19000)
+			last = -1
+			while (n < 600000) {
+				do {
+					i = int(rand() * 4)
+				} while (i == last)
+				last = i
+				for (k = 0; k < 3; k++) {
+					b[n] = b[n - off[i]]
+					n++
+				}
+			}
+		} else if (mode == "rlelit") {
+			for (n = 0; n < 60000; n++)
+				b[n] = int(rand() * 256)
+			for (r = 0; r < 20000; r++) {
+				b[n++] = 122
+				s = int(rand() * 59000)
+				len = 8 + int(rand() * 52)
+				for (k = 0; k < len; k++)
+					b[n++] = b[s + k]
+			}
+		} else {
+			for (i = 0; i < 20; i++)
+				total += w[i] = 2 ^ (rand() * 8)
+			for (n = 0; n < 60000; n++) {
+				x = rand() * total
+				for (i = 0; i < 19 && x >= w[i]; i++)
+					x -= w[i]
+				b[n] = 1 + i
+			}
+		}
+		for (i = 0; i < n; i++)
+			printf "%c", b[i]
+	}' > "$tmp/$1"
+}
+shaped seqs
+shaped rlelit
+shaped fewsym
+
+fail=0
+total=0
+
+run() {
+	name=$1
+	orig=$2
+	total=$((total + 1))
+	if "$tmp/decode_test" "$tmp/$name" "$tmp/$orig"; then
+		echo "ok   $name"
+	else
+		echo "FAIL $name"
+		fail=$((fail + 1))
+	fi
+}
+
+for input in text random zero empty mixed small seqs rlelit fewsym; do
+	# Independent and linked blocks, block and content checksums,
+	# block sizes, content size, fast and high compression levels
+	i=0
+	for opts in "" "-BD" "-BX" "-BD -BX" "-B4" "-B4 -BD" "-B5 -BD" \
+			"--content-size" "--no-frame-crc" "-1 -B4" \
+			"-9 -BD" "-12 -B4 -BD"; do
+		i=$((i + 1))
+		$LZ4 -q -f $opts "$tmp/$input" "$tmp/$input.$i.lz4"
+		run "$input.$i.lz4" "$input"
+	done
+
+	# Raw and RLE blocks come from the random and zero inputs, and
+	# treeless literals and repeated sequence tables from the text
+	# being split into blocks; checksums on and off, frames with and
+	# without a content size, and windows past the frame size
+	i=0
+	for opts in "-1" "-3" "-9" "-19" "--no-check" "--no-content-size" \
+			"-1 --no-content-size" "--long=24" "--fast=5" \
+			"--rsyncable"; do
+		i=$((i + 1))
+		$ZSTD -q -f $opts "$tmp/$input" -o "$tmp/$input.$i.zst"
+		run "$input.$i.zst" "$input"
+	done
+done
+
+# Several frames in a row, as written by pzstd or concatenated images
+cat "$tmp/text.1.lz4" "$tmp/zero.2.lz4" > "$tmp/multi.lz4"
+cat "$tmp/text.1.zst" "$tmp/random.6.zst" "$tmp/zero.4.zst" \
+	> "$tmp/multi.zst"
+cat "$tmp/text" "$tmp/zero" > "$tmp/multi.lz4.orig"
+cat "$tmp/text" "$tmp/random" "$tmp/zero" > "$tmp/multi.zst.orig"
+run multi.lz4 multi.lz4.orig
+run multi.zst multi.zst.orig
+
+echo "$((total - fail)) of $total passed"
+[ $fail -eq 0 ]
@@ -0,0 +1,295 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Fastboot over a FunctionFS gadget function, as an alternative to the
+ * android_adb character device */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/functionfs.h>
+
+#include "aio_sys.h"
+#include "droidboot_ui.h"
+#include "droidboot_util.h"
+#include "usb_ffs.h"
+
+#define USB_FFS_EP0	USB_FFS_PATH "/ep0"
+#define USB_FFS_EP_OUT	USB_FFS_PATH "/ep1"
+#define USB_FFS_EP_IN	USB_FFS_PATH "/ep2"
+
+#define ANDROID_USB	"/sys/class/android_usb/android0/"
+
+/* Fastboot interface class, as matched by the host tool */
+#define FB_CLASS	0xff
+#define FB_SUBCLASS	0x42
+#define FB_PROTOCOL	0x03
+
+#define FS_MAX_PACKET	64
+#define HS_MAX_PACKET	512
+
+struct ffs_descs_head {
+	uint32_t magic;
+	uint32_t length;
+	uint32_t fs_count;
+	uint32_t hs_count;
+} __attribute__((packed));
+
+struct fb_func_descs {
+	struct usb_interface_descriptor intf;
+	struct usb_endpoint_descriptor_no_audio source;
+	struct usb_endpoint_descriptor_no_audio sink;
+} __attribute__((packed));
+
+#define FB_FUNC_DESCS(max_packet) { \
+	.intf = { \
+		.bLength = sizeof(struct usb_interface_descriptor), \
+		.bDescriptorType = USB_DT_INTERFACE, \
+		.bInterfaceNumber = 0, \
+		.bNumEndpoints = 2, \
+		.bInterfaceClass = FB_CLASS, \
+		.bInterfaceSubClass = FB_SUBCLASS, \
+		.bInterfaceProtocol = FB_PROTOCOL, \
+		.iInterface = 1, \
+	}, \
+	.source = { \
+		.bLength = sizeof(struct usb_endpoint_descriptor_no_audio), \
+		.bDescriptorType = USB_DT_ENDPOINT, \
+		.bEndpointAddress = 1 | USB_DIR_OUT, \
+		.bmAttributes = USB_ENDPOINT_XFER_BULK, \
+		.wMaxPacketSize = max_packet, \
+	}, \
+	.sink = { \
+		.bLength = sizeof(struct usb_endpoint_descriptor_no_audio), \
+		.bDescriptorType = USB_DT_ENDPOINT, \
+		.bEndpointAddress = 2 | USB_DIR_IN, \
+		.bmAttributes = USB_ENDPOINT_XFER_BULK, \
+		.wMaxPacketSize = max_packet, \
+	}, \
+}
+
+static const struct {
+	struct ffs_descs_head header;
+	struct fb_func_descs fs_descs, hs_descs;
+} __attribute__((packed)) descriptors = {
+	.header = {
+		.magic = FUNCTIONFS_DESCRIPTORS_MAGIC,
+		.length = sizeof(descriptors),
+		.fs_count = 3,
+		.hs_count = 3,
+	},
+	.fs_descs = FB_FUNC_DESCS(FS_MAX_PACKET),
+	.hs_descs = FB_FUNC_DESCS(HS_MAX_PACKET),
+};
+
+#define STR_INTERFACE	"fastboot"
+
+static const struct {
+	struct usb_functionfs_strings_head header;
+	struct {
+		uint16_t code;
+		char str1[sizeof(STR_INTERFACE)];
+	} __attribute__((packed)) lang0;
+} __attribute__((packed)) strings = {
+	.header = {
+		.magic = FUNCTIONFS_STRINGS_MAGIC,
+		.length = sizeof(strings),
+		.str_count = 1,
+		.lang_count = 1,
+	},
+	.lang0 = {
+		0x0409, /* en-us */
+		STR_INTERFACE,
+	},
+};
+
+static int ep0 = -1;
+
+/* Best effort: test setups may bind the function through configfs */
+static void write_sysfs(const char *name, const char *value)
+{
+	int fd = open(name, O_WRONLY);
+
+	if (fd < 0)
+		return;
+	if (write(fd, value, strlen(value)) < 0)
+		pr_verbose("can't write %s: %s\n", name, strerror(errno));
+	close(fd);
+}
+
+int usb_ffs_init(void)
+{
+	if (ep0 >= 0)
+		return 0;
+
+	ep0 = open(USB_FFS_EP0, O_RDWR);
+	if (ep0 < 0) {
+		pr_error("Can't open %s: %s\n", USB_FFS_EP0, strerror(errno));
+		return -1;
+	}
+	if (write(ep0, &descriptors, sizeof(descriptors)) < 0) {
+		pr_perror("write descriptors");
+		goto err;
+	}
+	if (write(ep0, &strings, sizeof(strings)) < 0) {
+		pr_perror("write strings");
+		goto err;
+	}
+
+	write_sysfs(ANDROID_USB "enable", "0");
+	write_sysfs(ANDROID_USB "functions", "ffs");
+	write_sysfs(ANDROID_USB "enable", "1");
+	pr_info("Listening on %s\n", USB_FFS_PATH);
+	return 0;
+err:
+	close(ep0);
+	ep0 = -1;
+	return -1;
+}
+
+int usb_ffs_open(struct usb_ffs *u)
+{
+	u->ep_out = open(USB_FFS_EP_OUT, O_RDWR);
+	if (u->ep_out < 0) {
+		pr_error("Can't open %s: %s\n", USB_FFS_EP_OUT, strerror(errno));
+		return -1;
+	}
+	u->ep_in = open(USB_FFS_EP_IN, O_RDWR);
+	if (u->ep_in < 0) {
+		pr_error("Can't open %s: %s\n", USB_FFS_EP_IN, strerror(errno));
+		close(u->ep_out);
+		return -1;
+	}
+	return 0;
+}
+
+void usb_ffs_close(struct usb_ffs *u)
+{
+	close(u->ep_in);
+	close(u->ep_out);
+}
+
+static int usb_ffs_read_sync(struct usb_ffs *u, unsigned char *buf,
+		size_t len, usb_ffs_progress_fn progress, void *arg)
+{
+	ssize_t r;
+
+	while (len) {
+		r = read(u->ep_out, buf,
+				(len > USB_FFS_AIO_SIZE) ? USB_FFS_AIO_SIZE : len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			pr_perror("read");
+			return -1;
+		}
+		if (progress)
+			progress(arg, r);
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+int usb_ffs_read(struct usb_ffs *u, void *_buf, size_t len,
+		usb_ffs_progress_fn progress, void *arg)
+{
+	unsigned char *buf = _buf;
+	struct iocb cbs[USB_FFS_AIO_DEPTH];
+	struct iocb *cbp;
+	struct io_event events[USB_FFS_AIO_DEPTH];
+	aio_context_t ctx = 0;
+	size_t queued = 0, done = 0, reported;
+	unsigned head = 0, inflight = 0;
+	int i, n, ret = 0;
+
+	if (io_setup(USB_FFS_AIO_DEPTH, &ctx)) {
+		pr_verbose("io_setup: %s\n", strerror(errno));
+		return usb_ffs_read_sync(u, buf, len, progress, arg);
+	}
+
+	while (done < len) {
+		/* Keep the endpoint's queue full. Requests on an endpoint
+		 * complete in the order they were queued. */
+		while (inflight < USB_FFS_AIO_DEPTH && queued < len) {
+			cbp = &cbs[head % USB_FFS_AIO_DEPTH];
+			memset(cbp, 0, sizeof(*cbp));
+			cbp->aio_fildes = u->ep_out;
+			cbp->aio_lio_opcode = IOCB_CMD_PREAD;
+			cbp->aio_buf = (uintptr_t)(buf + queued);
+			/* Ignored by endpoints */
+			cbp->aio_offset = queued;
+			cbp->aio_nbytes = (len - queued > USB_FFS_AIO_SIZE) ?
+				USB_FFS_AIO_SIZE : len - queued;
+			if (io_submit(ctx, 1, &cbp) != 1) {
+				if (!queued && (errno == EINVAL ||
+							errno == ENOSYS)) {
+					/* This FunctionFS has no AIO */
+					io_destroy(ctx);
+					return usb_ffs_read_sync(u, buf, len,
+							progress, arg);
+				}
+				pr_perror("io_submit");
+				ret = -1;
+				goto out;
+			}
+			queued += cbp->aio_nbytes;
+			head++;
+			inflight++;
+		}
+
+		n = io_getevents(ctx, 1, USB_FFS_AIO_DEPTH, events);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			pr_perror("io_getevents");
+			ret = -1;
+			goto out;
+		}
+		reported = done;
+		for (i = 0; i < n; i++) {
+			struct iocb *cb = (struct iocb *)(uintptr_t)events[i].obj;
+
+			inflight--;
+			if (events[i].res < 0) {
+				pr_error("bulk read failed: %s\n",
+						strerror(-events[i].res));
+				ret = -1;
+			} else if ((size_t)events[i].res != cb->aio_nbytes) {
+				/* The host sends a download as one transfer,
+				 * so only its end may be short */
+				pr_error("short bulk read: %lld of %llu bytes\n",
+						(long long)events[i].res,
+						(unsigned long long)cb->aio_nbytes);
+				ret = -1;
+			} else {
+				done += events[i].res;
+			}
+		}
+		if (ret)
+			goto out;
+		if (progress && done > reported)
+			progress(arg, done - reported);
+	}
+out:
+	/* Cancels and waits for anything still queued */
+	io_destroy(ctx);
+	return ret;
+}
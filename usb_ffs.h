@@ -0,0 +1,53 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DROIDBOOT_USB_FFS_H
+#define DROIDBOOT_USB_FFS_H
+
+#include <sys/types.h>
+
+/* FunctionFS instance; the android gadget driver only binds one named
+ * "adb" */
+#define USB_FFS_PATH		"/dev/usb-ffs/adb"
+
+/* Bulk OUT requests kept in flight while receiving download data */
+#define USB_FFS_AIO_DEPTH	4
+#define USB_FFS_AIO_SIZE	(1024 * 1024)
+
+struct usb_ffs {
+	int ep_in;
+	int ep_out;
+};
+
+/* Write the fastboot interface descriptors to ep0 and switch the gadget
+ * over to FunctionFS. ep0 stays open for the life of the process. */
+int usb_ffs_init(void);
+
+int usb_ffs_open(struct usb_ffs *u);
+void usb_ffs_close(struct usb_ffs *u);
+
+/* Called while receiving with the number of bytes that arrived, in
+ * order, since the last call */
+typedef void (*usb_ffs_progress_fn)(void *arg, size_t len);
+
+/* Receive exactly len bytes of download data, with several large bulk
+ * requests queued through Linux native AIO. Falls back to large
+ * blocking reads on kernels whose FunctionFS can't do AIO. progress
+ * may be NULL. */
+int usb_ffs_read(struct usb_ffs *u, void *buf, size_t len,
+		usb_ffs_progress_fn progress, void *arg);
+
+#endif
@@ -36,16 +36,31 @@
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <time.h>
 #include <unistd.h>
 #include <linux/fs.h>
 
 #include <zlib.h>
 #include <cutils/android_reboot.h>
+#include <ext2fs/ext2fs.h>
 
+/* from ext4_utils for sparse ext4 images */
+#include <sparse_format.h>
+
+#include "blkdev.h"
+#include "blockmap.h"
 #include "fastboot.h"
+#include "finalize.h"
+#include "lz4.h"
+#include "pipeline.h"
+#include "ring.h"
+#include "writer.h"
+#include "xxhash.h"
+#include "zstd.h"
 #include "droidboot.h"
 #include "droidboot_ui.h"
 #include "droidboot_util.h"
@@ -90,6 +105,24 @@ char *xstrdup(const char *s)
 }
 
 
+/* Monotonic time in seconds, for throughput reporting */
+double get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/* Number of online CPUs, for sizing worker pools */
+unsigned num_cpus(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? n : 1;
+}
+
+
 char *xasprintf(const char *fmt, ...)
 {
 	va_list ap;
@@ -105,22 +138,41 @@ char *xasprintf(const char *fmt, ...)
 	return out;
 }
 
-#define CHUNK 1024 * 256
+/* Inflated data is handed to a writer thread in GZIP_SLOTS page aligned
+ * buffers, so decompression and the block writes run on separate cores */
+#define GZIP_SLOTS	4
+#define GZIP_SLOT_SIZE	(1024 * 1024)
+
+static int is_gzip_member(const unsigned char *p, size_t sz)
+{
+	return sz >= 2 && p[0] == 0x1f && p[1] == 0x8b;
+}
+
+/* Open the destination of a decompressing writer at offset */
+static int open_output(struct blk_writer *bw, const char *filename,
+		off64_t offset, int append)
+{
+	return blk_writer_open(bw, filename,
+			O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC),
+			offset);
+}
 
 int named_file_write_decompress_gzip(const char *filename,
-	unsigned char *what, size_t sz, off_t offset, int append)
+	unsigned char *what, size_t sz, off64_t offset, int append)
 {
 	int ret;
-	unsigned int have;
+	int members = 1;
 	z_stream strm;
-	FILE *dest;
-	unsigned char out[CHUNK];
-
-	dest = fopen(filename, append ? "a" : "w");
-	if (!dest) {
-		pr_perror("fopen");
+	struct blk_writer bw;
+	struct ring ring;
+	struct ring_writer writer;
+	struct ring_slot *slot = NULL;
+	uint64_t total = 0;
+	void *mem;
+	double start;
+
+	if (open_output(&bw, filename, offset, append))
 		return -1;
-	}
 
 	/* allocate inflate state */
 	strm.zalloc = Z_NULL;
@@ -131,128 +183,900 @@ int named_file_write_decompress_gzip(const char *filename,
 	ret = inflateInit2(&strm, 15 + 32);
 	if (ret != Z_OK) {
 		pr_error("zlib inflateInit error");
-		fclose(dest);
+		blk_writer_close(&bw);
 		return ret;
 	}
 
-	if (offset && fseeko(dest, offset, SEEK_SET)) {
-		pr_perror("fseek");
+	if (posix_memalign(&mem, 4096, GZIP_SLOTS * GZIP_SLOT_SIZE)) {
+		pr_error("Can't allocate gzip output buffers\n");
+		(void)inflateEnd(&strm);
+		blk_writer_close(&bw);
+		return -1;
+	}
+	ring_init(&ring, GZIP_SLOTS, GZIP_SLOT_SIZE, mem);
+	if (ring_writer_start(&writer, &ring, &bw)) {
 		ret = -1;
-		goto out;
+		goto out_ring;
 	}
 
-	do {
-		strm.avail_in = (sz > CHUNK) ? CHUNK : sz;
-		if (strm.avail_in == 0)
-			break;
-		strm.next_in = what;
-
-		what += strm.avail_in;
-		sz -= strm.avail_in;
-
-		/* run inflate() on input until output buffer not full */
-		do {
-			strm.avail_out = CHUNK;
-			strm.next_out = out;
-			ret = inflate(&strm, Z_NO_FLUSH);
-			if (ret == Z_STREAM_ERROR) {
-				pr_error("zlib state clobbered");
-				die();
+	start = get_time();
+	strm.next_in = what;
+	strm.avail_in = sz;
+	for (;;) {
+		if (!slot) {
+			slot = ring_get_free(&ring);
+			if (!slot) {
+				/* writer failed */
+				ret = -1;
+				goto out;
 			}
-			switch (ret) {
-			case Z_NEED_DICT:
-				ret = Z_DATA_ERROR;     /* and fall through */
-			case Z_DATA_ERROR:
-			case Z_MEM_ERROR:
-				pr_perror("zlib memory/data/corruption error");
+			slot->len = 0;
+		}
+
+		strm.next_out = slot->buf + slot->len;
+		strm.avail_out = slot->size - slot->len;
+		ret = inflate(&strm, Z_NO_FLUSH);
+		slot->len = slot->size - strm.avail_out;
+
+		switch (ret) {
+		case Z_STREAM_ERROR:
+			pr_error("zlib state clobbered");
+			die();
+		case Z_NEED_DICT:
+			ret = Z_DATA_ERROR;     /* and fall through */
+		case Z_DATA_ERROR:
+		case Z_MEM_ERROR:
+			pr_perror("zlib memory/data/corruption error");
+			goto out;
+		case Z_BUF_ERROR:
+			if (!strm.avail_in) {
+				pr_error("gzip data truncated\n");
 				goto out;
 			}
-			have = CHUNK - strm.avail_out;
-			if (fwrite(out, 1, have, dest) != have ||
-					ferror(dest)) {
-				pr_perror("fwrite");
-				ret = -1;
+			break;
+		}
+
+		if (slot->len == slot->size) {
+			total += slot->len;
+			ring_put_full(&ring);
+			slot = NULL;
+		}
+
+		if (ret == Z_STREAM_END) {
+			/* Concatenated members, as produced by some parallel
+			 * compressors, decompress back to back. Anything else
+			 * after the end of a member is ignored. */
+			if (!is_gzip_member(strm.next_in, strm.avail_in))
+				break;
+			ret = inflateReset(&strm);
+			if (ret != Z_OK) {
+				pr_error("zlib inflateReset error");
 				goto out;
 			}
-		} while (strm.avail_out == 0);
-		/* done when inflate() says it's done */
-	} while (ret != Z_STREAM_END);
+			members++;
+		}
+	}
 
-	if (ret == Z_STREAM_END)
-		ret = 0;
-	else
-		pr_error("zlib data error");
+	if (slot && slot->len) {
+		total += slot->len;
+		ring_put_full(&ring);
+	}
+	slot = NULL;
+	ret = ring_writer_finish(&writer);
+	if (blk_writer_flush(&bw))
+		ret = -1;
+	if (!ret) {
+		double elapsed = get_time() - start;
+
+		pr_debug("inflated %u member(s), %llu bytes in %.2fs (%.1f MB/s)\n",
+				members, (unsigned long long)total, elapsed,
+				elapsed > 0 ? total / elapsed / MEGABYTE : 0.0);
+	}
+	goto out_ring;
 out:
+	ring_abort(&ring);
+	ring_writer_finish(&writer);
+out_ring:
+	ring_destroy(&ring);
+	free(mem);
 	/* clean up and return */
 	(void)inflateEnd(&strm);
-	fclose(dest);
+	if (blk_writer_close(&bw))
+		ret = -1;
 	return ret;
 }
 
 
-int named_file_write_ext4_sparse(const char *filename,
-	unsigned char *what, size_t sz)
+static inline uint32_t get_le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void report_decompress(const char *what, unsigned frames,
+		unsigned workers, uint64_t total, double start)
+{
+	double elapsed = get_time() - start;
+
+	pr_debug("%s: %u frame(s), %llu bytes on %u thread(s) in %.2fs (%.1f MB/s)\n",
+			what, frames, (unsigned long long)total, workers,
+			elapsed, elapsed > 0 ? total / elapsed / MEGABYTE : 0.0);
+}
+
+/* The largest block an LZ4 frame may declare */
+#define LZ4_SLOT_SIZE	(4 * 1024 * 1024)
+
+static int lz4_decode_job(void *arg, const unsigned char *src, size_t len,
+		unsigned char *dst, size_t cap, size_t *out_len)
+{
+	ssize_t ret = lz4_decompress_block(src, len, dst, cap, 0);
+
+	if (ret < 0)
+		return -1;
+	*out_len = ret;
+	return 0;
+}
+
+static int xxh32_hook(void *arg, const unsigned char *buf, size_t len)
+{
+	xxh32_update(arg, buf, len);
+	return 0;
+}
+
+/* Frames with independent blocks, the lz4 tool's default, are decoded a
+ * block per job on all cores. Linked blocks reference the previous 64K
+ * of output, so they are decoded here in order and only the writes are
+ * overlapped. */
+int named_file_write_decompress_lz4(const char *filename,
+	unsigned char *what, size_t sz, off64_t offset, int append)
+{
+	const unsigned char *p = what, *end = what + sz;
+	unsigned char *hist = NULL;
+	struct lz4_frame_info fi;
+	struct xxh32_state xxh;
+	struct pipeline pl;
+	unsigned frames = 0;
+	struct blk_writer bw;
+	double start;
+	int ret = -1;
+
+	if (open_output(&bw, filename, offset, append))
+		return -1;
+	if (pipeline_init(&pl, num_cpus(), LZ4_SLOT_SIZE, &bw,
+				lz4_decode_job, NULL)) {
+		blk_writer_close(&bw);
+		return -1;
+	}
+
+	start = get_time();
+	while (end - p >= 4) {
+		uint32_t magic = get_le32(p);
+		size_t hist_len = 0;
+
+		if ((magic & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE_MAGIC) {
+			if (end - p < 8 || get_le32(p + 4) > (size_t)(end - p) - 8) {
+				pr_error("lz4: truncated skippable frame\n");
+				goto out;
+			}
+			p += 8 + get_le32(p + 4);
+			continue;
+		}
+		/* Anything else after the last frame is ignored */
+		if (magic != LZ4_MAGIC && frames)
+			break;
+		if (lz4_frame_info(p, end - p, &fi))
+			goto out;
+
+		if (pipeline_drain(&pl))
+			goto out;
+		if (fi.content_checksum) {
+			xxh32_reset(&xxh, 0);
+			pipeline_set_hook(&pl, xxh32_hook, &xxh);
+		} else {
+			pipeline_set_hook(&pl, NULL, NULL);
+		}
+		if (!fi.independent && !hist)
+			hist = xmalloc(LZ4_HISTORY + LZ4_SLOT_SIZE);
+
+		p += fi.header_len;
+		for (;;) {
+			size_t bsize, csum = fi.block_checksum ? 4 : 0;
+			int raw;
+
+			if (end - p < 4) {
+				pr_error("lz4: truncated frame\n");
+				goto out;
+			}
+			bsize = get_le32(p);
+			p += 4;
+			if (!bsize)
+				break;
+			raw = !!(bsize & 0x80000000);
+			bsize &= 0x7FFFFFFF;
+			if (bsize > fi.block_max || bsize + csum > (size_t)(end - p)) {
+				pr_error("lz4: bad block size\n");
+				goto out;
+			}
+			if (csum && xxh32(p, bsize, 0) != get_le32(p + bsize)) {
+				pr_error("lz4: block checksum mismatch\n");
+				goto out;
+			}
+
+			if (fi.independent) {
+				ret = raw ? pipeline_submit_data(&pl, p, bsize) :
+					pipeline_submit(&pl, p, bsize);
+			} else {
+				unsigned char *out = hist + hist_len;
+				ssize_t n = bsize;
+				size_t keep;
+
+				if (raw)
+					memcpy(out, p, bsize);
+				else
+					n = lz4_decompress_block(p, bsize, out,
+							fi.block_max, hist_len);
+				ret = (n < 0) ? -1 : pipeline_submit_data(&pl, out, n);
+				if (!ret) {
+					keep = hist_len + n;
+					if (keep > LZ4_HISTORY)
+						keep = LZ4_HISTORY;
+					memmove(hist, out + n - keep, keep);
+					hist_len = keep;
+				}
+			}
+			if (ret)
+				goto out;
+			p += bsize + csum;
+		}
+
+		if (fi.content_checksum) {
+			ret = -1;
+			if (end - p < 4) {
+				pr_error("lz4: truncated frame\n");
+				goto out;
+			}
+			if (pipeline_drain(&pl))
+				goto out;
+			if (xxh32_digest(&xxh) != get_le32(p)) {
+				pr_error("lz4: content checksum mismatch\n");
+				goto out;
+			}
+			p += 4;
+		}
+		frames++;
+	}
+
+	if (!frames) {
+		pr_error("lz4: no frames found\n");
+		goto out;
+	}
+	ret = pipeline_finish(&pl);
+	if (blk_writer_close(&bw))
+		ret = -1;
+	if (!ret)
+		report_decompress("lz4", frames, pl.nworkers, pl.bytes, start);
+	free(hist);
+	return ret;
+out:
+	pipeline_abort(&pl);
+	pipeline_finish(&pl);
+	free(hist);
+	blk_writer_close(&bw);
+	return -1;
+}
+
+/* zstd frames of known size up to ZSTD_JOB_MAX are decoded a frame per
+ * job on all cores, as written by pzstd and other parallel compressors.
+ * Other frames are decoded here through a window sized buffer. */
+#define ZSTD_JOB_MAX	(8 * 1024 * 1024)
+#define ZSTD_CHUNK	(128 * 1024)
+
+static int zstd_decode_job(void *arg, const unsigned char *src, size_t len,
+		unsigned char *dst, size_t cap, size_t *out_len)
 {
+	return zstd_decompress_frame(src, len, dst, cap, out_len);
+}
+
+static int zstd_stream_out(void *arg, const unsigned char *buf, size_t len)
+{
+	return pipeline_submit_data(arg, buf, len);
+}
+
+static int zstd_parallel_frame(const struct zstd_frame_info *fi)
+{
+	return fi->has_content_size && fi->content_size <= ZSTD_JOB_MAX;
+}
+
+int named_file_write_decompress_zstd(const char *filename,
+	unsigned char *what, size_t sz, off64_t offset, int append)
+{
+	const unsigned char *p, *end = what + sz;
+	struct zstd_frame_info fi;
+	struct pipeline pl;
+	size_t slot = ZSTD_CHUNK;
+	unsigned frames = 0, left;
+	struct blk_writer bw;
+	ssize_t len;
+	double start;
 	int ret;
 
-	ret = named_file_write("/tmp/s.img", what, sz, 0, 0);
-	if (ret) {
-		pr_error("writing sparse ext4 image to temporary file\n");
+	/* Walk the frames first, so truncated images are rejected before
+	 * anything is written and the job buffers fit the largest frame */
+	for (p = what; end - p >= 4; p += len) {
+		uint32_t magic = get_le32(p);
+
+		if ((magic & ZSTD_SKIPPABLE_MASK) != ZSTD_SKIPPABLE_MAGIC &&
+				magic != ZSTD_MAGIC && frames)
+			break;
+		len = zstd_frame_size(p, end - p);
+		if (len < 0) {
+			pr_error("zstd: truncated or corrupt frame\n");
+			return -1;
+		}
+		if (magic != ZSTD_MAGIC)
+			continue;
+		if (zstd_frame_info(p, len, &fi))
+			return -1;
+		if (zstd_parallel_frame(&fi) && fi.content_size > slot)
+			slot = (fi.content_size + 4095) & ~4095;
+		frames++;
+	}
+	if (!frames) {
+		pr_error("zstd: no frames found\n");
 		return -1;
 	}
 
-	ret = execute_command("/system/bin/simg2img /tmp/s.img %s",
-				filename);
-	if (ret) {
-		pr_error("writing sparse ext4 image failed\n");
+	if (open_output(&bw, filename, offset, append))
 		return -1;
+	if (pipeline_init(&pl, num_cpus(), slot, &bw, zstd_decode_job, NULL)) {
+		blk_writer_close(&bw);
+		return -1;
+	}
+
+	start = get_time();
+	ret = 0;
+	for (p = what, left = frames; !ret && left; p += len) {
+		len = zstd_frame_size(p, end - p);
+		if (get_le32(p) != ZSTD_MAGIC)
+			continue;
+		zstd_frame_info(p, len, &fi);
+		if (zstd_parallel_frame(&fi))
+			ret = pipeline_submit(&pl, p, len);
+		else
+			ret = zstd_decompress_frame_stream(p, len,
+					zstd_stream_out, &pl);
+		left--;
 	}
 
-	execute_command("rm /tmp/s.img");
+	if (ret)
+		pipeline_abort(&pl);
+	if (pipeline_finish(&pl))
+		ret = -1;
+	if (blk_writer_close(&bw))
+		ret = -1;
+	if (!ret)
+		report_decompress("zstd", frames, pl.nworkers, pl.bytes, start);
+	return ret;
+}
 
+
+/* Consecutive RAW chunks land back to back on the device, so they are
+ * gathered into a single writev() instead of one write per chunk */
+#define SPARSE_IOV_MAX	64
+
+struct sparse_out {
+	struct blk_writer bw;
+	off64_t pos;		/* device offset of the first queued iovec */
+	size_t pending;		/* bytes queued */
+	int iovcnt;
+	struct iovec iov[SPARSE_IOV_MAX];
+};
+
+static int sparse_flush(struct sparse_out *out)
+{
+	if (!out->iovcnt)
+		return 0;
+
+	if (out->bw.pos != out->pos && blk_writer_seek(&out->bw, out->pos))
+		return -1;
+	if (blk_writer_writev(&out->bw, out->iov, out->iovcnt))
+		return -1;
+
+	out->pos += out->pending;
+	out->pending = 0;
+	out->iovcnt = 0;
 	return 0;
 }
 
+static int sparse_queue(struct sparse_out *out, off64_t pos,
+		unsigned char *buf, size_t len)
+{
+	if (out->iovcnt && (out->iovcnt == SPARSE_IOV_MAX ||
+				pos != out->pos + (off64_t)out->pending)) {
+		if (sparse_flush(out))
+			return -1;
+	}
+	if (!out->iovcnt)
+		out->pos = pos;
+	out->iov[out->iovcnt].iov_base = buf;
+	out->iov[out->iovcnt].iov_len = len;
+	out->iovcnt++;
+	out->pending += len;
+	return 0;
+}
 
-int named_file_write(const char *filename, const unsigned char *what,
-		size_t sz, off_t offset, int append)
+/* CRC32 of len bytes of a repeating 32-bit pattern, for FILL and
+ * DONT_CARE chunks (the latter count as zeroes) */
+static uint32_t sparse_crc32_fill(uint32_t crc, uint32_t pattern, uint64_t len)
 {
-	int fd, ret, flags;
+	uint32_t buf[1024];
+	size_t xfer;
+	unsigned i;
 
-	flags = O_RDWR | (append ? O_APPEND : O_CREAT);
-	if (flags & O_CREAT)
-		fd = open(filename, flags, 0600);
-	else
-		fd = open(filename, flags);
-	if (fd < 0) {
-		pr_error("file_write: Can't open file %s: %s\n",
-				filename, strerror(errno));
+	for (i = 0; i < sizeof(buf) / sizeof(buf[0]); i++)
+		buf[i] = pattern;
+
+	while (len) {
+		xfer = (len > sizeof(buf)) ? sizeof(buf) : len;
+		crc = crc32(crc, (unsigned char *)buf, xfer);
+		len -= xfer;
+	}
+	return crc;
+}
+
+/* Walk all the chunk headers before touching the device, so that a
+ * truncated or corrupt image is rejected up front */
+static int sparse_validate(unsigned char *what, size_t sz, int *has_crc)
+{
+	sparse_header_t *hdr = (sparse_header_t *)what;
+	chunk_header_t *chunk;
+	size_t pos;
+	uint64_t blocks = 0;
+	uint64_t expected;
+	uint32_t i;
+
+	*has_crc = 0;
+	if (sz < sizeof(*hdr) || hdr->magic != SPARSE_HEADER_MAGIC) {
+		pr_error("not a sparse image\n");
+		return -1;
+	}
+	if (hdr->major_version != SPARSE_HEADER_MAJOR_VER ||
+			hdr->file_hdr_sz < sizeof(sparse_header_t) ||
+			hdr->chunk_hdr_sz < sizeof(chunk_header_t) ||
+			!hdr->blk_sz || (hdr->blk_sz & 3)) {
+		pr_error("unsupported sparse image header\n");
+		return -1;
+	}
+
+	pos = hdr->file_hdr_sz;
+	for (i = 0; i < hdr->total_chunks; i++) {
+		if (pos > sz || sz - pos < hdr->chunk_hdr_sz) {
+			pr_error("sparse image truncated at chunk %u\n", i);
+			return -1;
+		}
+		chunk = (chunk_header_t *)(what + pos);
+
+		switch (chunk->chunk_type) {
+		case CHUNK_TYPE_RAW:
+			expected = hdr->chunk_hdr_sz +
+				(uint64_t)chunk->chunk_sz * hdr->blk_sz;
+			break;
+		case CHUNK_TYPE_FILL:
+			expected = hdr->chunk_hdr_sz + sizeof(uint32_t);
+			break;
+		case CHUNK_TYPE_DONT_CARE:
+			expected = hdr->chunk_hdr_sz;
+			break;
+		case CHUNK_TYPE_CRC32:
+			expected = hdr->chunk_hdr_sz + sizeof(uint32_t);
+			*has_crc = 1;
+			break;
+		default:
+			pr_error("unknown sparse chunk type 0x%x\n",
+					chunk->chunk_type);
+			return -1;
+		}
+		if (chunk->total_sz != expected ||
+				chunk->total_sz > sz - pos) {
+			pr_error("bad size for sparse chunk %u\n", i);
+			return -1;
+		}
+		if (chunk->chunk_type != CHUNK_TYPE_CRC32)
+			blocks += chunk->chunk_sz;
+		pos += chunk->total_sz;
+	}
+
+	if (blocks > hdr->total_blks) {
+		pr_error("sparse image chunks exceed %u blocks\n",
+				hdr->total_blks);
+		return -1;
+	}
+	/* Device offsets are off64_t */
+	if ((uint64_t)hdr->total_blks * hdr->blk_sz > INT64_MAX) {
+		pr_error("sparse image of %u blocks of %u bytes is too large\n",
+				hdr->total_blks, hdr->blk_sz);
+		return -1;
+	}
+	return 0;
+}
+
+struct sparse_job {
+	const char *filename;
+	unsigned char *what;
+	int has_crc;
+	off64_t *bounds;	/* region i covers [bounds[i], bounds[i + 1]) */
+};
+
+/* Write the part of the image that falls within region idx. Every
+ * region walks all the chunk headers, which is cheap next to the data. */
+static int sparse_write_region(void *arg, unsigned idx)
+{
+	struct sparse_job *job = arg;
+	sparse_header_t *hdr = (sparse_header_t *)job->what;
+	off64_t lo = job->bounds[idx];
+	off64_t hi = job->bounds[idx + 1];
+	chunk_header_t *chunk;
+	struct sparse_out out;
+	unsigned char *data;
+	uint32_t crc = 0;
+	uint32_t fill;
+	uint32_t i;
+	uint64_t len;
+	off64_t pos = 0, s, e;
+	size_t next;
+	int ret = -1;
+
+	if (blk_writer_open(&out.bw, job->filename, O_WRONLY, lo))
 		return -1;
+	out.pos = lo;
+	out.pending = 0;
+	out.iovcnt = 0;
+
+	next = hdr->file_hdr_sz;
+	/* With CRC32 chunks there is a single region, and the trailing
+	 * checksum still needs checking once it's complete */
+	for (i = 0; i < hdr->total_chunks && (job->has_crc || pos < hi);
+			i++) {
+		chunk = (chunk_header_t *)(job->what + next);
+		data = job->what + next + hdr->chunk_hdr_sz;
+		len = (uint64_t)chunk->chunk_sz * hdr->blk_sz;
+		next += chunk->total_sz;
+
+		/* Part of the chunk inside the region */
+		s = pos > lo ? pos : lo;
+		e = pos + (off64_t)len < hi ? pos + (off64_t)len : hi;
+
+		switch (chunk->chunk_type) {
+		case CHUNK_TYPE_RAW:
+			if (job->has_crc)
+				crc = crc32(crc, data, len);
+			if (s < e && sparse_queue(&out, s, data + (s - pos),
+						e - s))
+				goto out;
+			break;
+		case CHUNK_TYPE_FILL:
+			memcpy(&fill, data, sizeof(fill));
+			if (job->has_crc)
+				crc = sparse_crc32_fill(crc, fill, len);
+			/* Region bounds are multiples of 4, so the pattern
+			 * stays in phase */
+			if (s < e && (sparse_flush(&out) ||
+					blk_writer_seek(&out.bw, s) ||
+					blk_writer_fill(&out.bw, e - s, fill)))
+				goto out;
+			break;
+		case CHUNK_TYPE_DONT_CARE:
+			if (job->has_crc)
+				crc = sparse_crc32_fill(crc, 0, len);
+			break;
+		case CHUNK_TYPE_CRC32:
+			memcpy(&fill, data, sizeof(fill));
+			if (job->has_crc && fill != crc) {
+				pr_error("sparse image CRC mismatch at chunk %u\n",
+						i);
+				goto out;
+			}
+			break;
+		}
+		pos += len;
+	}
+
+	ret = sparse_flush(&out);
+out:
+	if (blk_writer_close(&out.bw))
+		ret = -1;
+	return ret;
+}
+
+/* Split the image into n regions holding about as much data each,
+ * DONT_CARE chunks counting for nothing */
+static void sparse_split(unsigned char *what, unsigned n, off64_t *bounds)
+{
+	sparse_header_t *hdr = (sparse_header_t *)what;
+	chunk_header_t *chunk;
+	uint64_t total = 0, done = 0, target, len;
+	off64_t pos, b;
+	size_t next;
+	uint32_t i;
+	unsigned k;
+
+	next = hdr->file_hdr_sz;
+	for (i = 0; i < hdr->total_chunks; i++) {
+		chunk = (chunk_header_t *)(what + next);
+		if (chunk->chunk_type == CHUNK_TYPE_RAW ||
+				chunk->chunk_type == CHUNK_TYPE_FILL)
+			total += (uint64_t)chunk->chunk_sz * hdr->blk_sz;
+		next += chunk->total_sz;
+	}
+
+	bounds[0] = 0;
+	k = 1;
+	pos = 0;
+	next = hdr->file_hdr_sz;
+	for (i = 0; i < hdr->total_chunks && k < n; i++) {
+		chunk = (chunk_header_t *)(what + next);
+		len = (uint64_t)chunk->chunk_sz * hdr->blk_sz;
+		next += chunk->total_sz;
+		if (chunk->chunk_type != CHUNK_TYPE_RAW &&
+				chunk->chunk_type != CHUNK_TYPE_FILL) {
+			pos += len;
+			continue;
+		}
+		while (k < n && (target = total * k / n) < done + len) {
+			b = pos + (target - done);
+			b -= b % WRITE_REGION_ALIGN;
+			bounds[k] = b > bounds[k - 1] ? b : bounds[k - 1];
+			k++;
+		}
+		done += len;
+		pos += len;
 	}
-	if (offset) {
-		if (lseek(fd, offset, SEEK_SET) < 0) {
-			pr_perror("lseek");
-			close(fd);
+	for (; k <= n; k++)
+		bounds[k] = (off64_t)hdr->total_blks * hdr->blk_sz;
+}
+
+/* Decode an Android sparse image straight out of the download buffer
+ * onto the destination. RAW chunks are written in place from the buffer,
+ * FILL chunks are pattern-filled (or zeroed by the device), DONT_CARE
+ * regions are left alone, and CRC32 chunks are checked against the data
+ * output so far. Large images are written as several regions at once,
+ * except when they carry CRC32 chunks, which need the data in order. */
+int named_file_write_ext4_sparse(const char *filename,
+	unsigned char *what, size_t sz)
+{
+	sparse_header_t *hdr = (sparse_header_t *)what;
+	struct sparse_job job;
+	off64_t bounds[WRITE_REGIONS_MAX + 1];
+	uint64_t size;
+	unsigned n;
+	double start;
+	int has_crc;
+	int ret;
+
+	if (sparse_validate(what, sz, &has_crc))
+		return -1;
+
+	pr_debug("sparse image: %u blocks of %u bytes in %u chunks\n",
+			hdr->total_blks, hdr->blk_sz, hdr->total_chunks);
+
+	size = (uint64_t)hdr->total_blks * hdr->blk_sz;
+	n = has_crc ? 1 : write_regions_for(filename, size);
+	job.filename = filename;
+	job.what = what;
+	job.has_crc = has_crc;
+	job.bounds = bounds;
+	start = get_time();
+	if (n > 1) {
+		sparse_split(what, n, bounds);
+		ret = write_parallel(n, sparse_write_region, &job);
+	} else {
+		bounds[0] = 0;
+		bounds[1] = size;
+		ret = sparse_write_region(&job, 0);
+	}
+	if (ret)
+		pr_error("writing sparse ext4 image failed\n");
+	else if (size >= WRITE_REGION_MIN)
+		write_rate_record(n, size, get_time() - start);
+	return ret;
+}
+
+
+/* Check a type=blocks image against the partition it is written to,
+ * before touching the device */
+static int blocks_validate(unsigned char *what, size_t sz, uint64_t size)
+{
+	struct blocks_header *hdr = (struct blocks_header *)what;
+	struct blocks_extent *ext;
+	uint64_t len;
+	size_t pos;
+	uint32_t i;
+
+	if (sz < sizeof(*hdr) || hdr->magic != BLOCKS_MAGIC ||
+			hdr->version != BLOCKMAP_VERSION ||
+			hdr->header_size < sizeof(*hdr) ||
+			hdr->block_size < BLOCKMAP_BLOCK_MIN ||
+			hdr->block_size > BLOCKMAP_BLOCK_MAX ||
+			(hdr->block_size & (hdr->block_size - 1))) {
+		pr_error("not a blocks image\n");
+		return -1;
+	}
+	if (hdr->size != size) {
+		pr_error("blocks image is for a partition of %llu bytes, "
+				"not %llu\n", (unsigned long long)hdr->size,
+				(unsigned long long)size);
+		return -1;
+	}
+
+	pos = hdr->header_size;
+	for (i = 0; i < hdr->extents; i++) {
+		if (pos > sz || sz - pos < sizeof(*ext)) {
+			pr_error("blocks image truncated at extent %u\n", i);
 			return -1;
 		}
+		ext = (struct blocks_extent *)(what + pos);
+		pos += sizeof(*ext);
+		if (ext->block >= size / hdr->block_size + 1 ||
+				ext->block * hdr->block_size >= size) {
+			pr_error("extent %u is past the end\n", i);
+			return -1;
+		}
+		len = (uint64_t)ext->nblocks * hdr->block_size;
+		if (len > size - ext->block * hdr->block_size)
+			len = size - ext->block * hdr->block_size;
+		if (len > sz - pos) {
+			pr_error("blocks image truncated at extent %u\n", i);
+			return -1;
+		}
+		pos += len;
+	}
+	if (pos != sz) {
+		pr_error("%zu trailing bytes in blocks image\n", sz - pos);
+		return -1;
+	}
+	return 0;
+}
+
+/* Write the extents of a type=blocks image, made by the host from the
+ * partition's oem blockmap manifest, in place */
+int named_file_write_blocks(const char *filename, unsigned char *what,
+		size_t sz)
+{
+	struct blocks_header *hdr = (struct blocks_header *)what;
+	struct blocks_extent *ext;
+	struct blk_writer bw;
+	uint64_t size, len, total = 0;
+	size_t pos;
+	uint32_t i;
+	int ret = 0;
+
+	if (blk_writer_open(&bw, filename, O_WRONLY, 0))
+		return -1;
+	if (blkdev_size(bw.fd, &size) || blocks_validate(what, sz, size)) {
+		blk_writer_close(&bw);
+		return -1;
+	}
+
+	pos = hdr->header_size;
+	for (i = 0; i < hdr->extents && !ret; i++) {
+		ext = (struct blocks_extent *)(what + pos);
+		pos += sizeof(*ext);
+		len = (uint64_t)ext->nblocks * hdr->block_size;
+		if (len > size - ext->block * hdr->block_size)
+			len = size - ext->block * hdr->block_size;
+		ret = blk_writer_seek(&bw, ext->block * hdr->block_size) ||
+			blk_writer_write(&bw, what + pos, len);
+		pos += len;
+		total += len;
 	}
+	if (blk_writer_close(&bw))
+		ret = -1;
+	if (ret)
+		pr_error("writing blocks image failed\n");
+	else
+		pr_info("wrote %u extents, %llu of %llu MiB\n", hdr->extents,
+				(unsigned long long)(total >> 20),
+				(unsigned long long)(size >> 20));
+	return ret;
+}
+
+
+/* write() the whole buffer, retrying on short writes and EINTR */
+int write_all(int fd, const void *buf, size_t sz)
+{
+	const unsigned char *what = buf;
+	ssize_t ret;
 
 	while (sz) {
-		pr_verbose("write() %zu bytes to %s\n", sz, filename);
 		ret = write(fd, what, sz);
-		if (ret <= 0 && errno != EINTR) {
-			pr_error("file_write: Failed to write to %s: %s\n",
-					filename, strerror(errno));
-			close(fd);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
 			return -1;
-		}
 		what += ret;
 		sz -= ret;
 	}
-	close(fd);
 	return 0;
 }
 
+
+struct region_job {
+	const char *filename;
+	const unsigned char *what;
+	size_t sz;
+	off64_t offset;
+	unsigned n;
+};
+
+/* Start of region k of a raw write, aligned on the device */
+static off64_t region_start(struct region_job *job, unsigned k)
+{
+	off64_t b;
+
+	if (!k)
+		return job->offset;
+	if (k == job->n)
+		return job->offset + job->sz;
+	b = job->offset + (off64_t)((uint64_t)job->sz * k / job->n);
+	b -= b % WRITE_REGION_ALIGN;
+	return b > job->offset ? b : job->offset;
+}
+
+static int write_region(void *arg, unsigned idx)
+{
+	struct region_job *job = arg;
+	struct blk_writer bw;
+	off64_t start, end;
+	int ret;
+
+	start = region_start(job, idx);
+	end = region_start(job, idx + 1);
+
+	if (blk_writer_open(&bw, job->filename, O_WRONLY, start))
+		return -1;
+	ret = blk_writer_write(&bw, job->what + (start - job->offset),
+			end - start);
+	if (blk_writer_close(&bw))
+		ret = -1;
+	return ret;
+}
+
+int named_file_write(const char *filename, const unsigned char *what,
+		size_t sz, off64_t offset, int append)
+{
+	struct blk_writer bw;
+	struct region_job job;
+	double start;
+	int ret;
+
+	start = get_time();
+	job.n = append ? 1 : write_regions_for(filename, sz);
+	if (job.n > 1) {
+		pr_verbose("write() %zu bytes to %s in %u regions\n", sz,
+				filename, job.n);
+		job.filename = filename;
+		job.what = what;
+		job.sz = sz;
+		job.offset = offset;
+		ret = write_parallel(job.n, write_region, &job);
+		goto out;
+	}
+
+	if (blk_writer_open(&bw, filename,
+				O_RDWR | (append ? O_APPEND : O_CREAT), offset))
+		return -1;
+
+	pr_verbose("write() %zu bytes to %s\n", sz, filename);
+	ret = blk_writer_write(&bw, what, sz);
+	if (blk_writer_close(&bw))
+		ret = -1;
+out:
+	if (ret)
+		pr_error("file_write: Failed to write to %s\n", filename);
+	else if (sz >= WRITE_REGION_MIN)
+		write_rate_record(job.n, sz, get_time() - start);
+	return ret;
+}
+
 int mount_partition_device(const char *device, const char *type, char *mountpoint)
 {
 	int ret;
@@ -302,12 +1126,43 @@ static int get_volume_size(Volume *vol, uint64_t *sz)
 }
 
 
+static int ext4_open(Volume *vol, ext2_filsys *fs)
+{
+	errcode_t err;
+
+	writeback_note_device(vol->device);
+	err = ext2fs_open(vol->device, EXT2_FLAG_RW | EXT2_FLAG_64BITS, 0, 0,
+			unix_io_manager, fs);
+	if (err) {
+		pr_error("Couldn't open ext4 filesystem on %s (error %ld)\n",
+				vol->device, (long)err);
+		return -1;
+	}
+	return 0;
+}
+
+static int ext4_close(ext2_filsys fs)
+{
+	errcode_t err;
+
+	err = ext2fs_close(fs);
+	if (err) {
+		pr_error("Couldn't write back ext4 superblock (error %ld)\n",
+				(long)err);
+		ext2fs_free(fs);
+		return -1;
+	}
+	return 0;
+}
+
+/* Prepare a freshly written ext4 filesystem for its first boot. The
+ * superblock is inspected in-process with libext2fs; e2fsck and resize2fs
+ * are only run when it says they have something to do. */
 int ext4_filesystem_checks(Volume *vol)
 {
-#ifndef SKIP_FSCK
-	int ret;
-#endif
+	ext2_filsys fs;
 	uint64_t length;
+	blk64_t blocks;
 	struct stat sb;
 
 	if (stat(vol->device, &sb) < 0) {
@@ -315,35 +1170,51 @@ int ext4_filesystem_checks(Volume *vol)
 		return -1;
 	}
 
-#ifndef SKIP_FSCK
-	/* run fdisk to make sure the partition is OK */
-	ret = execute_command("/system/bin/e2fsck -C 0 -fn %s",
-				vol->device);
-	if (ret) {
-		pr_error("fsck of filesystem failed\n");
+	if (ext4_open(vol, &fs))
 		return -1;
+
+#ifndef SKIP_FSCK
+	if (!(fs->super->s_state & EXT2_VALID_FS) ||
+			(fs->super->s_state & EXT2_ERROR_FS) ||
+			(fs->super->s_feature_incompat &
+			 EXT3_FEATURE_INCOMPAT_RECOVER)) {
+		ext2fs_free(fs);
+		pr_info("%s is not clean, checking it\n", vol->device);
+		if (execute_command("/system/bin/e2fsck -C 0 -fn %s",
+					vol->device)) {
+			pr_error("fsck of filesystem failed\n");
+			return -1;
+		}
+		if (ext4_open(vol, &fs))
+			return -1;
 	}
 #endif
 
 	if (get_volume_size(vol, &length)) {
 		pr_error("Couldn't get size of device %s\n", vol->device);
+		ext2fs_free(fs);
 		return -1;
 	}
-	if (execute_command("/system/bin/resize2fs -f -F %s %lluK",
-				vol->device, length >> 10)) {
-		pr_error("could not resize filesystem to %lluK\n",
-				length >> 10);
-		return -1;
+	blocks = ext2fs_blocks_count(fs->super);
+	if (blocks != length / fs->blocksize) {
+		ext2fs_free(fs);
+		if (execute_command("/system/bin/resize2fs -f -F %s %lluK",
+					vol->device, length >> 10)) {
+			pr_error("could not resize filesystem to %lluK\n",
+					length >> 10);
+			return -1;
+		}
+		if (ext4_open(vol, &fs))
+			return -1;
+	} else {
+		pr_debug("%s already spans the partition\n", vol->device);
 	}
 
 	/* Set mount count to 1 so that 1st mount on boot doesn't
 	 * result in complaints */
-	if (execute_command("/system/bin/tune2fs -C 1 %s",
-				vol->device)) {
-		pr_error("tune2fs failed\n");
-		return -1;
-	}
-	return 0;
+	fs->super->s_mnt_count = 1;
+	ext2fs_mark_super_dirty(fs);
+	return ext4_close(fs);
 }
 
 int mount_partition(Volume *vol)
@@ -351,6 +1222,9 @@ int mount_partition(Volume *vol)
 	char *mountpoint;
 	int status;
 
+	finalize_wait(vol);
+	/* Mounted read-write, so the partition may change */
+	writeback_note_device(vol->device);
 	mountpoint = xasprintf("/mnt/%s", vol->mount_point);
 	status = mount_partition_device(vol->device, vol->fs_type, mountpoint);
 	free(mountpoint);
@@ -369,27 +1243,116 @@ int unmount_partition(Volume *vol)
 	return ret;
 }
 
-int erase_partition(Volume *vol)
+/* ext4 volumes are discarded and formatted; anything else (emmc, vfat)
+ * is left reading back as zeroes. Either way the device does the work
+ * through discard/zero-out requests where it can. */
+static int do_erase_partition(Volume *vol, int secure)
 {
+	uint64_t size;
+	int fd;
+	int ret;
+
 	if (!is_valid_blkdev(vol->device)) {
 		pr_error("invalid destination node. partition disks?\n");
 		return -1;
 	}
+	finalize_discard(vol);
+	writeback_note_device(vol->device);
+
+	fd = open(vol->device, O_RDWR);
+	if (fd < 0) {
+		pr_error("Can't open %s: %s\n", vol->device, strerror(errno));
+		return -1;
+	}
+	if (blkdev_size(fd, &size)) {
+		close(fd);
+		return -1;
+	}
 
 	if (!strcmp(vol->fs_type, "ext4")) {
+		/* Stale blocks don't matter to the new filesystem; this
+		 * only saves the device from preserving them */
+		if (blkdev_discard(fd, 0, size, secure))
+			pr_debug("discard of %s failed: %s\n", vol->device,
+					strerror(errno));
+		close(fd);
 		if (make_ext4fs(vol->device, vol->length, &vol->mount_point[1],
 					sehandle)) {
 		        pr_error("make_ext4fs failed\n");
 			return -1;
 		}
-	} else {
-		pr_error("erase_partition: I can't handle fs_type %s\n",
-				vol->fs_type);
+		return 0;
+	}
+
+	pr_debug("Erasing %llu bytes of %s\n", size, vol->device);
+	ret = blkdev_erase(fd, 0, size, secure);
+	if (!ret && fsync(fd)) {
+		pr_perror("fsync");
+		ret = -1;
+	}
+	close(fd);
+	if (ret)
+		pr_error("Couldn't erase %s\n", vol->device);
+	return ret;
+}
+
+int erase_partition(Volume *vol)
+{
+	return do_erase_partition(vol, 0);
+}
+
+/* Unlike make_ext4fs, mke2fs can leave the inode tables and the journal
+ * uninitialized (uninit_bg) for the kernel to zero in the background
+ * after the first mount, so formatting only writes the metadata. It
+ * also runs in its own process, so several volumes can be formatted at
+ * once. The partition is discarded beforehand so that the device doesn't
+ * keep the stale blocks around. */
+int format_partition_lazy(Volume *vol)
+{
+	uint64_t size;
+	uint64_t length;
+	int fd;
+
+	if (strcmp(vol->fs_type, "ext4")) {
+		pr_error("can't format fs_type %s\n", vol->fs_type);
+		return -1;
+	}
+	if (!is_valid_blkdev(vol->device)) {
+		pr_error("invalid destination node. partition disks?\n");
+		return -1;
+	}
+	finalize_discard(vol);
+	writeback_note_device(vol->device);
+
+	fd = open(vol->device, O_RDWR);
+	if (fd < 0) {
+		pr_error("Can't open %s: %s\n", vol->device, strerror(errno));
+		return -1;
+	}
+	if (!blkdev_size(fd, &size) && blkdev_discard(fd, 0, size, 0))
+		pr_debug("discard of %s failed: %s\n", vol->device,
+				strerror(errno));
+	close(fd);
+
+	if (get_volume_size(vol, &length)) {
+		pr_error("Couldn't get size of device %s\n", vol->device);
+		return -1;
+	}
+	if (execute_command("/system/bin/mke2fs -q -t ext4 "
+				"-E lazy_itable_init=1,lazy_journal_init=1,nodiscard "
+				"-L %s %s %lluK", &vol->mount_point[1],
+				vol->device, length >> 10)) {
+		pr_error("mke2fs of %s failed\n", vol->device);
 		return -1;
 	}
 	return 0;
 }
 
+int secure_erase_partition(Volume *vol)
+{
+	return do_erase_partition(vol, 1);
+}
+
 int execute_command(const char *fmt, ...)
 {
 	int ret = -1;
@@ -0,0 +1,1423 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "aio_sys.h"
+#include "blkdev.h"
+#include "digest.h"
+#include "droidboot_ui.h"
+#include "droidboot_util.h"
+#include "writer.h"
+
+#define WRITE_CHUNK_MIN		(1024 * 1024)
+#define WRITE_CHUNK_MAX		(16 * 1024 * 1024)
+/* Cap on the staging memory of the aio engine */
+#define WRITE_STAGE_MAX		(32 * 1024 * 1024)
+
+#ifndef SYNC_FILE_RANGE_WAIT_BEFORE
+#define SYNC_FILE_RANGE_WAIT_BEFORE	1
+#define SYNC_FILE_RANGE_WRITE		2
+#define SYNC_FILE_RANGE_WAIT_AFTER	4
+#endif
+
+static const char *engine_names[] = { "buffered", "direct", "aio" };
+
+struct touched_dev {
+	char *device;
+	unsigned generation;	/* times it has been noted */
+	struct touched_dev *next;
+};
+
+static struct touched_dev *touched;
+static pthread_mutex_t touched_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const char *write_engine_name(int engine)
+{
+	if (engine < 0 || engine > WRITE_AIO)
+		return "unknown";
+	return engine_names[engine];
+}
+
+int write_engine_parse(const char *name)
+{
+	int i;
+
+	for (i = 0; i <= WRITE_AIO; i++)
+		if (!strcmp(name, engine_names[i]))
+			return i;
+	return -1;
+}
+
+/* The selection is kept in the thread's key value itself: the engine in
+ * the low byte, then the queue depth, the number of regions and the
+ * skip-unchanged and verify flags */
+#define SELECT_SKIP		(1 << 24)
+#define SELECT_VERIFY		(1 << 25)
+
+static pthread_key_t engine_key;
+static pthread_once_t engine_once = PTHREAD_ONCE_INIT;
+
+static void engine_key_init(void)
+{
+	pthread_key_create(&engine_key, NULL);
+}
+
+void write_engine_select(int engine, unsigned depth, unsigned regions)
+{
+	pthread_once(&engine_once, engine_key_init);
+	if (depth > WRITE_DEPTH_MAX)
+		depth = WRITE_DEPTH_MAX;
+	if (regions > WRITE_REGIONS_MAX)
+		regions = WRITE_REGIONS_MAX;
+	pthread_setspecific(engine_key, (void *)(uintptr_t)((engine & 0xff) |
+				(depth << 8) | (regions << 16)));
+}
+
+void write_engine_current(int *engine, unsigned *depth, unsigned *regions)
+{
+	uintptr_t v;
+
+	pthread_once(&engine_once, engine_key_init);
+	v = (uintptr_t)pthread_getspecific(engine_key);
+	*engine = v & 0xff;
+	*depth = (v >> 8) & 0xff;
+	if (!*depth)
+		*depth = WRITE_DEPTH_DEFAULT;
+	*regions = (v >> 16) & 0xff;
+}
+
+void write_skip_select(int skip)
+{
+	uintptr_t v;
+
+	pthread_once(&engine_once, engine_key_init);
+	v = (uintptr_t)pthread_getspecific(engine_key);
+	v = skip ? v | SELECT_SKIP : v & ~SELECT_SKIP;
+	pthread_setspecific(engine_key, (void *)v);
+}
+
+static int write_skip_current(void)
+{
+	pthread_once(&engine_once, engine_key_init);
+	return !!((uintptr_t)pthread_getspecific(engine_key) & SELECT_SKIP);
+}
+
+void write_verify_select(int verify)
+{
+	uintptr_t v;
+
+	pthread_once(&engine_once, engine_key_init);
+	v = (uintptr_t)pthread_getspecific(engine_key);
+	v = verify ? v | SELECT_VERIFY : v & ~SELECT_VERIFY;
+	pthread_setspecific(engine_key, (void *)v);
+}
+
+static int write_verify_current(void)
+{
+	pthread_once(&engine_once, engine_key_init);
+	return !!((uintptr_t)pthread_getspecific(engine_key) & SELECT_VERIFY);
+}
+
+static uint64_t verify_checked;
+static int64_t verify_bad = -1;
+static pthread_mutex_t verify_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void write_verify_reset(void)
+{
+	pthread_mutex_lock(&verify_lock);
+	verify_checked = 0;
+	verify_bad = -1;
+	pthread_mutex_unlock(&verify_lock);
+}
+
+void write_verify_stats(uint64_t *checked, int64_t *first_bad)
+{
+	pthread_mutex_lock(&verify_lock);
+	*checked = verify_checked;
+	*first_bad = verify_bad;
+	pthread_mutex_unlock(&verify_lock);
+}
+
+static uint64_t skip_total, skip_skipped;
+static pthread_mutex_t skip_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void write_skip_reset(void)
+{
+	pthread_mutex_lock(&skip_lock);
+	skip_total = skip_skipped = 0;
+	pthread_mutex_unlock(&skip_lock);
+}
+
+void write_skip_stats(uint64_t *total, uint64_t *skipped)
+{
+	pthread_mutex_lock(&skip_lock);
+	*total = skip_total;
+	*skipped = skip_skipped;
+	pthread_mutex_unlock(&skip_lock);
+}
+
+/* Read a numeric sysfs attribute of the disk holding a block device
+ * (e.g. "queue/rotational"); -1 if there's no such attribute */
+static int disk_attr(const struct stat *sb, const char *attr,
+		unsigned long *val)
+{
+	static const char *fmts[] = {
+		"/sys/dev/block/%u:%u/../%s",
+		"/sys/dev/block/%u:%u/%s",
+	};
+	char path[128];
+	unsigned i;
+	FILE *f;
+	int ret;
+
+	if (!S_ISBLK(sb->st_mode))
+		return -1;
+	for (i = 0; i < sizeof(fmts) / sizeof(fmts[0]); i++) {
+		snprintf(path, sizeof(path), fmts[i], major(sb->st_rdev),
+				minor(sb->st_rdev), attr);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		ret = fscanf(f, "%lu", val);
+		fclose(f);
+		if (ret == 1)
+			return 0;
+	}
+	return -1;
+}
+
+/* Preferred erase size of the disk holding a block device; 0 if
+ * unknown */
+static size_t erase_size(int fd)
+{
+	struct stat sb;
+	unsigned long size;
+
+	if (fstat(fd, &sb) ||
+			disk_attr(&sb, "device/preferred_erase_size", &size))
+		return 0;
+	return size;
+}
+
+unsigned write_regions_for(const char *filename, uint64_t len)
+{
+	struct stat sb;
+	unsigned long rotational;
+	unsigned depth, n;
+	int engine;
+
+	if (stat(filename, &sb) || !S_ISBLK(sb.st_mode))
+		return 1;
+	write_engine_current(&engine, &depth, &n);
+	if (!n) {
+		n = 1;
+		if (!disk_attr(&sb, "queue/rotational", &rotational) &&
+				!rotational)
+			n = WRITE_REGIONS_DEFAULT;
+	}
+	if (n > len / WRITE_REGION_MIN)
+		n = len / WRITE_REGION_MIN;
+	return n ? n : 1;
+}
+
+struct parallel_job {
+	int (*fn)(void *arg, unsigned idx);
+	void *arg;
+	unsigned idx;
+	int engine;
+	unsigned depth;
+	int skip;
+	int verify;
+	pthread_t thread;
+	int started;
+	int ret;
+};
+
+static void *parallel_thread(void *arg)
+{
+	struct parallel_job *job = arg;
+
+	write_engine_select(job->engine, job->depth, 1);
+	write_skip_select(job->skip);
+	write_verify_select(job->verify);
+	job->ret = job->fn(job->arg, job->idx);
+	return NULL;
+}
+
+int write_parallel(unsigned n, int (*fn)(void *arg, unsigned idx),
+		void *arg)
+{
+	struct parallel_job *jobs;
+	unsigned depth, regions, i;
+	int engine, skip, verify;
+	int ret = 0;
+
+	write_engine_current(&engine, &depth, &regions);
+	skip = write_skip_current();
+	verify = write_verify_current();
+	jobs = xmalloc(n * sizeof(*jobs));
+	for (i = 0; i < n; i++) {
+		jobs[i].fn = fn;
+		jobs[i].arg = arg;
+		jobs[i].idx = i;
+		jobs[i].engine = engine;
+		jobs[i].depth = depth;
+		jobs[i].skip = skip;
+		jobs[i].verify = verify;
+		jobs[i].started = !pthread_create(&jobs[i].thread, NULL,
+				parallel_thread, &jobs[i]);
+		if (!jobs[i].started) {
+			pr_error("Can't start writer thread %u\n", i);
+			jobs[i].ret = -1;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		if (jobs[i].started)
+			pthread_join(jobs[i].thread, NULL);
+		if (jobs[i].ret)
+			ret = -1;
+	}
+	free(jobs);
+	return ret;
+}
+
+static double rates[WRITE_REGIONS_MAX + 1];
+static pthread_mutex_t rates_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void write_rate_record(unsigned n, uint64_t bytes, double secs)
+{
+	double rate;
+
+	if (n > WRITE_REGIONS_MAX || secs <= 0)
+		return;
+	rate = bytes / secs / (1024 * 1024);
+	pr_info("wrote %llu MiB in %.2fs with %u region%s: %.1f MB/s\n",
+			(unsigned long long)(bytes >> 20), secs, n,
+			n == 1 ? "" : "s", rate);
+	pthread_mutex_lock(&rates_lock);
+	rates[n] = rate;
+	pthread_mutex_unlock(&rates_lock);
+}
+
+void write_rates(char *buf, size_t len)
+{
+	size_t pos = 0;
+	unsigned i;
+	int r;
+
+	buf[0] = '\0';
+	pthread_mutex_lock(&rates_lock);
+	for (i = 1; i <= WRITE_REGIONS_MAX && pos < len; i++) {
+		if (!rates[i])
+			continue;
+		r = snprintf(buf + pos, len - pos, "%s%u:%.1f",
+				pos ? " " : "", i, rates[i]);
+		if (r < 0)
+			break;
+		pos += r;
+	}
+	pthread_mutex_unlock(&rates_lock);
+}
+
+/* bionic has no sync_file_range() */
+static int sync_range(int fd, int64_t offset, int64_t len, unsigned flags)
+{
+#if defined(__LP64__)
+	return syscall(__NR_sync_file_range, fd, offset, len, flags);
+#else
+	return syscall(__NR_sync_file_range, fd,
+			(uint32_t)offset, (uint32_t)(offset >> 32),
+			(uint32_t)len, (uint32_t)(len >> 32), flags);
+#endif
+}
+
+/* Wait for the window under writeback, and start writeback of the one
+ * just dirtied */
+static void writeback_kick(struct blk_writer *w)
+{
+	if (w->wb_prev_hi > w->wb_prev_lo &&
+			sync_range(w->fd, w->wb_prev_lo,
+				w->wb_prev_hi - w->wb_prev_lo,
+				SYNC_FILE_RANGE_WAIT_BEFORE |
+				SYNC_FILE_RANGE_WRITE |
+				SYNC_FILE_RANGE_WAIT_AFTER))
+		goto fail;
+	if (sync_range(w->fd, w->wb_lo, w->wb_hi - w->wb_lo,
+				SYNC_FILE_RANGE_WRITE))
+		goto fail;
+	w->wb_prev_lo = w->wb_lo;
+	w->wb_prev_hi = w->wb_hi;
+	w->wb_dirty = 0;
+	return;
+fail:
+	/* Leave it all to fdatasync() */
+	pr_verbose("sync_file_range: %s\n", strerror(errno));
+	w->wb = 0;
+}
+
+/* Account for len bytes written through the page cache at offset */
+static void writeback(struct blk_writer *w, off64_t offset, size_t len)
+{
+	if (!w->wb || !len)
+		return;
+	if (!w->wb_dirty || offset < w->wb_lo)
+		w->wb_lo = offset;
+	if (!w->wb_dirty || offset + (off64_t)len > w->wb_hi)
+		w->wb_hi = offset + len;
+	w->wb_dirty += len;
+	if (w->wb_dirty >= WRITEBACK_WINDOW)
+		writeback_kick(w);
+}
+
+static void writeback_init(struct blk_writer *w)
+{
+	struct stat sb;
+
+	w->wb = !fstat(w->fd, &sb) &&
+		(S_ISREG(sb.st_mode) || S_ISBLK(sb.st_mode));
+}
+
+void writeback_note_device(const char *device)
+{
+	struct touched_dev *t;
+
+	pthread_mutex_lock(&touched_lock);
+	for (t = touched; t; t = t->next)
+		if (!strcmp(t->device, device))
+			break;
+	if (!t) {
+		t = xmalloc(sizeof(*t));
+		t->device = xstrdup(device);
+		t->generation = 0;
+		t->next = touched;
+		touched = t;
+	}
+	t->generation++;
+	pthread_mutex_unlock(&touched_lock);
+}
+
+unsigned writeback_device_generation(const char *device)
+{
+	struct touched_dev *t;
+	unsigned generation = 0;
+
+	pthread_mutex_lock(&touched_lock);
+	for (t = touched; t; t = t->next)
+		if (!strcmp(t->device, device))
+			generation = t->generation;
+	pthread_mutex_unlock(&touched_lock);
+	return generation;
+}
+
+int writeback_sync_devices(void)
+{
+	struct touched_dev *t, *list = NULL;
+	int fd, ret = 0;
+
+	/* Sync a copy of the list, so that writers noting devices don't
+	 * wait on the flushes */
+	pthread_mutex_lock(&touched_lock);
+	for (t = touched; t; t = t->next) {
+		struct touched_dev *c = xmalloc(sizeof(*c));
+
+		c->device = xstrdup(t->device);
+		c->next = list;
+		list = c;
+	}
+	pthread_mutex_unlock(&touched_lock);
+
+	while (list) {
+		t = list;
+		list = t->next;
+		fd = open(t->device, O_RDONLY);
+		if (fd < 0) {
+			pr_error("Can't open %s: %s\n", t->device,
+					strerror(errno));
+			ret = -1;
+			goto next;
+		}
+		if (fdatasync(fd)) {
+			pr_error("fdatasync %s: %s\n", t->device,
+					strerror(errno));
+			ret = -1;
+		}
+		if (ioctl(fd, BLKFLSBUF, 0))
+			pr_verbose("BLKFLSBUF %s: %s\n", t->device,
+					strerror(errno));
+		close(fd);
+		pr_verbose("flushed %s\n", t->device);
+next:
+		free(t->device);
+		free(t);
+	}
+	return ret;
+}
+
+/* A piece of a write, within one VERIFY_SPAN of the device, with the
+ * CRC32C of each VERIFY_BLOCK of the device it covers (or part of it) */
+struct verify_rec {
+	struct verify_rec *next;
+	off64_t offset;
+	size_t len;
+	uint32_t crcs[];
+};
+
+struct blk_verifier {
+	int fd;			/* O_DIRECT */
+	unsigned char *buf;	/* VERIFY_SPAN bytes */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct verify_rec *head;
+	struct verify_rec **tail;
+	int closed;
+	uint64_t checked;
+	int64_t bad;		/* first block that didn't match, or -1 */
+};
+
+static size_t verify_block_at(off64_t offset, size_t off, size_t len)
+{
+	size_t bl = VERIFY_BLOCK - (offset + off) % VERIFY_BLOCK;
+
+	return bl > len - off ? len - off : bl;
+}
+
+/* Read a piece back and compare it block by block */
+static void verify_check(struct blk_verifier *v, struct verify_rec *rec)
+{
+	off64_t lo = rec->offset - rec->offset % VERIFY_BLOCK;
+	size_t rlen, off, bl, got = 0;
+	unsigned i;
+	ssize_t r;
+	int err = 0;
+
+	rlen = rec->offset + rec->len - lo;
+	rlen = (rlen + VERIFY_BLOCK - 1) / VERIFY_BLOCK * VERIFY_BLOCK;
+	while (got < rlen) {
+		r = pread64(v->fd, v->buf + got, rlen - got, lo + got);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			err = errno;
+		if (r <= 0)
+			break;
+		got += r;
+	}
+	if (got < rec->offset + rec->len - lo) {
+		pr_error("read back at %lld failed: %s\n",
+				(long long)rec->offset,
+				err ? strerror(err) : "short read");
+		v->bad = rec->offset;
+		return;
+	}
+
+	for (off = 0, i = 0; off < rec->len; off += bl, i++) {
+		bl = verify_block_at(rec->offset, off, rec->len);
+		if (crc32c(0, v->buf + (rec->offset - lo) + off, bl) !=
+				rec->crcs[i]) {
+			pr_error("read back differs at %lld\n",
+					(long long)(rec->offset + off));
+			v->bad = rec->offset + off;
+			return;
+		}
+	}
+	v->checked += rec->len;
+}
+
+static void *verify_thread(void *arg)
+{
+	struct blk_verifier *v = arg;
+	struct verify_rec *rec;
+
+	for (;;) {
+		pthread_mutex_lock(&v->lock);
+		while (!v->head && !v->closed)
+			pthread_cond_wait(&v->cond, &v->lock);
+		rec = v->head;
+		if (rec) {
+			v->head = rec->next;
+			if (!v->head)
+				v->tail = &v->head;
+		}
+		pthread_mutex_unlock(&v->lock);
+		if (!rec)
+			break;
+		/* After a mismatch the rest is just drained */
+		if (v->bad < 0)
+			verify_check(v, rec);
+		free(rec);
+	}
+	return NULL;
+}
+
+/* Queue len bytes at p, just written to offset, for reading back. Only
+ * called once the data has been handed to the kernel: an O_DIRECT read
+ * of the range then writes back any of it still in the page cache
+ * first. */
+static void verify_note(struct blk_writer *w, const unsigned char *p,
+		size_t len, off64_t offset)
+{
+	struct blk_verifier *v = w->verify;
+	struct verify_rec *rec;
+	size_t n, off, bl;
+	unsigned i;
+
+	if (!v)
+		return;
+	while (len) {
+		n = VERIFY_SPAN - offset % VERIFY_SPAN;
+		if (n > len)
+			n = len;
+		rec = xmalloc(sizeof(*rec) + sizeof(uint32_t) *
+				((offset % VERIFY_BLOCK + n + VERIFY_BLOCK - 1) /
+				 VERIFY_BLOCK));
+		rec->next = NULL;
+		rec->offset = offset;
+		rec->len = n;
+		for (off = 0, i = 0; off < n; off += bl, i++) {
+			bl = verify_block_at(offset, off, n);
+			rec->crcs[i] = crc32c(0, p + off, bl);
+		}
+
+		pthread_mutex_lock(&v->lock);
+		*v->tail = rec;
+		v->tail = &rec->next;
+		pthread_cond_signal(&v->cond);
+		pthread_mutex_unlock(&v->lock);
+
+		p += n;
+		len -= n;
+		offset += n;
+	}
+}
+
+static int setup_verify(struct blk_writer *w, const char *filename)
+{
+	struct blk_verifier *v;
+	void *mem;
+
+	v = xmalloc(sizeof(*v));
+	memset(v, 0, sizeof(*v));
+	v->bad = -1;
+	v->tail = &v->head;
+	pthread_mutex_init(&v->lock, NULL);
+	pthread_cond_init(&v->cond, NULL);
+
+	/* Reading back through the page cache would prove nothing */
+	v->fd = open(filename, O_RDONLY | O_DIRECT);
+	if (v->fd < 0) {
+		pr_error("%s: can't read it back: %s\n", filename,
+				strerror(errno));
+		goto fail;
+	}
+	if (posix_memalign(&mem, 4096, VERIFY_SPAN)) {
+		pr_error("Can't allocate read back buffer\n");
+		goto fail_fd;
+	}
+	v->buf = mem;
+	if (pthread_create(&v->thread, NULL, verify_thread, v)) {
+		pr_error("Can't start read back thread\n");
+		free(v->buf);
+		goto fail_fd;
+	}
+	w->verify = v;
+	return 0;
+
+fail_fd:
+	close(v->fd);
+fail:
+	pthread_cond_destroy(&v->cond);
+	pthread_mutex_destroy(&v->lock);
+	free(v);
+	return -1;
+}
+
+/* Wait for everything queued to be read back; -1 on a mismatch */
+static int verify_finish(struct blk_writer *w)
+{
+	struct blk_verifier *v = w->verify;
+	double start = get_time();
+	int ret = 0;
+
+	pthread_mutex_lock(&v->lock);
+	v->closed = 1;
+	pthread_cond_signal(&v->cond);
+	pthread_mutex_unlock(&v->lock);
+	pthread_join(v->thread, NULL);
+	pr_debug("read back %llu MiB, %.2fs after the writes\n",
+			(unsigned long long)(v->checked >> 20),
+			get_time() - start);
+
+	pthread_mutex_lock(&verify_lock);
+	verify_checked += v->checked;
+	if (v->bad >= 0) {
+		if (verify_bad < 0 || v->bad < verify_bad)
+			verify_bad = v->bad;
+		ret = -1;
+	}
+	pthread_mutex_unlock(&verify_lock);
+
+	close(v->fd);
+	free(v->buf);
+	pthread_cond_destroy(&v->cond);
+	pthread_mutex_destroy(&v->lock);
+	free(v);
+	w->verify = NULL;
+	return ret;
+}
+
+static int pwrite_all(int fd, const unsigned char *buf, size_t len,
+		off64_t offset)
+{
+	ssize_t r;
+
+	while (len) {
+		r = pwrite64(fd, buf, len, offset);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		buf += r;
+		len -= r;
+		offset += r;
+	}
+	return 0;
+}
+
+/* iov is used up in the process */
+static int writev_all(int fd, struct iovec *iov, int cnt)
+{
+	ssize_t r;
+
+	while (cnt) {
+		if (!iov->iov_len) {
+			iov++;
+			cnt--;
+			continue;
+		}
+		r = writev(fd, iov, cnt);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		while (cnt && (size_t)r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base = (unsigned char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+	return 0;
+}
+
+static int setup_direct(struct blk_writer *w, const char *filename,
+		int engine, unsigned depth)
+{
+	int blksz = 0;
+	size_t chunk;
+	void *mem;
+
+	w->dfd = open(filename, O_WRONLY | O_DIRECT);
+	if (w->dfd < 0) {
+		pr_verbose("O_DIRECT open of %s: %s\n", filename,
+				strerror(errno));
+		return -1;
+	}
+
+	/* Direct writes never share a page with the buffered head and
+	 * tail writes, so the page cache can't write stale data over them */
+	if (ioctl(w->fd, BLKSSZGET, &blksz) || blksz <= 0)
+		blksz = 512;
+	w->align = blksz;
+	if (w->align < 4096)
+		w->align = 4096;
+
+	chunk = erase_size(w->fd);
+	if (!chunk)
+		chunk = WRITE_CHUNK_DEFAULT;
+	while (chunk < WRITE_CHUNK_MIN)
+		chunk *= 2;
+	if (chunk > WRITE_CHUNK_MAX)
+		chunk = WRITE_CHUNK_MAX;
+	chunk = (chunk + w->align - 1) / w->align * w->align;
+	w->chunk = chunk;
+
+	w->nbufs = 1;
+	if (engine == WRITE_AIO) {
+		w->nbufs = depth;
+		if (w->nbufs * chunk > WRITE_STAGE_MAX)
+			w->nbufs = WRITE_STAGE_MAX / chunk;
+		if (w->nbufs < 2)
+			w->nbufs = 2;
+		w->ctx = 0;
+		if (io_setup(w->nbufs, &w->ctx)) {
+			pr_verbose("io_setup: %s\n", strerror(errno));
+			engine = WRITE_DIRECT;
+			w->nbufs = 1;
+		}
+	}
+
+	if (posix_memalign(&mem, 4096, w->nbufs * chunk)) {
+		pr_error("Can't allocate %u write buffers of %zu bytes\n",
+				w->nbufs, chunk);
+		if (engine == WRITE_AIO)
+			io_destroy(w->ctx);
+		close(w->dfd);
+		w->dfd = -1;
+		return -1;
+	}
+	w->mem = mem;
+	if (engine == WRITE_AIO) {
+		w->cbs = xmalloc(w->nbufs * sizeof(*w->cbs));
+		w->busy = xmalloc(w->nbufs);
+		memset(w->busy, 0, w->nbufs);
+	}
+	w->engine = engine;
+	pr_debug("%s: %s writes of %zu bytes, %u in flight\n", filename,
+			write_engine_name(engine), chunk, w->nbufs);
+	return 0;
+}
+
+/* Discard zero extents if the device reads them back as zeroes */
+static void setup_zero(struct blk_writer *w, const struct stat *sb)
+{
+	unsigned long granularity;
+	unsigned int zeroes = 0;
+
+	if (ioctl(w->fd, BLKDISCARDZEROES, &zeroes) || !zeroes)
+		return;
+	if (disk_attr(sb, "queue/discard_granularity", &granularity) ||
+			!granularity)
+		return;
+	w->zero_align = granularity;
+	if (w->zero_align < SKIP_BLOCK)
+		w->zero_align = SKIP_BLOCK;
+}
+
+/* Open the destination for reading back in skip-unchanged mode;
+ * without it, everything is written */
+static void setup_skip(struct blk_writer *w, const char *filename)
+{
+	void *mem;
+
+	w->rfd = open(filename, O_RDONLY | O_DIRECT);
+	if (w->rfd < 0)
+		w->rfd = open(filename, O_RDONLY);
+	if (w->rfd < 0) {
+		pr_info("%s: can't read it back: %s\n", filename,
+				strerror(errno));
+		return;
+	}
+	if (posix_memalign(&mem, 4096, SKIP_SPAN)) {
+		pr_error("Can't allocate read back buffer\n");
+		close(w->rfd);
+		w->rfd = -1;
+		return;
+	}
+	w->rbuf = mem;
+}
+
+int blk_writer_open(struct blk_writer *w, const char *filename, int flags,
+		off64_t offset)
+{
+	struct stat sb;
+	unsigned depth, regions;
+	int engine;
+
+	memset(w, 0, sizeof(*w));
+	w->dfd = -1;
+	w->rfd = -1;
+	w->owns_fd = 1;
+	w->engine = WRITE_BUFFERED;
+
+	if (flags & O_CREAT)
+		w->fd = open(filename, flags, 0600);
+	else
+		w->fd = open(filename, flags);
+	if (w->fd < 0) {
+		pr_error("Can't open %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	if (!(flags & O_APPEND) && offset &&
+			lseek64(w->fd, offset, SEEK_SET) < 0) {
+		pr_perror("lseek64");
+		close(w->fd);
+		return -1;
+	}
+	w->pos = offset;
+	writeback_init(w);
+
+	if (fstat(w->fd, &sb) || !S_ISBLK(sb.st_mode))
+		return 0;
+	writeback_note_device(filename);
+	write_engine_current(&engine, &depth, &regions);
+	if (engine != WRITE_BUFFERED && !(flags & O_APPEND) &&
+			setup_direct(w, filename, engine, depth))
+		pr_info("%s: using buffered writes\n", filename);
+	if (!(flags & O_APPEND))
+		setup_zero(w, &sb);
+	if (write_skip_current() && !(flags & O_APPEND))
+		setup_skip(w, filename);
+	if (write_verify_current() && !(flags & O_APPEND) &&
+			setup_verify(w, filename)) {
+		blk_writer_close(w);
+		return -1;
+	}
+	return 0;
+}
+
+void blk_writer_fdopen(struct blk_writer *w, int fd)
+{
+	memset(w, 0, sizeof(*w));
+	w->fd = fd;
+	w->dfd = -1;
+	w->rfd = -1;
+	w->engine = WRITE_BUFFERED;
+	w->pos = lseek64(fd, 0, SEEK_CUR);
+	if (w->pos < 0)
+		w->pos = 0;
+	writeback_init(w);
+}
+
+static unsigned char *stage(struct blk_writer *w)
+{
+	return w->mem + w->cur * w->chunk;
+}
+
+/* Reap at least min completed AIO writes */
+static int reap(struct blk_writer *w, unsigned min)
+{
+	struct io_event events[WRITE_DEPTH_MAX];
+	struct iocb *cb;
+	int i, n;
+
+	while (min) {
+		n = io_getevents(w->ctx, min, w->nbufs, events);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			pr_perror("io_getevents");
+			w->error = 1;
+			return -1;
+		}
+		for (i = 0; i < n; i++) {
+			cb = (struct iocb *)(uintptr_t)events[i].obj;
+			w->busy[cb - w->cbs] = 0;
+			w->inflight--;
+			if (events[i].res < 0 ||
+					(size_t)events[i].res != cb->aio_nbytes) {
+				pr_error("write of %llu bytes at %lld failed: %s\n",
+						(unsigned long long)cb->aio_nbytes,
+						(long long)cb->aio_offset,
+						events[i].res < 0 ?
+						strerror(-events[i].res) :
+						"short write");
+				w->error = 1;
+			} else {
+				verify_note(w, (unsigned char *)(uintptr_t)
+						cb->aio_buf, cb->aio_nbytes,
+						cb->aio_offset);
+			}
+		}
+		min = (unsigned)n >= min ? 0 : min - n;
+	}
+	return w->error ? -1 : 0;
+}
+
+/* Write out len (aligned) bytes of the current staging buffer */
+static int stage_submit(struct blk_writer *w, size_t len)
+{
+	struct iocb *cb;
+
+	if (w->engine == WRITE_DIRECT) {
+		if (pwrite_all(w->dfd, stage(w), len, w->stage_pos)) {
+			pr_perror("pwrite");
+			w->error = 1;
+			return -1;
+		}
+		verify_note(w, stage(w), len, w->stage_pos);
+		w->fill = 0;
+		return 0;
+	}
+
+	cb = &w->cbs[w->cur];
+	memset(cb, 0, sizeof(*cb));
+	cb->aio_fildes = w->dfd;
+	cb->aio_lio_opcode = IOCB_CMD_PWRITE;
+	cb->aio_buf = (uintptr_t)stage(w);
+	cb->aio_nbytes = len;
+	cb->aio_offset = w->stage_pos;
+	if (io_submit(w->ctx, 1, &cb) != 1) {
+		pr_perror("io_submit");
+		w->error = 1;
+		return -1;
+	}
+	w->busy[w->cur] = 1;
+	w->inflight++;
+	w->cur = (w->cur + 1) % w->nbufs;
+	w->fill = 0;
+	return 0;
+}
+
+static int buffered_pwrite(struct blk_writer *w, const unsigned char *buf,
+		size_t len, off64_t offset)
+{
+	if (pwrite_all(w->fd, buf, len, offset)) {
+		pr_perror("pwrite");
+		w->error = 1;
+		return -1;
+	}
+	writeback(w, offset, len);
+	verify_note(w, buf, len, offset);
+	return 0;
+}
+
+static int write_data(struct blk_writer *w, const unsigned char *p,
+		size_t len)
+{
+	size_t n, mis;
+
+	if (w->error)
+		return -1;
+
+	while (w->engine == WRITE_BUFFERED && len) {
+		/* A window at a time, or the whole image could be dirty
+		 * before writeback gets a chance to start */
+		n = len;
+		if (w->wb && n > WRITEBACK_WINDOW)
+			n = WRITEBACK_WINDOW;
+		if (write_all(w->fd, p, n)) {
+			pr_perror("write");
+			w->error = 1;
+			return -1;
+		}
+		writeback(w, w->pos, n);
+		verify_note(w, p, n, w->pos);
+		p += n;
+		len -= n;
+		w->pos += n;
+		w->bytes += n;
+	}
+
+	while (len) {
+		if (!w->fill) {
+			mis = w->pos % w->align;
+			if (mis) {
+				/* Unaligned head */
+				n = w->align - mis;
+				if (n > len)
+					n = len;
+				if (buffered_pwrite(w, p, n, w->pos))
+					return -1;
+				goto advance;
+			}
+			if (w->engine == WRITE_DIRECT && len >= w->chunk &&
+					!((uintptr_t)p % w->align)) {
+				/* Aligned source, no need to stage it */
+				n = len - len % w->align;
+				if (pwrite_all(w->dfd, p, n, w->pos)) {
+					pr_perror("pwrite");
+					w->error = 1;
+					return -1;
+				}
+				verify_note(w, p, n, w->pos);
+				goto advance;
+			}
+			while (w->engine == WRITE_AIO && w->busy[w->cur])
+				if (reap(w, 1))
+					return -1;
+			w->stage_pos = w->pos;
+		}
+
+		n = w->chunk - w->fill;
+		if (n > len)
+			n = len;
+		memcpy(stage(w) + w->fill, p, n);
+		w->fill += n;
+		if (w->fill == w->chunk && stage_submit(w, w->fill))
+			return -1;
+advance:
+		p += n;
+		len -= n;
+		w->pos += n;
+		w->bytes += n;
+	}
+	return 0;
+}
+
+/* Write the len bytes at p to offset pos */
+static int write_run(struct blk_writer *w, off64_t pos, const unsigned char *p,
+		size_t len)
+{
+	if (w->pos != pos && blk_writer_seek(w, pos))
+		return -1;
+	return write_data(w, p, len);
+}
+
+/* Skip-unchanged mode: read back the span of the destination that holds
+ * the next bytes, compare them block by block and write only the runs
+ * of blocks that differ */
+static int skip_write(struct blk_writer *w, const unsigned char *p,
+		size_t len)
+{
+	off64_t base, at;
+	size_t n, rlen, off, bl;
+	ssize_t r, run;
+
+	while (len) {
+		at = w->pos;
+		base = at - at % SKIP_SPAN;
+		n = base + SKIP_SPAN - at;
+		if (n > len)
+			n = len;
+		rlen = at + n - base;
+		rlen = (rlen + SKIP_BLOCK - 1) / SKIP_BLOCK * SKIP_BLOCK;
+
+		do {
+			r = pread64(w->rfd, w->rbuf, rlen, base);
+		} while (r < 0 && errno == EINTR);
+		if (r < (ssize_t)(at + n - base)) {
+			/* Can't tell, write it all */
+			if (write_data(w, p, n))
+				return -1;
+			goto next;
+		}
+
+		run = -1;
+		for (off = 0; off < n; off += bl) {
+			bl = SKIP_BLOCK - (at + off) % SKIP_BLOCK;
+			if (bl > n - off)
+				bl = n - off;
+			if (memcmp(w->rbuf + (at - base) + off, p + off, bl)) {
+				if (run < 0)
+					run = off;
+				continue;
+			}
+			w->skipped += bl;
+			if (run >= 0 && write_run(w, at + run, p + run, off - run))
+				return -1;
+			run = -1;
+		}
+		if (run >= 0 && write_run(w, at + run, p + run, n - run))
+			return -1;
+		if (w->pos != at + (off64_t)n && blk_writer_seek(w, at + n))
+			return -1;
+next:
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int write_some(struct blk_writer *w, const unsigned char *p,
+		size_t len)
+{
+	if (w->rfd >= 0)
+		return skip_write(w, p, len);
+	return write_data(w, p, len);
+}
+
+/* Whether the len bytes at p, a multiple of 64, are all zero. Data
+ * blocks usually give up within the first few bytes. */
+static int all_zero(const unsigned char *p, size_t len)
+{
+	size_t i;
+#ifdef __SSE2__
+	__m128i v;
+
+	for (i = 0; i < len; i += 64) {
+		v = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i)),
+				_mm_loadu_si128((const __m128i *)(p + i + 16))),
+			_mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i + 32)),
+				_mm_loadu_si128((const __m128i *)(p + i + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v,
+						_mm_setzero_si128())) != 0xffff)
+			return 0;
+	}
+#else
+	uint64_t v[8];
+	unsigned j;
+
+	for (i = 0; i < len; i += 64) {
+		memcpy(v, p + i, sizeof(v));
+		for (j = 1; j < 8; j++)
+			v[0] |= v[j];
+		if (v[0])
+			return 0;
+	}
+#endif
+	return 1;
+}
+
+/* Size of the block of a write at off, cut at SKIP_BLOCK boundaries of
+ * the device */
+static size_t block_at(off64_t at, size_t off, size_t len)
+{
+	size_t bl = SKIP_BLOCK - (at + off) % SKIP_BLOCK;
+
+	return bl > len - off ? len - off : bl;
+}
+
+/* Look for runs of zero blocks, and discard the part of them aligned to
+ * the discard granularity instead of writing it */
+static int zero_write(struct blk_writer *w, const unsigned char *p,
+		size_t len)
+{
+	off64_t at = w->pos;
+	off64_t s, e;
+	size_t off = 0, done = 0, run, bl;
+
+	while (off < len) {
+		bl = block_at(at, off, len);
+		if (bl != SKIP_BLOCK || !all_zero(p + off, bl)) {
+			off += bl;
+			continue;
+		}
+		run = off;
+		do {
+			off += bl;
+			if (off == len)
+				break;
+			bl = block_at(at, off, len);
+		} while (bl == SKIP_BLOCK && all_zero(p + off, bl));
+
+		s = at + run;
+		s = (s + w->zero_align - 1) / w->zero_align * w->zero_align;
+		e = at + off;
+		e -= e % w->zero_align;
+		if (e - s < ZERO_RUN_MIN)
+			continue;
+
+		if (write_some(w, p + done, s - at - done))
+			return -1;
+		if (blkdev_discard(w->fd, s, e - s, 0)) {
+			/* Write everything from here on */
+			pr_verbose("discard: %s\n", strerror(errno));
+			w->zero_align = 0;
+			done = s - at;
+			break;
+		}
+		w->discarded += e - s;
+		w->bytes += e - s;
+		if (blk_writer_seek(w, e))
+			return -1;
+		done = e - at;
+	}
+	return write_some(w, p + done, len - done);
+}
+
+int blk_writer_write(struct blk_writer *w, const void *buf, size_t len)
+{
+	if (w->zero_align && len >= ZERO_RUN_MIN)
+		return zero_write(w, buf, len);
+	return write_some(w, buf, len);
+}
+
+static int writev_buffered(struct blk_writer *w, struct iovec *iov, int cnt)
+{
+	struct iovec *v = iov;
+	unsigned char *end;
+	size_t n, rest;
+	int k;
+
+	if (w->error)
+		return -1;
+
+	while (cnt) {
+		/* A window at a time, as in write_data(), the last iovec
+		 * cut short if it crosses the end of the window */
+		n = 0;
+		for (k = 0; k < cnt && (!w->wb || n < WRITEBACK_WINDOW); k++)
+			n += v[k].iov_len;
+		rest = 0;
+		if (w->wb && n > WRITEBACK_WINDOW) {
+			rest = n - WRITEBACK_WINDOW;
+			v[k - 1].iov_len -= rest;
+			n = WRITEBACK_WINDOW;
+		}
+		end = (unsigned char *)v[k - 1].iov_base + v[k - 1].iov_len;
+
+		if (writev_all(w->fd, v, k)) {
+			pr_perror("writev");
+			w->error = 1;
+			return -1;
+		}
+		writeback(w, w->pos, n);
+		w->pos += n;
+		w->bytes += n;
+
+		if (rest) {
+			k--;
+			v[k].iov_base = end;
+			v[k].iov_len = rest;
+		}
+		v += k;
+		cnt -= k;
+	}
+	return 0;
+}
+
+int blk_writer_writev(struct blk_writer *w, struct iovec *iov, int cnt)
+{
+	int i, j;
+
+	if (w->engine != WRITE_BUFFERED || w->rfd >= 0 || w->verify) {
+		for (i = 0; i < cnt; i++)
+			if (blk_writer_write(w, iov[i].iov_base, iov[i].iov_len))
+				return -1;
+		return 0;
+	}
+	if (!w->zero_align)
+		return writev_buffered(w, iov, cnt);
+
+	/* iovecs large enough to hold a zero run go through
+	 * blk_writer_write(), the others are still gathered */
+	for (i = 0, j = 0; i < cnt; i++) {
+		if (iov[i].iov_len < ZERO_RUN_MIN)
+			continue;
+		if (writev_buffered(w, iov + j, i - j) ||
+				blk_writer_write(w, iov[i].iov_base,
+					iov[i].iov_len))
+			return -1;
+		j = i + 1;
+	}
+	return writev_buffered(w, iov + j, cnt - j);
+}
+
+int blk_writer_flush(struct blk_writer *w)
+{
+	unsigned char *tail;
+	off64_t tail_pos;
+	size_t aligned, tail_len;
+
+	if (w->engine == WRITE_BUFFERED)
+		return w->error ? -1 : 0;
+
+	if (w->fill && !w->error) {
+		aligned = w->fill - w->fill % w->align;
+		tail = stage(w) + aligned;
+		tail_pos = w->stage_pos + aligned;
+		tail_len = w->fill - aligned;
+		if (aligned)
+			stage_submit(w, aligned);
+		if (tail_len && !w->error)
+			buffered_pwrite(w, tail, tail_len, tail_pos);
+	}
+	w->fill = 0;
+	if (w->inflight)
+		reap(w, w->inflight);
+	return w->error ? -1 : 0;
+}
+
+int blk_writer_seek(struct blk_writer *w, off64_t pos)
+{
+	if (blk_writer_flush(w))
+		return -1;
+	if (w->engine == WRITE_BUFFERED && lseek64(w->fd, pos, SEEK_SET) < 0) {
+		pr_perror("lseek64");
+		w->error = 1;
+		return -1;
+	}
+	w->pos = pos;
+	return 0;
+}
+
+int blk_writer_fill(struct blk_writer *w, uint64_t len, uint32_t pattern)
+{
+	off64_t pos = w->pos;
+	uint64_t n, done;
+
+	if (blk_writer_flush(w))
+		return -1;
+	/* Pattern fills go through the page cache, one window at a time
+	 * so they don't pile up dirty pages either. The window size keeps
+	 * the pattern aligned. Zero fills are left to BLKZEROOUT. */
+	for (done = 0; done < len; done += n) {
+		n = len - done;
+		if (pattern && n > WRITEBACK_WINDOW)
+			n = WRITEBACK_WINDOW;
+		if (blkdev_fill(w->fd, pos + done, n, pattern)) {
+			w->error = 1;
+			return -1;
+		}
+		if (pattern)
+			writeback(w, pos + done, n);
+	}
+	w->bytes += len;
+	/* blkdev_fill() leaves the file position wherever it ended up */
+	return blk_writer_seek(w, pos + len);
+}
+
+int blk_writer_close(struct blk_writer *w)
+{
+	int ret;
+
+	ret = blk_writer_flush(w);
+	if (!ret && w->owns_fd && fdatasync(w->fd)) {
+		pr_perror("fdatasync");
+		ret = -1;
+	}
+	if (w->verify && verify_finish(w))
+		ret = -1;
+	if (w->engine == WRITE_AIO)
+		io_destroy(w->ctx);
+	if (w->dfd >= 0)
+		close(w->dfd);
+	/* Don't leave pages cached from before the discards around */
+	if (w->discarded && ioctl(w->fd, BLKFLSBUF, 0))
+		pr_verbose("BLKFLSBUF: %s\n", strerror(errno));
+	if (w->owns_fd && close(w->fd)) {
+		pr_perror("close");
+		ret = -1;
+	}
+	if (w->rfd >= 0) {
+		close(w->rfd);
+		pthread_mutex_lock(&skip_lock);
+		skip_total += w->bytes + w->skipped;
+		skip_skipped += w->skipped;
+		pthread_mutex_unlock(&skip_lock);
+	}
+	free(w->mem);
+	free(w->cbs);
+	free(w->busy);
+	free(w->rbuf);
+	pr_verbose("%s engine wrote %llu bytes, %llu of them discarded\n",
+			write_engine_name(w->engine),
+			(unsigned long long)w->bytes,
+			(unsigned long long)w->discarded);
+	return ret;
+}
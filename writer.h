@@ -0,0 +1,197 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DROIDBOOT_WRITER_H
+#define DROIDBOOT_WRITER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/aio_abi.h>
+
+/* Block write engines behind the named_file_write*() family:
+ *
+ * buffered : plain write()s through the page cache
+ * direct   : O_DIRECT writes of erase block sized chunks, aligned to the
+ *            device's logical block size
+ * aio      : like direct, with up to depth chunks in flight at once
+ *            through Linux native AIO
+ *
+ * The direct engines only apply to block devices; anything else, and
+ * appends, are written buffered. Unaligned heads and tails go through
+ * the page cache as well.
+ *
+ * Buffered writes are pushed out in WRITEBACK_WINDOW sized windows as
+ * they go, so only a bounded amount of dirty data builds up, and the
+ * data is made durable with fdatasync() when the writer is closed. */
+
+#define WRITE_BUFFERED		0
+#define WRITE_DIRECT		1
+#define WRITE_AIO		2
+
+#define WRITE_DEPTH_DEFAULT	4
+#define WRITE_DEPTH_MAX		32
+
+/* Used when the device doesn't tell its erase block size */
+#define WRITE_CHUNK_DEFAULT	(4 * 1024 * 1024)
+
+/* Large raw and sparse images on block devices are split into up to
+ * WRITE_REGIONS_MAX aligned regions written concurrently, each by its
+ * own thread and writer, to keep several requests outstanding on eMMC
+ * parts with internal parallelism. Regions are no smaller than
+ * WRITE_REGION_MIN. */
+#define WRITE_REGIONS_DEFAULT	4
+#define WRITE_REGIONS_MAX	16
+#define WRITE_REGION_MIN	(16 * 1024 * 1024)
+#define WRITE_REGION_ALIGN	(1024 * 1024)
+
+/* In skip-unchanged mode the destination is read back SKIP_SPAN bytes
+ * at a time ahead of the writes, and only the SKIP_BLOCK sized blocks
+ * that differ from the new data are written */
+#define SKIP_BLOCK		4096
+#define SKIP_SPAN		(1024 * 1024)
+
+/* On devices that read back zeroes after a discard, all-zero extents of
+ * at least ZERO_RUN_MIN bytes, aligned to the discard granularity, are
+ * discarded instead of written */
+#define ZERO_RUN_MIN		(1024 * 1024)
+
+/* In verify mode, the data written is read back with O_DIRECT by a
+ * thread trailing the writer, up to VERIFY_SPAN bytes at a time, and
+ * checked against the CRC32C of each VERIFY_BLOCK sized block taken as
+ * it was written. Fills and discarded zero runs aren't read back. */
+#define VERIFY_BLOCK		4096
+#define VERIFY_SPAN		(1024 * 1024)
+
+/* Writeback of a window is started once it is full, and waited for
+ * when the next one is; at most two windows are dirty at a time */
+#define WRITEBACK_WINDOW	(8 * 1024 * 1024)
+
+struct blk_verifier;
+
+struct blk_writer {
+	int fd;			/* buffered; head, tail and fills */
+	int dfd;		/* O_DIRECT, or -1 */
+	int engine;
+	int owns_fd;
+	int error;
+	off64_t pos;		/* offset of the next byte written */
+	size_t align;		/* logical block size */
+	size_t chunk;		/* size of each direct write */
+
+	/* Staging buffers for the direct engines */
+	unsigned nbufs;
+	unsigned cur;
+	size_t fill;		/* bytes staged in buffer cur */
+	off64_t stage_pos;	/* device offset of buffer cur */
+	unsigned char *mem;
+	unsigned char *busy;	/* buffer has an AIO write in flight */
+	unsigned inflight;
+	aio_context_t ctx;
+	struct iocb *cbs;
+
+	/* Writeback of the buffered writes; disabled if wb is 0 */
+	int wb;
+	size_t wb_dirty;
+	off64_t wb_lo, wb_hi;		/* dirtied since the last kick */
+	off64_t wb_prev_lo, wb_prev_hi;	/* under writeback */
+
+	/* Skip-unchanged mode; disabled if rfd is -1 */
+	int rfd;
+	unsigned char *rbuf;
+	uint64_t skipped;
+
+	/* Zero extents are discarded if zero_align isn't 0 */
+	size_t zero_align;
+	uint64_t discarded;
+
+	/* Read back verification; NULL if disabled */
+	struct blk_verifier *verify;
+
+	uint64_t bytes;
+};
+
+/* Name of an engine as accepted by write_engine_parse() */
+const char *write_engine_name(int engine);
+/* "buffered", "direct" or "aio"; -1 if unknown */
+int write_engine_parse(const char *name);
+
+/* Engine, AIO queue depth and number of regions used by the writers of
+ * the calling thread; the flash command selects them per image or per
+ * volume. 0 picks the default depth, or the device's default number of
+ * regions: WRITE_REGIONS_DEFAULT for solid state disks, 1 otherwise. */
+void write_engine_select(int engine, unsigned depth, unsigned regions);
+void write_engine_current(int *engine, unsigned *depth, unsigned *regions);
+/* Only write what differs from the block device's current contents,
+ * for the calling thread's writers. Reset by write_engine_select(). */
+void write_skip_select(int skip);
+/* Bytes compared and skipped by skip-unchanged writers since the last
+ * write_skip_reset() */
+void write_skip_reset(void);
+void write_skip_stats(uint64_t *total, uint64_t *skipped);
+
+/* Read back and check everything written by the calling thread's
+ * writers. Reset by write_engine_select(). */
+void write_verify_select(int verify);
+/* Bytes read back by verifying writers since the last
+ * write_verify_reset(), and the device offset of the first block that
+ * didn't match, or -1 */
+void write_verify_reset(void);
+void write_verify_stats(uint64_t *checked, int64_t *first_bad);
+
+/* Number of regions to split a write of len bytes to filename into */
+unsigned write_regions_for(const char *filename, uint64_t len);
+/* Run fn(arg, 0) ... fn(arg, n - 1) on n threads, each using the calling
+ * thread's engine and depth. Returns -1 if any of them failed. */
+int write_parallel(unsigned n, int (*fn)(void *arg, unsigned idx),
+		void *arg);
+/* Record the throughput of a write done with n regions */
+void write_rate_record(unsigned n, uint64_t bytes, double secs);
+/* "n:MB/s" of the latest write with each number of regions, for getvar */
+void write_rates(char *buf, size_t len);
+
+/* open() filename with flags and position it at offset, to be written
+ * with the calling thread's engine. offset is ignored for O_APPEND. */
+int blk_writer_open(struct blk_writer *w, const char *filename, int flags,
+		off64_t offset);
+/* Wrap an already open descriptor, written buffered at its current
+ * position. The descriptor is not closed by blk_writer_close(). */
+void blk_writer_fdopen(struct blk_writer *w, int fd);
+
+/* Write at the current position and advance it */
+int blk_writer_write(struct blk_writer *w, const void *buf, size_t len);
+/* iov is used up in the process */
+int blk_writer_writev(struct blk_writer *w, struct iovec *iov, int cnt);
+/* Move to another offset, writing out whatever is staged first */
+int blk_writer_seek(struct blk_writer *w, off64_t pos);
+/* Fill len bytes at the current position with a 32-bit pattern */
+int blk_writer_fill(struct blk_writer *w, uint64_t len, uint32_t pattern);
+/* Write out everything staged and wait for it */
+int blk_writer_flush(struct blk_writer *w);
+/* Flush, fdatasync() and close; returns -1 if any write failed */
+int blk_writer_close(struct blk_writer *w);
+
+/* Remember a block device written behind the page cache's back (or
+ * through it), to be flushed by writeback_sync_devices() */
+void writeback_note_device(const char *device);
+/* fdatasync() and BLKFLSBUF every device noted so far, instead of a
+ * global sync() */
+int writeback_sync_devices(void);
+/* Number of times device was noted, i.e. opened for writing or mounted,
+ * since droidboot started */
+unsigned writeback_device_generation(const char *device);
+
+#endif
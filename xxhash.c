@@ -0,0 +1,260 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Implementation of the xxHash algorithms by Yann Collet, written from
+ * the published specification. Little-endian hosts only. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "xxhash.h"
+
+#define P32_1	2654435761U
+#define P32_2	2246822519U
+#define P32_3	3266489917U
+#define P32_4	668265263U
+#define P32_5	374761393U
+
+#define P64_1	11400714785074694791ULL
+#define P64_2	14029467366897019727ULL
+#define P64_3	1609587929392839161ULL
+#define P64_4	9650029242287828579ULL
+#define P64_5	2870177450012600261ULL
+
+static inline uint32_t rotl32(uint32_t x, int r)
+{
+	return (x << r) | (x >> (32 - r));
+}
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint32_t read32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t xxh32_round(uint32_t acc, uint32_t input)
+{
+	acc += input * P32_2;
+	acc = rotl32(acc, 13);
+	return acc * P32_1;
+}
+
+void xxh32_reset(struct xxh32_state *s, uint32_t seed)
+{
+	memset(s, 0, sizeof(*s));
+	s->seed = seed;
+	s->v[0] = seed + P32_1 + P32_2;
+	s->v[1] = seed + P32_2;
+	s->v[2] = seed;
+	s->v[3] = seed - P32_1;
+}
+
+void xxh32_update(struct xxh32_state *s, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	const unsigned char *end = p + len;
+	unsigned char *mem = (unsigned char *)s->mem;
+
+	s->total_len += len;
+
+	if (s->memsize + len < 16) {
+		memcpy(mem + s->memsize, p, len);
+		s->memsize += len;
+		return;
+	}
+
+	if (s->memsize) {
+		memcpy(mem + s->memsize, p, 16 - s->memsize);
+		p += 16 - s->memsize;
+		s->v[0] = xxh32_round(s->v[0], read32(mem));
+		s->v[1] = xxh32_round(s->v[1], read32(mem + 4));
+		s->v[2] = xxh32_round(s->v[2], read32(mem + 8));
+		s->v[3] = xxh32_round(s->v[3], read32(mem + 12));
+		s->memsize = 0;
+	}
+
+	while (end - p >= 16) {
+		s->v[0] = xxh32_round(s->v[0], read32(p));
+		s->v[1] = xxh32_round(s->v[1], read32(p + 4));
+		s->v[2] = xxh32_round(s->v[2], read32(p + 8));
+		s->v[3] = xxh32_round(s->v[3], read32(p + 12));
+		p += 16;
+	}
+
+	if (p < end) {
+		memcpy(mem, p, end - p);
+		s->memsize = end - p;
+	}
+}
+
+uint32_t xxh32_digest(const struct xxh32_state *s)
+{
+	const unsigned char *p = (const unsigned char *)s->mem;
+	const unsigned char *end = p + s->memsize;
+	uint32_t h;
+
+	if (s->total_len >= 16)
+		h = rotl32(s->v[0], 1) + rotl32(s->v[1], 7) +
+			rotl32(s->v[2], 12) + rotl32(s->v[3], 18);
+	else
+		h = s->seed + P32_5;
+
+	h += (uint32_t)s->total_len;
+
+	while (end - p >= 4) {
+		h += read32(p) * P32_3;
+		h = rotl32(h, 17) * P32_4;
+		p += 4;
+	}
+	while (p < end) {
+		h += (*p++) * P32_5;
+		h = rotl32(h, 11) * P32_1;
+	}
+
+	h ^= h >> 15;
+	h *= P32_2;
+	h ^= h >> 13;
+	h *= P32_3;
+	h ^= h >> 16;
+	return h;
+}
+
+uint32_t xxh32(const void *buf, size_t len, uint32_t seed)
+{
+	struct xxh32_state s;
+
+	xxh32_reset(&s, seed);
+	xxh32_update(&s, buf, len);
+	return xxh32_digest(&s);
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * P64_2;
+	acc = rotl64(acc, 31);
+	return acc * P64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * P64_1 + P64_4;
+}
+
+void xxh64_reset(struct xxh64_state *s, uint64_t seed)
+{
+	memset(s, 0, sizeof(*s));
+	s->seed = seed;
+	s->v[0] = seed + P64_1 + P64_2;
+	s->v[1] = seed + P64_2;
+	s->v[2] = seed;
+	s->v[3] = seed - P64_1;
+}
+
+void xxh64_update(struct xxh64_state *s, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	const unsigned char *end = p + len;
+	unsigned char *mem = (unsigned char *)s->mem;
+
+	s->total_len += len;
+
+	if (s->memsize + len < 32) {
+		memcpy(mem + s->memsize, p, len);
+		s->memsize += len;
+		return;
+	}
+
+	if (s->memsize) {
+		memcpy(mem + s->memsize, p, 32 - s->memsize);
+		p += 32 - s->memsize;
+		s->v[0] = xxh64_round(s->v[0], read64(mem));
+		s->v[1] = xxh64_round(s->v[1], read64(mem + 8));
+		s->v[2] = xxh64_round(s->v[2], read64(mem + 16));
+		s->v[3] = xxh64_round(s->v[3], read64(mem + 24));
+		s->memsize = 0;
+	}
+
+	while (end - p >= 32) {
+		s->v[0] = xxh64_round(s->v[0], read64(p));
+		s->v[1] = xxh64_round(s->v[1], read64(p + 8));
+		s->v[2] = xxh64_round(s->v[2], read64(p + 16));
+		s->v[3] = xxh64_round(s->v[3], read64(p + 24));
+		p += 32;
+	}
+
+	if (p < end) {
+		memcpy(mem, p, end - p);
+		s->memsize = end - p;
+	}
+}
+
+uint64_t xxh64_digest(const struct xxh64_state *s)
+{
+	const unsigned char *p = (const unsigned char *)s->mem;
+	const unsigned char *end = p + s->memsize;
+	uint64_t h;
+
+	if (s->total_len >= 32) {
+		h = rotl64(s->v[0], 1) + rotl64(s->v[1], 7) +
+			rotl64(s->v[2], 12) + rotl64(s->v[3], 18);
+		h = xxh64_merge(h, s->v[0]);
+		h = xxh64_merge(h, s->v[1]);
+		h = xxh64_merge(h, s->v[2]);
+		h = xxh64_merge(h, s->v[3]);
+	} else {
+		h = s->seed + P64_5;
+	}
+
+	h += s->total_len;
+
+	while (end - p >= 8) {
+		h ^= xxh64_round(0, read64(p));
+		h = rotl64(h, 27) * P64_1 + P64_4;
+		p += 8;
+	}
+	if (end - p >= 4) {
+		h ^= (uint64_t)read32(p) * P64_1;
+		h = rotl64(h, 23) * P64_2 + P64_3;
+		p += 4;
+	}
+	while (p < end) {
+		h ^= (*p++) * P64_5;
+		h = rotl64(h, 11) * P64_1;
+	}
+
+	h ^= h >> 33;
+	h *= P64_2;
+	h ^= h >> 29;
+	h *= P64_3;
+	h ^= h >> 32;
+	return h;
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DROIDBOOT_XXHASH_H
+#define DROIDBOOT_XXHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Streaming xxHash32/xxHash64, as used for the content checksums of
+ * the LZ4 and zstd frame formats */
+
+struct xxh32_state {
+	uint64_t total_len;
+	uint32_t v[4];
+	uint32_t mem[4];
+	unsigned memsize;
+	uint32_t seed;
+};
+
+struct xxh64_state {
+	uint64_t total_len;
+	uint64_t v[4];
+	uint64_t mem[4];
+	unsigned memsize;
+	uint64_t seed;
+};
+
+void xxh32_reset(struct xxh32_state *s, uint32_t seed);
+void xxh32_update(struct xxh32_state *s, const void *buf, size_t len);
+uint32_t xxh32_digest(const struct xxh32_state *s);
+uint32_t xxh32(const void *buf, size_t len, uint32_t seed);
+
+void xxh64_reset(struct xxh64_state *s, uint64_t seed);
+void xxh64_update(struct xxh64_state *s, const void *buf, size_t len);
+uint64_t xxh64_digest(const struct xxh64_state *s);
+
+#endif
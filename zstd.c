@@ -0,0 +1,1072 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Zstandard decoder written from the format specification (RFC 8878).
+ * It favours simplicity over speed: entropy decoding is done one symbol
+ * at a time, and sequences are executed as soon as they are decoded.
+ * Little-endian hosts only. */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "droidboot_ui.h"
+#include "xxhash.h"
+#include "zstd.h"
+
+#define BLOCK_MAX	(128 * 1024)
+
+#define HUF_MAX_BITS	11
+#define HUF_MAX_SYMBOLS	256
+
+#define FSE_MAX_LOG	9
+#define FSE_MAX_SYMBOLS	256
+
+#define LL_MAX_LOG	9
+#define ML_MAX_LOG	9
+#define OF_MAX_LOG	8
+#define HUFW_MAX_LOG	6
+
+#define LL_MAX_CODE	35
+#define ML_MAX_CODE	52
+#define OF_MAX_CODE	31
+
+#define corrupt(msg) do { \
+	pr_error("zstd: %s\n", msg); \
+	return -1; \
+	} while (0)
+
+static const uint32_t ll_base[LL_MAX_CODE + 1] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+	16, 18, 20, 22, 24, 28, 32, 40, 48, 64, 128, 256, 512, 1024, 2048,
+	4096, 8192, 16384, 32768, 65536
+};
+
+static const uint8_t ll_bits[LL_MAX_CODE + 1] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 1, 1, 2, 2, 3, 3, 4, 6, 7, 8, 9, 10, 11, 12,
+	13, 14, 15, 16
+};
+
+static const uint32_t ml_base[ML_MAX_CODE + 1] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18,
+	19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34,
+	35, 37, 39, 41, 43, 47, 51, 59, 67, 83, 99, 131, 259, 515, 1027,
+	2051, 4099, 8195, 16387, 32771, 65539
+};
+
+static const uint8_t ml_bits[ML_MAX_CODE + 1] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 7, 8, 9, 10, 11,
+	12, 13, 14, 15, 16
+};
+
+static const int16_t ll_default[LL_MAX_CODE + 1] = {
+	4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1,
+	2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 2, 1, 1, 1, 1, 1,
+	-1, -1, -1, -1
+};
+
+static const int16_t ml_default[ML_MAX_CODE + 1] = {
+	1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1,
+	-1, -1, -1, -1, -1
+};
+
+static const int16_t of_default[29] = {
+	1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1
+};
+
+struct fse_entry {
+	uint8_t symbol;
+	uint8_t nbits;
+	uint16_t base;
+};
+
+struct fse_table {
+	int log;
+	struct fse_entry e[1 << FSE_MAX_LOG];
+};
+
+struct huf_entry {
+	uint8_t symbol;
+	uint8_t nbits;
+};
+
+struct huf_table {
+	int max_bits;
+	struct huf_entry e[1 << HUF_MAX_BITS];
+};
+
+struct zstd_out {
+	unsigned char *buf;
+	size_t cap;
+	size_t pos;		/* end of the decoded data */
+	size_t flushed;		/* data before this was handed to fn */
+	size_t window;
+	int (*fn)(void *arg, const unsigned char *buf, size_t len);
+	void *arg;
+};
+
+struct zstd_dctx {
+	struct zstd_out out;
+	uint64_t total;
+	struct huf_table huf;
+	struct fse_table ll, of, ml;
+	int huf_valid, ll_valid, of_valid, ml_valid;
+	uint32_t rep[3];
+	unsigned char lit[BLOCK_MAX];
+	size_t lit_len;
+	struct xxh64_state xxh;
+};
+
+static inline int highbit(uint32_t v)
+{
+	return 31 - __builtin_clz(v);
+}
+
+static inline uint32_t le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t le_n(const unsigned char *p, int n)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = n - 1; i >= 0; i--)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+/* Forward bit reader, for FSE table descriptions */
+struct fwd_bits {
+	const unsigned char *p;
+	size_t len;
+	size_t pos;
+};
+
+static int fwd_read(struct fwd_bits *b, int n, unsigned *out)
+{
+	unsigned v = 0;
+	int i;
+
+	if (b->pos + n > b->len * 8)
+		return -1;
+	for (i = 0; i < n; i++, b->pos++)
+		v |= ((b->p[b->pos >> 3] >> (b->pos & 7)) & 1) << i;
+	*out = v;
+	return 0;
+}
+
+/* Backward bit reader, for Huffman and FSE coded bitstreams. The stream
+ * is consumed from its last bit towards its first; bits before the
+ * start of the stream read as zero. */
+struct bstream {
+	const unsigned char *src;
+	size_t len;
+	int64_t pos;
+};
+
+static int bs_init(struct bstream *bs, const unsigned char *src, size_t len)
+{
+	if (!len || !src[len - 1])
+		return -1;
+	bs->src = src;
+	bs->len = len;
+	bs->pos = (int64_t)len * 8 - 8 + highbit(src[len - 1]);
+	return 0;
+}
+
+static uint64_t bs_read_slow(const struct bstream *bs, int64_t pos, int n)
+{
+	uint64_t v = 0;
+	int64_t bit;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		bit = pos + i;
+		if (bit >= 0 && bit < (int64_t)bs->len * 8)
+			v |= (uint64_t)((bs->src[bit >> 3] >> (bit & 7)) & 1) << i;
+	}
+	return v;
+}
+
+static inline uint64_t bs_read(struct bstream *bs, int n)
+{
+	uint64_t v;
+	int64_t pos;
+
+	if (!n)
+		return 0;
+	bs->pos -= n;
+	pos = bs->pos;
+	if (pos >= 0 && (size_t)(pos >> 3) + 8 <= bs->len) {
+		memcpy(&v, bs->src + (pos >> 3), sizeof(v));
+		return (v >> (pos & 7)) & ((1ULL << n) - 1);
+	}
+	return bs_read_slow(bs, pos, n);
+}
+
+static int fse_build(struct fse_table *t, const int16_t *norm, int nsym,
+		int log)
+{
+	uint16_t next[FSE_MAX_SYMBOLS];
+	unsigned size = 1 << log;
+	unsigned high = size;
+	unsigned step = (size >> 1) + (size >> 3) + 3;
+	unsigned mask = size - 1;
+	unsigned pos = 0;
+	unsigned i;
+	int s, j;
+
+	for (s = 0; s < nsym; s++) {
+		if (norm[s] == -1) {
+			t->e[--high].symbol = s;
+			next[s] = 1;
+		}
+	}
+
+	for (s = 0; s < nsym; s++) {
+		if (norm[s] <= 0)
+			continue;
+		next[s] = norm[s];
+		for (j = 0; j < norm[s]; j++) {
+			t->e[pos].symbol = s;
+			do {
+				pos = (pos + step) & mask;
+			} while (pos >= high);
+		}
+	}
+	if (pos)
+		corrupt("bad FSE distribution");
+
+	for (i = 0; i < size; i++) {
+		uint16_t d = next[t->e[i].symbol]++;
+
+		t->e[i].nbits = log - highbit(d);
+		t->e[i].base = (d << t->e[i].nbits) - size;
+	}
+	t->log = log;
+	return 0;
+}
+
+static void fse_rle(struct fse_table *t, uint8_t symbol)
+{
+	t->log = 0;
+	t->e[0].symbol = symbol;
+	t->e[0].nbits = 0;
+	t->e[0].base = 0;
+}
+
+/* Read an FSE table description; returns the number of bytes used */
+static ssize_t fse_read_table(struct fse_table *t, const unsigned char *src,
+		size_t len, int max_log, int max_symbol)
+{
+	struct fwd_bits b;
+	int16_t norm[FSE_MAX_SYMBOLS];
+	int remaining, log, nsym = 0;
+	unsigned v, repeat;
+
+	b.p = src;
+	b.len = len;
+	b.pos = 0;
+
+	if (fwd_read(&b, 4, &v))
+		corrupt("truncated FSE table");
+	log = v + 5;
+	if (log > max_log)
+		corrupt("FSE accuracy too large");
+
+	remaining = 1 << log;
+	while (remaining > 0) {
+		int bits = highbit(remaining + 1) + 1;
+		unsigned lower_mask = (1U << (bits - 1)) - 1;
+		unsigned threshold = (1U << bits) - 1 - (remaining + 1);
+		int proba;
+
+		if (nsym > max_symbol)
+			corrupt("too many FSE symbols");
+		if (fwd_read(&b, bits, &v))
+			corrupt("truncated FSE table");
+		if ((v & lower_mask) < threshold) {
+			b.pos--;
+			v &= lower_mask;
+		} else if (v > lower_mask) {
+			v -= threshold;
+		}
+		proba = (int)v - 1;
+		remaining -= proba < 0 ? -proba : proba;
+		norm[nsym++] = proba;
+
+		if (proba == 0) {
+			do {
+				if (fwd_read(&b, 2, &repeat))
+					corrupt("truncated FSE table");
+				if (nsym + (int)repeat > max_symbol + 1)
+					corrupt("too many FSE symbols");
+				for (v = 0; v < repeat; v++)
+					norm[nsym++] = 0;
+			} while (repeat == 3);
+		}
+	}
+	if (remaining)
+		corrupt("bad FSE distribution");
+
+	if (fse_build(t, norm, nsym, log))
+		return -1;
+	return (b.pos + 7) / 8;
+}
+
+static inline uint8_t fse_peek(const struct fse_table *t, unsigned state)
+{
+	return t->e[state].symbol;
+}
+
+static inline unsigned fse_update(const struct fse_table *t, unsigned state,
+		struct bstream *bs)
+{
+	const struct fse_entry *e = &t->e[state];
+
+	return e->base + bs_read(bs, e->nbits);
+}
+
+static int huf_build(struct huf_table *t, uint8_t *weights, int nweights)
+{
+	uint8_t bits[HUF_MAX_SYMBOLS];
+	uint32_t rank_count[HUF_MAX_BITS + 1];
+	uint32_t rank_idx[HUF_MAX_BITS + 1];
+	uint32_t total = 0, left;
+	int max_bits, nsym, i, j;
+
+	if (nweights >= HUF_MAX_SYMBOLS)
+		corrupt("too many Huffman weights");
+
+	for (i = 0; i < nweights; i++) {
+		if (weights[i] > HUF_MAX_BITS)
+			corrupt("bad Huffman weight");
+		if (weights[i])
+			total += 1 << (weights[i] - 1);
+	}
+	if (!total)
+		corrupt("empty Huffman table");
+
+	max_bits = highbit(total) + 1;
+	if (max_bits > HUF_MAX_BITS)
+		corrupt("Huffman table too deep");
+
+	/* The last weight is implied by the others */
+	left = (1U << max_bits) - total;
+	if (left & (left - 1))
+		corrupt("bad Huffman weights");
+	weights[nweights] = highbit(left) + 1;
+	nsym = nweights + 1;
+
+	memset(rank_count, 0, sizeof(rank_count));
+	for (i = 0; i < nsym; i++) {
+		bits[i] = weights[i] ? max_bits + 1 - weights[i] : 0;
+		rank_count[bits[i]]++;
+	}
+
+	/* Longest codes come first */
+	rank_idx[max_bits] = 0;
+	for (i = max_bits; i >= 1; i--)
+		rank_idx[i - 1] = rank_idx[i] +
+			rank_count[i] * (1U << (max_bits - i));
+	if (rank_idx[0] != (1U << max_bits))
+		corrupt("bad Huffman table");
+
+	for (i = 0; i < nsym; i++) {
+		uint32_t code, n;
+
+		if (!bits[i])
+			continue;
+		code = rank_idx[bits[i]];
+		n = 1U << (max_bits - bits[i]);
+		for (j = 0; j < (int)n; j++) {
+			t->e[code + j].symbol = i;
+			t->e[code + j].nbits = bits[i];
+		}
+		rank_idx[bits[i]] += n;
+	}
+	t->max_bits = max_bits;
+	return 0;
+}
+
+/* Read a Huffman tree description; returns the number of bytes used */
+static ssize_t huf_read_table(struct huf_table *t, const unsigned char *src,
+		size_t len)
+{
+	uint8_t weights[HUF_MAX_SYMBOLS];
+	int nweights = 0;
+	size_t used;
+
+	if (!len)
+		corrupt("truncated Huffman table");
+
+	if (src[0] >= 128) {
+		int i;
+
+		/* Weights stored directly, 4 bits each */
+		nweights = src[0] - 127;
+		used = 1 + (nweights + 1) / 2;
+		if (used > len)
+			corrupt("truncated Huffman table");
+		for (i = 0; i < nweights; i++)
+			weights[i] = (i & 1) ? (src[1 + i / 2] & 15) :
+				(src[1 + i / 2] >> 4);
+	} else {
+		struct fse_table fse;
+		struct bstream bs;
+		unsigned s1, s2;
+		ssize_t n;
+
+		/* Weights compressed with two interleaved FSE states */
+		used = 1 + src[0];
+		if (used > len)
+			corrupt("truncated Huffman table");
+		n = fse_read_table(&fse, src + 1, src[0], HUFW_MAX_LOG,
+				HUF_MAX_BITS);
+		if (n < 0)
+			return -1;
+		if (bs_init(&bs, src + 1 + n, src[0] - n))
+			corrupt("bad Huffman weight stream");
+
+		s1 = bs_read(&bs, fse.log);
+		s2 = bs_read(&bs, fse.log);
+		for (;;) {
+			if (nweights >= HUF_MAX_SYMBOLS - 1)
+				corrupt("too many Huffman weights");
+			weights[nweights++] = fse_peek(&fse, s1);
+			s1 = fse_update(&fse, s1, &bs);
+			if (bs.pos < 0) {
+				weights[nweights++] = fse_peek(&fse, s2);
+				break;
+			}
+			if (nweights >= HUF_MAX_SYMBOLS - 1)
+				corrupt("too many Huffman weights");
+			weights[nweights++] = fse_peek(&fse, s2);
+			s2 = fse_update(&fse, s2, &bs);
+			if (bs.pos < 0) {
+				weights[nweights++] = fse_peek(&fse, s1);
+				break;
+			}
+		}
+	}
+
+	if (huf_build(t, weights, nweights))
+		return -1;
+	return used;
+}
+
+static int huf_decode_stream(const struct huf_table *t,
+		const unsigned char *src, size_t len,
+		unsigned char *dst, size_t n)
+{
+	struct bstream bs;
+	unsigned mask = (1U << t->max_bits) - 1;
+	unsigned state;
+	size_t i;
+
+	if (bs_init(&bs, src, len))
+		corrupt("bad Huffman stream");
+
+	state = bs_read(&bs, t->max_bits);
+	for (i = 0; i < n; i++) {
+		const struct huf_entry *e = &t->e[state];
+
+		dst[i] = e->symbol;
+		state = ((state << e->nbits) + bs_read(&bs, e->nbits)) & mask;
+	}
+	if (bs.pos != -t->max_bits)
+		corrupt("Huffman stream size mismatch");
+	return 0;
+}
+
+/* Decode the literals section; returns the number of bytes used */
+static ssize_t decode_literals(struct zstd_dctx *d, const unsigned char *src,
+		size_t len)
+{
+	int type = src[0] & 3;
+	int size_format = (src[0] >> 2) & 3;
+	size_t hlen, regen, csize;
+	const unsigned char *p;
+	int streams;
+
+	if (type == 0 || type == 1) {
+		switch (size_format) {
+		case 1:
+			hlen = 2;
+			break;
+		case 3:
+			hlen = 3;
+			break;
+		default:
+			hlen = 1;
+		}
+		if (hlen > len)
+			corrupt("truncated literals header");
+		regen = le_n(src, hlen) >> (hlen == 1 ? 3 : 4);
+		if (regen > BLOCK_MAX)
+			corrupt("literals too large");
+
+		if (type == 0) {
+			if (hlen + regen > len)
+				corrupt("truncated literals");
+			memcpy(d->lit, src + hlen, regen);
+			d->lit_len = regen;
+			return hlen + regen;
+		}
+		if (hlen + 1 > len)
+			corrupt("truncated literals");
+		memset(d->lit, src[hlen], regen);
+		d->lit_len = regen;
+		return hlen + 1;
+	}
+
+	switch (size_format) {
+	case 0:
+	case 1:
+		hlen = 3;
+		break;
+	case 2:
+		hlen = 4;
+		break;
+	default:
+		hlen = 5;
+	}
+	streams = size_format ? 4 : 1;
+	if (hlen > len)
+		corrupt("truncated literals header");
+
+	switch (hlen) {
+	case 3:
+		regen = (le_n(src, 3) >> 4) & 0x3FF;
+		csize = le_n(src, 3) >> 14;
+		break;
+	case 4:
+		regen = (le_n(src, 4) >> 4) & 0x3FFF;
+		csize = le_n(src, 4) >> 18;
+		break;
+	default:
+		regen = (le_n(src, 5) >> 4) & 0x3FFFF;
+		csize = le_n(src, 5) >> 22;
+	}
+	if (regen > BLOCK_MAX)
+		corrupt("literals too large");
+	if (hlen + csize > len)
+		corrupt("truncated literals");
+
+	p = src + hlen;
+	if (type == 2) {
+		ssize_t n = huf_read_table(&d->huf, p, csize);
+
+		if (n < 0)
+			return -1;
+		d->huf_valid = 1;
+		p += n;
+		csize -= n;
+	} else if (!d->huf_valid) {
+		corrupt("treeless literals without a previous table");
+	}
+
+	if (streams == 1) {
+		if (huf_decode_stream(&d->huf, p, csize, d->lit, regen))
+			return -1;
+	} else {
+		size_t s[4], seg, off = 6;
+		int i;
+
+		if (csize < 6)
+			corrupt("truncated jump table");
+		s[0] = p[0] | (p[1] << 8);
+		s[1] = p[2] | (p[3] << 8);
+		s[2] = p[4] | (p[5] << 8);
+		if (s[0] + s[1] + s[2] + 6 > csize)
+			corrupt("bad jump table");
+		s[3] = csize - 6 - s[0] - s[1] - s[2];
+		seg = (regen + 3) / 4;
+		if (seg * 3 > regen)
+			corrupt("literals too small for four streams");
+
+		for (i = 0; i < 4; i++) {
+			size_t n = (i < 3) ? seg : regen - 3 * seg;
+
+			if (huf_decode_stream(&d->huf, p + off, s[i],
+						d->lit + i * seg, n))
+				return -1;
+			off += s[i];
+		}
+	}
+	d->lit_len = regen;
+	return hlen + (p - (src + hlen)) + csize;
+}
+
+static int read_seq_table(struct fse_table *t, int *valid, int mode,
+		const int16_t *def, int def_nsym, int def_log, int max_log,
+		int max_symbol, const unsigned char **p, const unsigned char *end)
+{
+	ssize_t n;
+
+	switch (mode) {
+	case 0:
+		if (fse_build(t, def, def_nsym, def_log))
+			return -1;
+		break;
+	case 1:
+		if (*p >= end)
+			corrupt("truncated sequence table");
+		if (**p > max_symbol)
+			corrupt("bad RLE sequence symbol");
+		fse_rle(t, **p);
+		(*p)++;
+		break;
+	case 2:
+		n = fse_read_table(t, *p, end - *p, max_log, max_symbol);
+		if (n < 0)
+			return -1;
+		*p += n;
+		break;
+	default:
+		if (!*valid)
+			corrupt("repeated sequence table without a previous one");
+	}
+	*valid = 1;
+	return 0;
+}
+
+static inline void copy_match(unsigned char *dst, size_t offset, size_t len)
+{
+	const unsigned char *src = dst - offset;
+
+	if (offset >= len) {
+		memcpy(dst, src, len);
+		return;
+	}
+	if (offset >= 8) {
+		while (len >= 8) {
+			memcpy(dst, src, 8);
+			dst += 8;
+			src += 8;
+			len -= 8;
+		}
+	}
+	while (len--)
+		*dst++ = *src++;
+}
+
+static int decode_sequences(struct zstd_dctx *d, const unsigned char *src,
+		size_t len)
+{
+	struct zstd_out *o = &d->out;
+	const unsigned char *p = src;
+	const unsigned char *end = src + len;
+	const unsigned char *lit = d->lit;
+	const unsigned char *lit_end = d->lit + d->lit_len;
+	struct bstream bs;
+	unsigned lls, ofs, mls;
+	uint32_t nseq, i;
+	int modes;
+
+	if (p >= end)
+		corrupt("truncated sequences header");
+	nseq = *p++;
+	if (nseq >= 128) {
+		if (nseq < 255) {
+			if (p >= end)
+				corrupt("truncated sequences header");
+			nseq = ((nseq - 128) << 8) + *p++;
+		} else {
+			if (end - p < 2)
+				corrupt("truncated sequences header");
+			nseq = p[0] + (p[1] << 8) + 0x7F00;
+			p += 2;
+		}
+	}
+
+	if (nseq) {
+		if (p >= end)
+			corrupt("truncated sequences header");
+		modes = *p++;
+		if (modes & 3)
+			corrupt("reserved sequence mode bits set");
+
+		if (read_seq_table(&d->ll, &d->ll_valid, modes >> 6,
+					ll_default, LL_MAX_CODE + 1, 6,
+					LL_MAX_LOG, LL_MAX_CODE, &p, end) ||
+				read_seq_table(&d->of, &d->of_valid,
+					(modes >> 4) & 3, of_default, 29, 5,
+					OF_MAX_LOG, OF_MAX_CODE, &p, end) ||
+				read_seq_table(&d->ml, &d->ml_valid,
+					(modes >> 2) & 3, ml_default,
+					ML_MAX_CODE + 1, 6, ML_MAX_LOG,
+					ML_MAX_CODE, &p, end))
+			return -1;
+
+		if (bs_init(&bs, p, end - p))
+			corrupt("bad sequence stream");
+		lls = bs_read(&bs, d->ll.log);
+		ofs = bs_read(&bs, d->of.log);
+		mls = bs_read(&bs, d->ml.log);
+	}
+
+	for (i = 0; i < nseq; i++) {
+		uint8_t of_code = fse_peek(&d->of, ofs);
+		uint8_t ll_code = fse_peek(&d->ll, lls);
+		uint8_t ml_code = fse_peek(&d->ml, mls);
+		uint32_t offset, ll, ml;
+
+		if (of_code > OF_MAX_CODE)
+			corrupt("bad offset code");
+
+		offset = (1U << of_code) + bs_read(&bs, of_code);
+		ml = ml_base[ml_code] + bs_read(&bs, ml_bits[ml_code]);
+		ll = ll_base[ll_code] + bs_read(&bs, ll_bits[ll_code]);
+
+		if (i != nseq - 1) {
+			lls = fse_update(&d->ll, lls, &bs);
+			mls = fse_update(&d->ml, mls, &bs);
+			ofs = fse_update(&d->of, ofs, &bs);
+		}
+
+		if (offset > 3) {
+			offset -= 3;
+			d->rep[2] = d->rep[1];
+			d->rep[1] = d->rep[0];
+			d->rep[0] = offset;
+		} else {
+			uint32_t idx = offset - 1 + (ll == 0);
+
+			if (idx == 0) {
+				offset = d->rep[0];
+			} else {
+				offset = (idx < 3) ? d->rep[idx] : d->rep[0] - 1;
+				if (idx > 1)
+					d->rep[2] = d->rep[1];
+				d->rep[1] = d->rep[0];
+				d->rep[0] = offset;
+			}
+		}
+
+		if (ll > (size_t)(lit_end - lit))
+			corrupt("literal length out of range");
+		if ((size_t)ll + ml > o->cap - o->pos)
+			corrupt("output overflow");
+		memcpy(o->buf + o->pos, lit, ll);
+		lit += ll;
+		o->pos += ll;
+
+		if (!offset || offset > o->pos)
+			corrupt("match offset out of range");
+		copy_match(o->buf + o->pos, offset, ml);
+		o->pos += ml;
+	}
+
+	if (nseq && bs.pos != 0)
+		corrupt("sequence stream size mismatch");
+
+	if ((size_t)(lit_end - lit) > o->cap - o->pos)
+		corrupt("output overflow");
+	memcpy(o->buf + o->pos, lit, lit_end - lit);
+	o->pos += lit_end - lit;
+	return 0;
+}
+
+static int out_flush(struct zstd_out *o)
+{
+	if (o->fn && o->pos > o->flushed) {
+		if (o->fn(o->arg, o->buf + o->flushed, o->pos - o->flushed))
+			return -1;
+		o->flushed = o->pos;
+	}
+	return 0;
+}
+
+/* Make room for one more block of output, keeping a window's worth of
+ * history for back references */
+static int out_reserve(struct zstd_out *o)
+{
+	size_t keep;
+
+	if (!o->fn || o->cap - o->pos >= BLOCK_MAX)
+		return 0;
+	if (out_flush(o))
+		return -1;
+	keep = (o->pos > o->window) ? o->window : o->pos;
+	memmove(o->buf, o->buf + o->pos - keep, keep);
+	o->pos = keep;
+	o->flushed = keep;
+	return 0;
+}
+
+int zstd_frame_info(const unsigned char *src, size_t len,
+		struct zstd_frame_info *fi)
+{
+	static const int dict_bytes[4] = { 0, 1, 2, 4 };
+	int fhd, single, fcs_bytes, pos = 5;
+	uint64_t dict_id;
+
+	if (len < 5 || le32(src) != ZSTD_MAGIC)
+		corrupt("bad frame magic");
+
+	fhd = src[4];
+	if (fhd & 0x08)
+		corrupt("reserved frame header bit set");
+	single = (fhd >> 5) & 1;
+	fi->has_checksum = (fhd >> 2) & 1;
+	switch (fhd >> 6) {
+	case 0:
+		fcs_bytes = single ? 1 : 0;
+		break;
+	case 1:
+		fcs_bytes = 2;
+		break;
+	case 2:
+		fcs_bytes = 4;
+		break;
+	default:
+		fcs_bytes = 8;
+	}
+
+	if (len < (size_t)(pos + !single + dict_bytes[fhd & 3] + fcs_bytes))
+		corrupt("truncated frame header");
+
+	if (!single) {
+		int wd = src[pos++];
+		uint64_t base = 1ULL << (10 + (wd >> 3));
+
+		fi->window_size = base + (base >> 3) * (wd & 7);
+	}
+
+	dict_id = le_n(src + pos, dict_bytes[fhd & 3]);
+	pos += dict_bytes[fhd & 3];
+	if (dict_id)
+		corrupt("dictionaries are not supported");
+
+	fi->has_content_size = fcs_bytes != 0;
+	fi->content_size = le_n(src + pos, fcs_bytes);
+	if (fcs_bytes == 2)
+		fi->content_size += 256;
+	pos += fcs_bytes;
+
+	if (single)
+		fi->window_size = fi->content_size;
+	fi->header_len = pos;
+	return 0;
+}
+
+ssize_t zstd_frame_size(const unsigned char *src, size_t len)
+{
+	struct zstd_frame_info fi;
+	size_t pos;
+	uint32_t bh;
+
+	if (len >= 8 && (le32(src) & ZSTD_SKIPPABLE_MASK) ==
+			ZSTD_SKIPPABLE_MAGIC) {
+		pos = 8 + (size_t)le32(src + 4);
+		return (pos <= len) ? (ssize_t)pos : -1;
+	}
+
+	if (zstd_frame_info(src, len, &fi))
+		return -1;
+
+	pos = fi.header_len;
+	do {
+		if (len - pos < 3)
+			return -1;
+		bh = src[pos] | (src[pos + 1] << 8) | (src[pos + 2] << 16);
+		pos += 3;
+		switch ((bh >> 1) & 3) {
+		case 1:
+			pos += 1;
+			break;
+		case 3:
+			return -1;
+		default:
+			pos += bh >> 3;
+		}
+		if (pos > len)
+			return -1;
+	} while (!(bh & 1));
+
+	if (fi.has_checksum)
+		pos += 4;
+	return (pos <= len) ? (ssize_t)pos : -1;
+}
+
+static int decode_frame(struct zstd_dctx *d, const struct zstd_frame_info *fi,
+		const unsigned char *src, size_t len)
+{
+	struct zstd_out *o = &d->out;
+	const unsigned char *p = src + fi->header_len;
+	const unsigned char *end = src + len;
+	size_t block_max, bsize, start;
+	uint32_t bh;
+	int last, type;
+
+	block_max = (fi->window_size < BLOCK_MAX) ?
+		fi->window_size : BLOCK_MAX;
+	d->rep[0] = 1;
+	d->rep[1] = 4;
+	d->rep[2] = 8;
+	d->huf_valid = d->ll_valid = d->of_valid = d->ml_valid = 0;
+	d->total = 0;
+	xxh64_reset(&d->xxh, 0);
+
+	do {
+		if (end - p < 3)
+			corrupt("truncated block header");
+		bh = p[0] | (p[1] << 8) | (p[2] << 16);
+		p += 3;
+		last = bh & 1;
+		type = (bh >> 1) & 3;
+		bsize = bh >> 3;
+
+		if (bsize > block_max)
+			corrupt("block too large");
+		if (out_reserve(o))
+			return -1;
+		start = o->pos;
+
+		switch (type) {
+		case 0:
+			if ((size_t)(end - p) < bsize)
+				corrupt("truncated raw block");
+			if (bsize > o->cap - o->pos)
+				corrupt("output overflow");
+			memcpy(o->buf + o->pos, p, bsize);
+			o->pos += bsize;
+			p += bsize;
+			break;
+		case 1:
+			if (p >= end)
+				corrupt("truncated RLE block");
+			if (bsize > o->cap - o->pos)
+				corrupt("output overflow");
+			memset(o->buf + o->pos, *p, bsize);
+			o->pos += bsize;
+			p++;
+			break;
+		case 2: {
+			ssize_t n;
+
+			if ((size_t)(end - p) < bsize || !bsize)
+				corrupt("truncated compressed block");
+			n = decode_literals(d, p, bsize);
+			if (n < 0 || decode_sequences(d, p + n, bsize - n))
+				return -1;
+			p += bsize;
+			break;
+		}
+		default:
+			corrupt("reserved block type");
+		}
+
+		if (fi->has_checksum)
+			xxh64_update(&d->xxh, o->buf + start, o->pos - start);
+		d->total += o->pos - start;
+	} while (!last);
+
+	if (out_flush(o))
+		return -1;
+
+	if (fi->has_checksum) {
+		if (end - p < 4)
+			corrupt("truncated checksum");
+		if (le32(p) != (uint32_t)xxh64_digest(&d->xxh))
+			corrupt("content checksum mismatch");
+	}
+	if (fi->has_content_size && d->total != fi->content_size)
+		corrupt("content size mismatch");
+	return 0;
+}
+
+int zstd_decompress_frame(const unsigned char *src, size_t len,
+		unsigned char *dst, size_t cap, size_t *out_len)
+{
+	struct zstd_frame_info fi;
+	struct zstd_dctx *d;
+	int ret;
+
+	if (zstd_frame_info(src, len, &fi))
+		return -1;
+
+	d = malloc(sizeof(*d));
+	if (!d) {
+		pr_error("zstd: out of memory\n");
+		return -1;
+	}
+	d->out.buf = dst;
+	d->out.cap = cap;
+	d->out.pos = 0;
+	d->out.flushed = 0;
+	d->out.window = fi.window_size;
+	d->out.fn = NULL;
+	d->out.arg = NULL;
+
+	ret = decode_frame(d, &fi, src, len);
+	*out_len = d->out.pos;
+	free(d);
+	return ret;
+}
+
+int zstd_decompress_frame_stream(const unsigned char *src, size_t len,
+		int (*fn)(void *arg, const unsigned char *buf, size_t len),
+		void *arg)
+{
+	struct zstd_frame_info fi;
+	struct zstd_dctx *d;
+	unsigned char *buf;
+	size_t cap;
+	int ret;
+
+	if (zstd_frame_info(src, len, &fi))
+		return -1;
+	if (fi.window_size > ZSTD_WINDOW_MAX) {
+		pr_error("zstd: window of %llu bytes is too large\n",
+				(unsigned long long)fi.window_size);
+		return -1;
+	}
+
+	cap = 2 * fi.window_size + BLOCK_MAX;
+	buf = malloc(cap);
+	d = malloc(sizeof(*d));
+	if (!buf || !d) {
+		pr_error("zstd: out of memory\n");
+		free(buf);
+		free(d);
+		return -1;
+	}
+	d->out.buf = buf;
+	d->out.cap = cap;
+	d->out.pos = 0;
+	d->out.flushed = 0;
+	d->out.window = fi.window_size;
+	d->out.fn = fn;
+	d->out.arg = arg;
+
+	ret = decode_frame(d, &fi, src, len);
+	free(d);
+	free(buf);
+	return ret;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DROIDBOOT_ZSTD_H
+#define DROIDBOOT_ZSTD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Minimal Zstandard frame decoder (RFC 8878). Dictionaries are not
+ * supported. */
+
+#define ZSTD_MAGIC		0xFD2FB528
+#define ZSTD_SKIPPABLE_MAGIC	0x184D2A50
+#define ZSTD_SKIPPABLE_MASK	0xFFFFFFF0
+
+/* Largest window we are willing to allocate when streaming */
+#define ZSTD_WINDOW_MAX		(1 << 27)
+
+struct zstd_frame_info {
+	uint64_t content_size;
+	int has_content_size;
+	uint64_t window_size;
+	int has_checksum;
+	size_t header_len;
+};
+
+/* Parse the header of the frame at src */
+int zstd_frame_info(const unsigned char *src, size_t len,
+		struct zstd_frame_info *fi);
+
+/* Size of the frame (of any kind, including skippable frames) at src,
+ * found by walking the block headers. Returns -1 if truncated. */
+ssize_t zstd_frame_size(const unsigned char *src, size_t len);
+
+/* Decode the frame at src into dst, which must be large enough for the
+ * whole frame's content */
+int zstd_decompress_frame(const unsigned char *src, size_t len,
+		unsigned char *dst, size_t cap, size_t *out_len);
+
+/* Decode the frame at src with a window-sized buffer, handing the output
+ * to fn in order as it is produced */
+int zstd_decompress_frame_stream(const unsigned char *src, size_t len,
+		int (*fn)(void *arg, const unsigned char *buf, size_t len),
+		void *arg);
+
+#endif